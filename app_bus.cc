@@ -9,57 +9,489 @@
 
 #include "app_bus.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 
 namespace node_app {
 
-class AppBus::EventLock {
+/**
+ * Open-addressing hash table with string keys.
+ * Lookups take a pointer and length, so no std::string is built per emit.
+ * Published registries are never modified; writers change a copy.
+ */
+template<class T>
+class StringTable {
+ public:
+  const T *find(const char *key, size_t length) const {
+    if (slots_.empty()) {
+      return nullptr;
+    }
+    size_t hash = hashOf(key, length);
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      int32_t index = slots_[i];
+      if (index < 0) {
+        return nullptr;
+      }
+      const Entry &entry = entries_[index];
+      if (entry.hash == hash && entry.key.length() == length && memcmp(entry.key.data(), key, length) == 0) {
+        return &entry.value;
+      }
+    }
+  }
+
+  const T *find(const char *key) const {
+    return find(key, strlen(key));
+  }
+
+  void set(const char *key, size_t length, T value) {
+    size_t hash = hashOf(key, length);
+    for (auto iter = entries_.begin(); iter != entries_.end(); iter++) {
+      if (iter->hash == hash && iter->key.length() == length && memcmp(iter->key.data(), key, length) == 0) {
+        iter->value = std::move(value);
+        return;
+      }
+    }
+    entries_.push_back({std::string(key, length), hash, std::move(value)});
+    rehash();
+  }
+
+  void set(const char *key, T value) {
+    set(key, strlen(key), std::move(value));
+  }
+
+  void erase(const char *key, size_t length) {
+    size_t hash = hashOf(key, length);
+    for (auto iter = entries_.begin(); iter != entries_.end(); iter++) {
+      if (iter->hash == hash && iter->key.length() == length && memcmp(iter->key.data(), key, length) == 0) {
+        entries_.erase(iter);
+        rehash();
+        return;
+      }
+    }
+  }
+
+  template<class F>
+  void forEach(F func) const {
+    for (auto iter = entries_.begin(); iter != entries_.end(); iter++) {
+      func(iter->key, iter->value);
+    }
+  }
+
  private:
-  std::unique_lock<std::recursive_timed_mutex> lock_;
-  EventHolder *holder_;
+  struct Entry {
+    std::string key;
+    size_t hash;
+    T value;
+  };
 
- public:
-  bool alive() const {
-    return holder_ != NULL;
+  std::vector<Entry> entries_;
+  std::vector<int32_t> slots_;
+
+  static size_t hashOf(const char *key, size_t length) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+      hash ^= (uint8_t) key[i];
+      hash *= 1099511628211ULL;
+    }
+    return (size_t) hash;
+  }
+
+  void rehash() {
+    size_t capacity = 8;
+    while (capacity < entries_.size() * 2) capacity <<= 1;
+    slots_.assign(capacity, -1);
+    size_t mask = capacity - 1;
+    for (size_t index = 0; index < entries_.size(); index++) {
+      size_t i = entries_[index].hash & mask;
+      while (slots_[i] >= 0) i = (i + 1) & mask;
+      slots_[i] = (int32_t) index;
+    }
   }
+};
 
-  EventHolder *holder() const {
-    return holder_;
+/**
+ * Wildcard keys compiled into a trie of segments.
+ * Segments are separated by '.' or '/'. '*' or '+' matches one segment;
+ * '#' or '**' as the last segment matches any number of them, including none.
+ * Matching visits one node per segment and wildcard branch, independent of
+ * the number of patterns.
+ */
+template<class T>
+class TopicTrie {
+ public:
+  static bool isPattern(const char *key, size_t length) {
+    for (size_t pos = 0; pos <= length;) {
+      size_t end = segmentEnd(key, length, pos);
+      if (isSingleWildcard(key + pos, end - pos) || (end == length && isMultiWildcard(key + pos, end - pos))) {
+        return true;
+      }
+      pos = end + 1;
+    }
+    return false;
   }
 
-  EventLock(AppBus *cls, const char *event_key, bool create_if_not_exists)
-      : holder_(nullptr) {
-    std::unique_lock<std::recursive_timed_mutex> lock_map(cls->mutex_);
-    auto map_iter = cls->event_map_.find(event_key);
-    if (map_iter == cls->event_map_.end()) {
-      if (!create_if_not_exists) {
+  void insert(const char *key, size_t length, T value) {
+    Node *node = &root_;
+    for (size_t pos = 0;;) {
+      size_t end = segmentEnd(key, length, pos);
+      const char *segment = key + pos;
+      size_t segment_length = end - pos;
+      if (end == length && isMultiWildcard(segment, segment_length)) {
+        node->rest.push_back(std::move(value));
         return;
       }
-      std::unique_ptr<EventHolder> new_holder(new EventHolder());
-      holder_ = new_holder.get();
-      cls->event_map_.emplace(event_key, std::move(new_holder));
-    } else {
-      holder_ = map_iter->second.get();
+      if (isSingleWildcard(segment, segment_length)) {
+        if (!node->one) {
+          node->one.reset(new Node());
+        }
+        node = node->one.get();
+      } else {
+        const std::unique_ptr<Node> *found = node->children.find(segment, segment_length);
+        if (found) {
+          node = found->get();
+        } else {
+          Node *child = new Node();
+          node->children.set(segment, segment_length, std::unique_ptr<Node>(child));
+          node = child;
+        }
+      }
+      if (end == length) {
+        node->values.push_back(std::move(value));
+        return;
+      }
+      pos = end + 1;
+    }
+  }
+
+  template<class F>
+  void match(const char *key, size_t length, F &func) const {
+    matchNode(&root_, key, length, 0, func);
+  }
+
+ private:
+  struct Node {
+    StringTable<std::unique_ptr<Node>> children;
+    std::unique_ptr<Node> one;
+    std::vector<T> values;
+    std::vector<T> rest;
+  };
+
+  Node root_;
+
+  static size_t segmentEnd(const char *key, size_t length, size_t pos) {
+    while (pos < length && key[pos] != '.' && key[pos] != '/') pos++;
+    return pos;
+  }
+
+  static bool isSingleWildcard(const char *segment, size_t length) {
+    return length == 1 && (segment[0] == '*' || segment[0] == '+');
+  }
+
+  static bool isMultiWildcard(const char *segment, size_t length) {
+    return (length == 1 && segment[0] == '#') || (length == 2 && segment[0] == '*' && segment[1] == '*');
+  }
+
+  // pos is past the end once every segment has been consumed
+  template<class F>
+  static void matchNode(const Node *node, const char *key, size_t length, size_t pos, F &func) {
+    for (auto iter = node->rest.begin(); iter != node->rest.end(); iter++) {
+      func(*iter);
+    }
+    if (pos > length) {
+      for (auto iter = node->values.begin(); iter != node->values.end(); iter++) {
+        func(*iter);
+      }
+      return;
+    }
+    size_t end = segmentEnd(key, length, pos);
+    const std::unique_ptr<Node> *child = node->children.find(key + pos, end - pos);
+    if (child) {
+      matchNode(child->get(), key, length, end + 1, func);
+    }
+    if (node->one) {
+      matchNode(node->one.get(), key, length, end + 1, func);
+    }
+  }
+};
+
+struct AppBus::Registry {
+  StringTable<std::shared_ptr<const EventEntry>> events;
+  StringTable<std::shared_ptr<RequestHandlerHolder>> requests;
+  StringTable<std::shared_ptr<StreamHandlerHolder>> streams;
+  // Wildcard keys of events, rebuilt by publishRegistry()
+  std::shared_ptr<const TopicTrie<std::shared_ptr<const EventEntry>>> topics;
+  // Entries matching each interned key, rebuilt by publishRegistry()
+  std::vector<std::vector<std::shared_ptr<const EventEntry>>> event_ids;
+  // Whether any entry has a schema, set by publishRegistry()
+  bool has_schemas;
+
+  Registry() : has_schemas(false) {}
+
+  /**
+   * Calls func with the entry of key and with every wildcard entry matching it.
+   */
+  template<class F>
+  void forEachEntry(const char *key, size_t length, F func) const {
+    const std::shared_ptr<const EventEntry> *found = events.find(key, length);
+    if (found) {
+      func(**found);
+    }
+    if (topics) {
+      // A wildcard key emitted literally is already handled above
+      const EventEntry *exact = found ? found->get() : nullptr;
+      auto match = [exact, &func](const std::shared_ptr<const EventEntry> &entry) -> void {
+        if (entry.get() != exact) {
+          func(*entry);
+        }
+      };
+      topics->match(key, length, match);
+    }
+  }
+
+  template<class F>
+  void forEachEntry(EventId event_id, F func) const {
+    if (event_id >= event_ids.size()) {
+      return;
+    }
+    const std::vector<std::shared_ptr<const EventEntry>> &entries = event_ids[event_id];
+    for (auto iter = entries.begin(); iter != entries.end(); iter++) {
+      func(**iter);
+    }
+  }
+};
+
+/**
+ * Registry last seen by this thread. Emits only compare registry_version_
+ * with it, so they share no lock with each other. The snapshot is held
+ * weakly between emits: an idle thread keeps no removed handler alive.
+ */
+struct AppBus::RegistryCache {
+  uint64_t instance_id;
+  uint64_t version;
+  std::weak_ptr<const Registry> weak;
+  // Held while pinned, that is while any RegistryRef borrows it
+  std::shared_ptr<const Registry> registry;
+  int pins;
+
+  RegistryCache() : instance_id(0), version(0), pins(0) {}
+};
+
+thread_local AppBus::RegistryCache AppBus::registry_cache_;
+
+static std::atomic<uint64_t> next_instance_id(0);
+
+/**
+ * A registry snapshot, borrowed from the thread's cache or owned when the
+ * cache is pinned by an outer emit on this thread.
+ */
+class AppBus::RegistryRef {
+ public:
+  explicit RegistryRef(RegistryCache *cache) : cache_(cache), registry_(cache->registry.get()) {
+    cache_->pins++;
+  }
+  explicit RegistryRef(std::shared_ptr<const Registry> owned)
+      : cache_(nullptr), owned_(std::move(owned)), registry_(owned_.get()) {}
+  RegistryRef(RegistryRef &&other)
+      : cache_(other.cache_), owned_(std::move(other.owned_)), registry_(other.registry_) {
+    other.cache_ = nullptr;
+  }
+  RegistryRef(const RegistryRef &) = delete;
+  RegistryRef &operator=(const RegistryRef &) = delete;
+  ~RegistryRef() {
+    if (cache_ && --cache_->pins == 0) {
+      cache_->registry.reset();
+    }
+  }
+
+  const Registry *operator->() const { return registry_; }
+  const Registry &operator*() const { return *registry_; }
+
+ private:
+  RegistryCache *cache_;
+  std::shared_ptr<const Registry> owned_;
+  const Registry *registry_;
+};
+
+struct AppBus::LoopTask {
+  LoopTask *next_;
+  LoopTask() : next_(nullptr) {}
+  virtual ~LoopTask() {}
+  virtual void run() = 0;
+};
+
+struct AppBus::EventDelivery : LoopTask {
+  std::shared_ptr<EventMessage> message_;
+  std::shared_ptr<EventHandlerHolder> handler_;
+
+  EventDelivery(std::shared_ptr<EventMessage> message, std::shared_ptr<EventHandlerHolder> handler)
+      : message_(std::move(message)), handler_(std::move(handler)) {}
+
+  void run() override {
+    handler_->dispatch(message_);
+  }
+};
+
+/**
+ * Runs the messages waiting in a bounded handler's mailbox.
+ */
+struct AppBus::MailboxDrain : LoopTask {
+  std::shared_ptr<EventHandlerHolder> handler_;
+
+  MailboxDrain(std::shared_ptr<EventHandlerHolder> handler)
+      : handler_(std::move(handler)) {}
+
+  void run() override {
+    std::deque<std::shared_ptr<EventMessage>> messages;
+    {
+      std::unique_lock<std::mutex> lock(handler_->mailbox_mutex_);
+      messages.swap(handler_->mailbox_);
+      handler_->mailbox_scheduled_ = false;
     }
-    lock_ = std::unique_lock<std::recursive_timed_mutex>(holder_->mutex);
+    handler_->mailbox_space_.notify_all();
+    for (auto iter = messages.begin(); iter != messages.end(); iter++) {
+      handler_->dispatch(*iter);
+    }
+  }
+};
+
+/**
+ * Events of one Batch bound for the same loop and lane, in emit order.
+ */
+struct AppBus::BatchDelivery : LoopTask {
+  Priority priority_;
+  std::vector<std::pair<std::shared_ptr<EventHandlerHolder>, std::shared_ptr<EventMessage>>> deliveries_;
+
+  BatchDelivery(Priority priority) : priority_(priority) {}
+
+  void run() override;
+};
+
+/**
+ * A JS function and the context it was registered in.
+ * Must be destroyed on the isolate thread, see disposeV8Callback().
+ */
+struct AppBus::V8Callback {
+  v8::Isolate *isolate_;
+  uv_thread_t thread_;
+  v8::Global<v8::Function> func_;
+  v8::Global<v8::Context> context_;
+  node::async_context async_context_;
+
+  V8Callback(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::Function> func, const char *name)
+      : isolate_(isolate), thread_(uv_thread_self()), func_(isolate, func), context_(isolate, context),
+        async_context_(node::EmitAsyncInit(isolate, v8::Object::New(isolate), name)) {}
+
+  ~V8Callback() {
+    node::EmitAsyncDestroy(isolate_, async_context_);
+  }
+
+  bool onOwnThread() const {
+    uv_thread_t self = uv_thread_self();
+    return uv_thread_equal(&self, &thread_) != 0;
+  }
+};
+
+/**
+ * Async resource of callbacks that have no V8Callback, such as the
+ * handlers set on stream and ring objects. Isolate thread only.
+ */
+struct V8AsyncContext {
+  v8::Isolate *isolate_;
+  node::async_context async_context_;
+
+  V8AsyncContext(v8::Isolate *isolate, const char *name)
+      : isolate_(isolate), async_context_(node::EmitAsyncInit(isolate, v8::Object::New(isolate), name)) {}
+
+  ~V8AsyncContext() {
+    node::EmitAsyncDestroy(isolate_, async_context_);
   }
 };
 
+struct AppBus::V8DisposeTask : LoopTask {
+  std::unique_ptr<V8Callback> callback_;
+
+  V8DisposeTask(std::unique_ptr<V8Callback> callback)
+      : callback_(std::move(callback)) {}
+
+  void run() override {}
+};
+
 struct AppBus::HostEventHandlerHolder : EventHandlerHolder {
   EventHandler_t func_;
 
-  HostEventHandlerHolder(uv_loop_t *loop, EventHandler_t func)
-      : EventHandlerHolder(loop), func_(func) {}
+  HostEventHandlerHolder(uv_loop_t *loop, std::shared_ptr<LoopQueue> queue, EventHandler_t func)
+      : EventHandlerHolder(loop, std::move(queue)), func_(func) {}
+
+  void handle(std::shared_ptr<EventMessage> message) override;
+};
+
+struct AppBus::HostBinaryEventHandlerHolder : EventHandlerHolder {
+  BinaryEventHandler_t func_;
+
+  HostBinaryEventHandlerHolder(uv_loop_t *loop, std::shared_ptr<LoopQueue> queue, BinaryEventHandler_t func)
+      : EventHandlerHolder(loop, std::move(queue)), func_(func) {}
+
+  void handle(std::shared_ptr<EventMessage> message) override;
+};
+
+struct AppBus::HostJsonTextHandlerHolder : EventHandlerHolder {
+  JsonTextHandler_t func_;
+
+  HostJsonTextHandlerHolder(uv_loop_t *loop, std::shared_ptr<LoopQueue> queue, JsonTextHandler_t func)
+      : EventHandlerHolder(loop, std::move(queue)), func_(std::move(func)) {}
+
+  int formats() const override { return kTakesJsonText; }
 
   void handle(std::shared_ptr<EventMessage> message) override;
 };
 
+struct AppBus::HostRecordHandlerHolder : EventHandlerHolder {
+  const void *type_;
+  std::function<void(const void *record)> func_;
+
+  HostRecordHandlerHolder(uv_loop_t *loop,
+                          std::shared_ptr<LoopQueue> queue,
+                          const void *type,
+                          std::function<void(const void *record)> func)
+      : EventHandlerHolder(loop, std::move(queue)), type_(type), func_(std::move(func)) {}
+
+  int formats() const override { return kTakesRecords; }
+
+  void handle(std::shared_ptr<EventMessage> message) override {
+    if (message->record && message->schema->type_ == type_) {
+      func_(message->record.get());
+    }
+  }
+};
+
 struct AppBus::V8EventHandlerHolder : EventHandlerHolder {
-  v8::Persistent<v8::Function> vpfunc_;
+  v8::Isolate *isolate_;
+  std::unique_ptr<V8Callback> callback_;
+
+  V8EventHandlerHolder(uv_loop_t *loop,
+                       std::shared_ptr<LoopQueue> queue,
+                       v8::Isolate *isolate,
+                       v8::Local<v8::Context> context,
+                       v8::Local<v8::Function> func)
+      : EventHandlerHolder(loop, std::move(queue)), isolate_(isolate),
+        callback_(new V8Callback(isolate, context, func, "AppBus.emit")) {}
 
-  V8EventHandlerHolder(uv_loop_t *loop, v8::Isolate *isolate, v8::Local<v8::Function> func)
-      : EventHandlerHolder(loop), vpfunc_(isolate, func) {}
+  ~V8EventHandlerHolder() override {
+    disposeV8Callback(std::move(callback_), queue());
+  }
+
+  v8::Isolate *isolate() const override { return isolate_; }
+  int formats() const override { return kTakesJson | kTakesRecords | kTakesJsonText; }
+
+  void release() override {
+    callback_.reset();
+  }
 
   void handle(std::shared_ptr<EventMessage> message) override;
 };
@@ -68,191 +500,3985 @@ struct AppBus::HostRequestHandlerHolder : RequestHandlerHolder {
   AppBus *appbus_;
   RequestHandler_t func_;
 
-  HostRequestHandlerHolder(AppBus *appbus, uv_loop_t *loop, RequestHandler_t func)
-      : appbus_(appbus), RequestHandlerHolder(loop), func_(func) {}
+  HostRequestHandlerHolder(AppBus *appbus, uv_loop_t *loop, std::shared_ptr<LoopQueue> queue, RequestHandler_t func)
+      : appbus_(appbus), RequestHandlerHolder(loop, std::move(queue)), func_(func) {}
+
+  void handle(std::shared_ptr<RequestMessage> message) override;
+};
+
+struct AppBus::V8RequestHandlerHolder : RequestHandlerHolder, std::enable_shared_from_this<V8RequestHandlerHolder> {
+  AppBus *appbus_;
+  std::unique_ptr<V8Callback> callback_;
+
+  V8RequestHandlerHolder(AppBus *appbus,
+                         uv_loop_t *loop,
+                         std::shared_ptr<LoopQueue> queue,
+                         v8::Isolate *isolate,
+                         v8::Local<v8::Context> context,
+                         v8::Local<v8::Function> func)
+      : appbus_(appbus), RequestHandlerHolder(loop, std::move(queue)),
+        callback_(new V8Callback(isolate, context, func, "AppBus.request")) {}
+
+  ~V8RequestHandlerHolder() override {
+    disposeV8Callback(std::move(callback_), queue());
+  }
+
+  void release() override {
+    callback_.reset();
+  }
+
+  void handle(std::shared_ptr<RequestMessage> message) override;
+  // Calls the JS handler on the loop thread
+  void invoke(const std::shared_ptr<RequestMessage> &message);
+};
+
+struct AppBus::RequestDelivery : LoopTask {
+  std::shared_ptr<V8RequestHandlerHolder> handler_;
+  std::shared_ptr<RequestMessage> message_;
+
+  RequestDelivery(std::shared_ptr<V8RequestHandlerHolder> handler, std::shared_ptr<RequestMessage> message)
+      : handler_(std::move(handler)), message_(std::move(message)) {}
+
+  void run() override {
+    handler_->invoke(message_);
+  }
+};
+
+/**
+ * A request made by the host through AppBus::request().
+ * The timer lives on the handler's loop and holds a reference while open;
+ * it is only touched from that loop's thread.
+ */
+struct AppBus::OutgoingRequest : std::enable_shared_from_this<AppBus::OutgoingRequest> {
+  AppBus *appbus_;
+  RequestId id_;
+  // Loop of the handler the request went to, and its queue
+  uv_loop_t *loop_;
+  std::shared_ptr<LoopQueue> queue_;
+  uint64_t timeout_ms_;
+  ResponseHandler_t callback_;
+  std::atomic<bool> done_;
+
+  // Loop thread only
+  uv_timer_t timer_;
+  std::shared_ptr<OutgoingRequest> timer_ref_;
+
+  OutgoingRequest(AppBus *appbus,
+                  RequestId id,
+                  uv_loop_t *loop,
+                  std::shared_ptr<LoopQueue> queue,
+                  uint64_t timeout_ms,
+                  ResponseHandler_t callback)
+      : appbus_(appbus), id_(id), loop_(loop), queue_(std::move(queue)), timeout_ms_(timeout_ms),
+        callback_(std::move(callback)), done_(false) {}
+
+  bool complete(const rapidjson::Document &retval, bool is_throw) {
+    if (!finish()) {
+      return false;
+    }
+    callback_(retval, is_throw);
+    return true;
+  }
+
+  /**
+   * Marks the request done and closes its timer. Returns false if it was
+   * already done.
+   */
+  bool finish();
+
+  void startTimer(std::shared_ptr<OutgoingRequest> self) {
+    if (done_.load(std::memory_order_acquire)) {
+      return;
+    }
+    timer_ref_ = std::move(self);
+    uv_timer_init(loop_, &timer_);
+    timer_.data = this;
+    uv_unref((uv_handle_t *) &timer_);
+    uv_timer_start(&timer_, timerCallback, timeout_ms_, 0);
+  }
+
+  void closeTimer() {
+    if (!timer_ref_ || uv_is_closing((uv_handle_t *) &timer_)) {
+      return;
+    }
+    uv_timer_stop(&timer_);
+    uv_close((uv_handle_t *) &timer_, [](uv_handle_t *handle) {
+      OutgoingRequest *pthis = (OutgoingRequest *) (handle->data);
+      std::shared_ptr<OutgoingRequest> self = std::move(pthis->timer_ref_);
+    });
+  }
+
+  static void timerCallback(uv_timer_t *handle);
+};
+
+struct AppBus::RequestTimeout : LoopTask {
+  std::shared_ptr<OutgoingRequest> request_;
+
+  RequestTimeout(std::shared_ptr<OutgoingRequest> request) : request_(std::move(request)) {}
+
+  void run() override {
+    OutgoingRequest *request = request_.get();
+    request->startTimer(std::move(request_));
+  }
+};
+
+// Closes the timer of a request finished off its handler's loop thread
+struct AppBus::RequestTimerClose : LoopTask {
+  std::shared_ptr<OutgoingRequest> request_;
+
+  RequestTimerClose(std::shared_ptr<OutgoingRequest> request) : request_(std::move(request)) {}
+
+  void run() override {
+    request_->closeTimer();
+  }
+};
+
+static std::atomic<size_t> json_key_cache_limit(1024);
+static const size_t kMaxCachedKeyLength = 64;
+
+/**
+ * Internalized strings of JSON object keys in one isolate.
+ * Fills up to json_key_cache_limit keys, then only serves those.
+ * Also keeps Object.prototype of the context objects were last built in.
+ */
+struct JsonKeyCache {
+  StringTable<uint32_t> index;
+  std::vector<v8::Global<v8::String>> strings;
+  v8::Global<v8::Context> context;
+  v8::Global<v8::Value> prototype;
+};
+
+/**
+ * Object template and internalized field names of a schema in one isolate.
+ */
+struct AppBus::SchemaCache {
+  v8::Global<v8::ObjectTemplate> templ;
+  std::vector<v8::Global<v8::String>> names;
+};
+
+/**
+ * One long-lived async handle per target loop.
+ * Producers push tasks onto a lock-free stack from any thread and
+ * only the push that finds the stack empty wakes the loop. The loop
+ * thread takes the whole stack at once and runs it in FIFO order.
+ */
+class AppBus::LoopQueue {
+ private:
+  uv_async_t async_;
+  std::atomic<LoopTask *> heads_[kPriorityCount];
+  std::atomic<bool> closed_;
+  // Set by detachLoop() before its handlers are removed
+  std::atomic<bool> detached_;
+  // Orders uv_async_send against uv_close
+  std::mutex send_mutex_;
+  // Keeps the queue alive until the handle is closed
+  std::shared_ptr<LoopQueue> self_;
+
+  struct PendingRequest {
+    v8::Isolate *isolate;
+    v8::Global<v8::Context> context;
+    v8::Global<v8::Promise::Resolver> resolver;
+    std::unique_ptr<V8AsyncContext> async;
+  };
+  // Promises of request() calls made on this loop; loop thread only.
+  std::map<uint64_t, PendingRequest> pending_requests_;
+  uint64_t next_request_id_;
+
+  uv_thread_t thread_;
+  std::atomic<bool> thread_bound_;
+  // The async handle is ref'd while tasks are queued; loop thread only.
+  bool referenced_;
+
+  // Tasks taken off their lane but not yet run, in order; loop thread only.
+  LoopTask *pending_head_[kPriorityCount];
+  LoopTask *pending_tail_[kPriorityCount];
+
+  // Per wakeup limits, 0 for none
+  std::atomic<uint64_t> budget_ns_;
+  std::atomic<size_t> budget_messages_;
+  std::atomic<uint64_t> bulk_budget_ns_;
+
+  // Loop thread only; the counters are read by keyCacheStats()
+  std::map<v8::Isolate *, std::unique_ptr<JsonKeyCache>> key_caches_;
+  std::atomic<uint64_t> key_hits_;
+  std::atomic<uint64_t> key_misses_;
+  std::atomic<size_t> key_count_;
+
+  static void asyncCallback(uv_async_t *handle) {
+    LoopQueue *pthis = (LoopQueue *) (handle->data);
+    pthis->bindToCurrentThread();
+    pthis->ref();
+    pthis->drain();
+  }
+
+  static LoopTask *takeInOrder(LoopTask *list) {
+    LoopTask *reversed = nullptr;
+    while (list) {
+      LoopTask *next = list->next_;
+      list->next_ = reversed;
+      reversed = list;
+      list = next;
+    }
+    return reversed;
+  }
+
+  static void freeList(LoopTask *list) {
+    while (list) {
+      LoopTask *next = list->next_;
+      delete list;
+      list = next;
+    }
+  }
+
+  void freeAll() {
+    for (int i = 0; i < kPriorityCount; i++) {
+      freeList(heads_[i].exchange(nullptr, std::memory_order_acquire));
+    }
+    for (int i = 0; i < kPriorityCount; i++) {
+      freeList(pending_head_[i]);
+      pending_head_[i] = pending_tail_[i] = nullptr;
+    }
+  }
+
+  void wakeup() {
+    std::unique_lock<std::mutex> lock(send_mutex_);
+    if (!closed_.load(std::memory_order_relaxed)) {
+      uv_async_send(&async_);
+    }
+  }
+
+  // Keeps the loop alive until drain() finds every lane empty; loop thread only
+  void ref() {
+    if (!referenced_ && !closed_.load(std::memory_order_relaxed)) {
+      uv_ref((uv_handle_t *) &async_);
+      referenced_ = true;
+    }
+  }
+
+  void unrefIfEmpty() {
+    if (!referenced_) {
+      return;
+    }
+    for (int i = 0; i < kPriorityCount; i++) {
+      if (pending_head_[i] || heads_[i].load(std::memory_order_acquire)) {
+        return;
+      }
+    }
+    uv_unref((uv_handle_t *) &async_);
+    referenced_ = false;
+  }
+
+  // Moves the tasks pushed to a lane behind its pending ones
+  void collect(int lane) {
+    LoopTask *list = takeInOrder(heads_[lane].exchange(nullptr, std::memory_order_acquire));
+    if (!list) {
+      return;
+    }
+    if (pending_tail_[lane]) {
+      pending_tail_[lane]->next_ = list;
+    } else {
+      pending_head_[lane] = list;
+    }
+    while (list->next_) list = list->next_;
+    pending_tail_[lane] = list;
+  }
+
+ public:
+  LoopQueue(uv_loop_t *loop)
+      : closed_(false), detached_(false), next_request_id_(0), thread_bound_(false), referenced_(false),
+        budget_ns_(0), budget_messages_(0), bulk_budget_ns_(4 * 1000 * 1000),
+        key_hits_(0), key_misses_(0), key_count_(0) {
+    for (int i = 0; i < kPriorityCount; i++) {
+      heads_[i].store(nullptr, std::memory_order_relaxed);
+      pending_head_[i] = pending_tail_[i] = nullptr;
+    }
+    memset(&async_, 0, sizeof(async_));
+    uv_async_init(loop, &async_, asyncCallback);
+    async_.data = this;
+    // The bus keeps the loop alive only while deliveries are queued.
+    uv_unref((uv_handle_t *) &async_);
+  }
+
+  ~LoopQueue() {
+    freeAll();
+  }
+
+  void markDetached() {
+    detached_.store(true, std::memory_order_release);
+  }
+
+  bool detached() const {
+    return detached_.load(std::memory_order_acquire);
+  }
+
+  // Records the loop thread; called on it
+  void bindToCurrentThread() {
+    if (!thread_bound_.load(std::memory_order_relaxed)) {
+      thread_ = uv_thread_self();
+      thread_bound_.store(true, std::memory_order_release);
+    }
+  }
+
+  bool onLoopThread() const {
+    if (!thread_bound_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    uv_thread_t self = uv_thread_self();
+    return uv_thread_equal(&self, &thread_) != 0;
+  }
+
+  void push(LoopTask *task, Priority priority = kPriorityNormal) {
+    if (closed_.load(std::memory_order_acquire)) {
+      delete task;
+      return;
+    }
+    std::atomic<LoopTask *> &lane = heads_[priority];
+    LoopTask *head = lane.load(std::memory_order_relaxed);
+    do {
+      task->next_ = head;
+    } while (!lane.compare_exchange_weak(head, task, std::memory_order_release, std::memory_order_relaxed));
+    if (closed_.load(std::memory_order_acquire)) {
+      // Raced with close(): nothing drains the stack any more.
+      freeList(lane.exchange(nullptr, std::memory_order_acquire));
+      return;
+    }
+    if (onLoopThread()) {
+      // uv_ref is not thread-safe; other threads rely on their wakeup
+      // reaching the loop, whose drain() then holds the ref.
+      ref();
+    }
+    if (!head) {
+      wakeup();
+    }
+  }
+
+  /**
+   * Internalized string for a JSON object key; loop thread only.
+   */
+  v8::Local<v8::String> jsonKey(v8::Isolate *isolate, const char *key, size_t length) {
+    size_t limit = json_key_cache_limit.load(std::memory_order_relaxed);
+    if (limit && length <= kMaxCachedKeyLength) {
+      std::unique_ptr<JsonKeyCache> &cache = key_caches_[isolate];
+      if (!cache) {
+        cache.reset(new JsonKeyCache());
+      }
+      const uint32_t *found = cache->index.find(key, length);
+      if (found) {
+        key_hits_.fetch_add(1, std::memory_order_relaxed);
+        return cache->strings[*found].Get(isolate);
+      }
+      key_misses_.fetch_add(1, std::memory_order_relaxed);
+      v8::Local<v8::String> vkey =
+          v8::String::NewFromUtf8(isolate, key, v8::NewStringType::kInternalized, length).ToLocalChecked();
+      if (cache->strings.size() < limit) {
+        cache->index.set(key, length, (uint32_t) cache->strings.size());
+        cache->strings.emplace_back(isolate, vkey);
+        key_count_.fetch_add(1, std::memory_order_relaxed);
+      }
+      return vkey;
+    }
+    key_misses_.fetch_add(1, std::memory_order_relaxed);
+    return v8::String::NewFromUtf8(isolate, key, v8::NewStringType::kInternalized, length).ToLocalChecked();
+  }
+
+  /**
+   * Object.prototype of the current context; loop thread only.
+   */
+  v8::Local<v8::Value> objectPrototype(v8::Isolate *isolate) {
+    std::unique_ptr<JsonKeyCache> &cache = key_caches_[isolate];
+    if (!cache) {
+      cache.reset(new JsonKeyCache());
+    }
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+    if (cache->context.IsEmpty() || cache->context.Get(isolate) != context) {
+      cache->context.Reset(isolate, context);
+      cache->prototype.Reset(isolate, v8::Object::New(isolate)->GetPrototype());
+    }
+    return cache->prototype.Get(isolate);
+  }
+
+  KeyCacheStats keyCacheStats() const {
+    KeyCacheStats stats;
+    stats.hits = key_hits_.load(std::memory_order_relaxed);
+    stats.misses = key_misses_.load(std::memory_order_relaxed);
+    stats.keys = key_count_.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  void setBudget(uint64_t budget_ns, size_t budget_messages, uint64_t bulk_budget_ns) {
+    budget_ns_.store(budget_ns, std::memory_order_relaxed);
+    budget_messages_.store(budget_messages, std::memory_order_relaxed);
+    bulk_budget_ns_.store(bulk_budget_ns, std::memory_order_relaxed);
+  }
+
+  /**
+   * Runs pending tasks highest lane first; high tasks pushed meanwhile go
+   * ahead of the next task. Stops once the wakeup's budget is spent, or
+   * for bulk tasks the bulk budget, and re-arms the async handle so the
+   * rest runs after the loop has polled for I/O.
+   */
+  void drain() {
+    uint64_t budget_ns = budget_ns_.load(std::memory_order_relaxed);
+    size_t budget_messages = budget_messages_.load(std::memory_order_relaxed);
+    uint64_t bulk_budget_ns = bulk_budget_ns_.load(std::memory_order_relaxed);
+    uint64_t start = (budget_ns || bulk_budget_ns) ? uv_hrtime() : 0;
+    uint64_t bulk_start = 0;
+    size_t count = 0;
+
+    for (int i = 0; i < kPriorityCount; i++) {
+      collect(i);
+    }
+    for (;;) {
+      if (heads_[kPriorityHigh].load(std::memory_order_relaxed)) {
+        collect(kPriorityHigh);
+      }
+      int lane = 0;
+      while (lane < kPriorityCount && !pending_head_[lane]) lane++;
+      if (lane == kPriorityCount) {
+        unrefIfEmpty();
+        break;
+      }
+
+      uint64_t now = (count > 0 && (budget_ns || bulk_budget_ns)) ? uv_hrtime() : start;
+      if (lane == kPriorityBulk && !bulk_start) {
+        bulk_start = now;
+      }
+      // At least one task runs per wakeup. The handle stays ref'd until the
+      // lanes are empty, so the re-armed wakeup keeps the loop alive too.
+      if (count > 0 &&
+          ((budget_messages && count >= budget_messages) ||
+              (budget_ns && now - start >= budget_ns) ||
+              (lane == kPriorityBulk && bulk_budget_ns && now - bulk_start >= bulk_budget_ns))) {
+        ref();
+        wakeup();
+        break;
+      }
+
+      LoopTask *task = pending_head_[lane];
+      pending_head_[lane] = task->next_;
+      if (!pending_head_[lane]) pending_tail_[lane] = nullptr;
+      task->run();
+      delete task;
+      count++;
+      if (closed_.load(std::memory_order_relaxed)) {
+        // The task closed the queue, which dropped the rest
+        break;
+      }
+    }
+  }
+
+  /**
+   * Closes the handle on the loop thread and drops pending tasks.
+   * The queue is freed once the handle is closed and no holder refers to it.
+   */
+  static void close(std::shared_ptr<LoopQueue> queue) {
+    {
+      std::unique_lock<std::mutex> lock(queue->send_mutex_);
+      if (queue->closed_.exchange(true)) {
+        return;
+      }
+    }
+    LoopQueue *pthis = queue.get();
+    pthis->self_ = std::move(queue);
+    uv_close((uv_handle_t *) &pthis->async_, [](uv_handle_t *handle) {
+      LoopQueue *pthis = (LoopQueue *) (handle->data);
+      std::shared_ptr<LoopQueue> self = std::move(pthis->self_);
+    });
+    pthis->freeAll();
+    // Abandoned promises stay pending; their handles go away on this thread.
+    pthis->pending_requests_.clear();
+    pthis->abortStreams();
+    pthis->rings_.clear();
+    pthis->schema_caches_.clear();
+    pthis->key_caches_.clear();
+    pthis->key_count_.store(0, std::memory_order_relaxed);
+  }
+
+  struct CloseTask : LoopTask {
+    std::shared_ptr<LoopQueue> queue_;
+
+    CloseTask(std::shared_ptr<LoopQueue> queue) : queue_(std::move(queue)) {}
+
+    void run() override {
+      close(std::move(queue_));
+    }
+  };
+
+  /**
+   * close() from any thread. Off the loop thread it is queued on the high
+   * lane, so it runs on the loop thread ahead of the tasks still pending;
+   * the loop has to run once more for that.
+   */
+  static void closeOnLoop(std::shared_ptr<LoopQueue> queue) {
+    if (queue->onLoopThread()) {
+      close(std::move(queue));
+      return;
+    }
+    LoopQueue *pthis = queue.get();
+    pthis->push(new CloseTask(std::move(queue)), kPriorityHigh);
+  }
+
+  struct StreamEnd {
+    std::weak_ptr<Stream> stream;
+    // Null for host ends
+    v8::Isolate *isolate;
+    v8::Global<v8::Context> context;
+    v8::Global<v8::Object> object;
+    std::unique_ptr<V8AsyncContext> async;
+
+    StreamEnd() : isolate(nullptr) {}
+  };
+  // Stream ends on this loop keyed by (stream id, is writer); loop thread only.
+  std::map<std::pair<uint64_t, bool>, StreamEnd> streams_;
+
+  void abortStreams();
+
+  struct RingEnd {
+    v8::Isolate *isolate;
+    v8::Global<v8::Context> context;
+    v8::Global<v8::Object> object;
+    std::unique_ptr<V8AsyncContext> async;
+  };
+  // JS consumers of rings keyed by ring id; loop thread only.
+  std::map<uint64_t, RingEnd> rings_;
+
+  // Keyed by schema id; loop thread only.
+  std::map<std::pair<uint64_t, v8::Isolate *>, std::unique_ptr<SchemaCache>> schema_caches_;
+
+  uint64_t addPendingRequest(v8::Isolate *isolate,
+                             v8::Local<v8::Context> context,
+                             v8::Local<v8::Promise::Resolver> resolver) {
+    uint64_t id = ++next_request_id_;
+    PendingRequest &pending = pending_requests_[id];
+    pending.isolate = isolate;
+    pending.context.Reset(isolate, context);
+    pending.resolver.Reset(isolate, resolver);
+    pending.async.reset(new V8AsyncContext(isolate, "AppBus.request"));
+    return id;
+  }
+
+  void settleRequest(uint64_t id, const rapidjson::Value &retval, bool is_throw);
+};
+
+static void makeRequestError(rapidjson::Document &error, const char *code, int err, const char *message) {
+  error.SetObject();
+  error.AddMember("code", rapidjson::StringRef(code), error.GetAllocator());
+  error.AddMember("errno", err, error.GetAllocator());
+  error.AddMember("message", rapidjson::StringRef(message), error.GetAllocator());
+}
+
+bool AppBus::OutgoingRequest::finish() {
+  if (done_.exchange(true)) {
+    return false;
+  }
+  appbus_->forgetRequest(id_);
+  if (timeout_ms_ > 0) {
+    if (queue_->onLoopThread()) {
+      closeTimer();
+    } else {
+      // Queued behind the RequestTimeout, so a timer it started is closed
+      queue_->push(new RequestTimerClose(shared_from_this()));
+    }
+  }
+  return true;
+}
+
+void AppBus::OutgoingRequest::timerCallback(uv_timer_t *handle) {
+  OutgoingRequest *pthis = (OutgoingRequest *) (handle->data);
+  if (!pthis->done_.load(std::memory_order_acquire)) {
+    rapidjson::Document error;
+    makeRequestError(error, "ETIMEDOUT", -110, "Request timed out");
+    pthis->complete(error, true);
+  }
+  pthis->closeTimer();
+}
+
+struct AppBus::ResponseTask : LoopTask {
+  LoopQueue *queue_;
+  uint64_t id_;
+  rapidjson::Document retval_;
+  bool is_throw_;
+
+  ResponseTask(LoopQueue *queue, uint64_t id, const rapidjson::Document &retval, bool is_throw)
+      : queue_(queue), id_(id), is_throw_(is_throw) {
+    retval_.CopyFrom(retval, retval_.GetAllocator());
+  }
+
+  void run() override {
+    queue_->settleRequest(id_, retval_, is_throw_);
+  }
+};
+
+void AppBus::EventHandlerHolder::dispatch(const std::shared_ptr<EventMessage> &message) {
+  if (removed_.load(std::memory_order_acquire)) {
+    return;
+  }
+  if (once_) {
+    if (removed_.exchange(true)) {
+      return;
+    }
+    appbus_->off(id_);
+  }
+  handle(message);
+}
+
+void AppBus::BatchDelivery::run() {
+  auto iter = deliveries_.begin();
+  while (iter != deliveries_.end()) {
+    v8::Isolate *isolate = iter->first->isolate();
+    V8EventHandlerHolder *holder = static_cast<V8EventHandlerHolder *>(iter->first.get());
+    if (!isolate || !holder->callback_) {
+      iter->first->dispatch(iter->second);
+      iter++;
+      continue;
+    }
+
+    // Consecutive JS listeners of one isolate share a scope, so the
+    // nextTick and microtask queues are drained once for the whole run.
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = holder->callback_->context_.Get(isolate);
+    v8::Context::Scope context_scope(context);
+#if NODE_MAJOR_VERSION >= 10
+    node::CallbackScope callback_scope(isolate, context->Global(), holder->callback_->async_context_);
+#endif
+    do {
+      iter->first->dispatch(iter->second);
+      iter++;
+    } while (iter != deliveries_.end() && iter->first->isolate() == isolate);
+  }
+}
+
+void AppBus::EventHandlerHolder::markRemoved() {
+  {
+    std::unique_lock<std::mutex> lock(mailbox_mutex_);
+    removed_.store(true, std::memory_order_release);
+  }
+  // Wakes producers blocked on a full mailbox
+  mailbox_space_.notify_all();
+}
+
+void AppBus::disposeV8Callback(std::unique_ptr<V8Callback> callback, LoopQueue *queue) {
+  if (!callback || callback->onOwnThread() || !queue) {
+    return;
+  }
+  // The last reference was dropped on a foreign thread
+  queue->push(new V8DisposeTask(std::move(callback)));
+}
+
+static std::atomic<uint32_t> json_max_depth(64);
+static std::atomic<size_t> json_max_values(1 << 20);
+
+void AppBus::setJsonLimits(uint32_t max_depth, size_t max_values) {
+  json_max_depth.store(max_depth ? max_depth : UINT32_MAX, std::memory_order_relaxed);
+  json_max_values.store(max_values ? max_values : SIZE_MAX, std::memory_order_relaxed);
+}
+
+/**
+ * A JS container being converted: the next child is entry index of it.
+ */
+struct V8JsonFrame {
+  enum Kind {
+    kArray,
+    kObject,
+    // [key, value, ...] of a Map
+    kMap,
+    // Values of a Set
+    kSet
+  };
+
+  Kind kind;
+  rapidjson::Value *target;
+  v8::Local<v8::Object> object;
+  // Own enumerable names of objects, entries of maps and sets
+  v8::Local<v8::Array> entries;
+  uint32_t index;
+  uint32_t length;
+};
+
+/**
+ * Buffers reused by the conversions of one thread. A conversion started
+ * from a getter while another one runs gets fresh buffers.
+ */
+struct V8JsonScratch {
+  std::vector<V8JsonFrame> frames;
+  std::vector<char> utf8;
+  bool busy;
+
+  V8JsonScratch() : busy(false) {}
+};
+
+static thread_local V8JsonScratch v8_json_scratch;
+
+/**
+ * Writes vstring to utf8 and returns its length.
+ */
+static size_t v8StringToUtf8(v8::Isolate *isolate, v8::Local<v8::String> vstring, std::vector<char> &utf8) {
+#if NODE_MAJOR_VERSION >= 12
+  int length = vstring->Utf8Length(isolate);
+  if (utf8.size() < (size_t) length) {
+    utf8.resize(length);
+  }
+  vstring->WriteUtf8(isolate, utf8.data(), length, nullptr,
+                     v8::String::NO_NULL_TERMINATION | v8::String::REPLACE_INVALID_UTF8);
+  return length;
+#else
+  v8::String::Utf8Value str(isolate, vstring);
+  utf8.assign(*str, *str + str.length());
+  return str.length();
+#endif
+}
+
+template<class JsonAllocator>
+static void v8StringToJson(rapidjson::Value &target,
+                           JsonAllocator &allocator,
+                           v8::Isolate *isolate,
+                           v8::Local<v8::String> vstring,
+                           std::vector<char> &utf8) {
+  size_t length = v8StringToUtf8(isolate, vstring, utf8);
+  target.SetString(length ? utf8.data() : "", length, allocator);
+}
+
+/**
+ * Converts everything but arrays, maps, sets and plain objects.
+ * Returns false for those.
+ */
+template<class JsonAllocator>
+static bool v8ScalarToJson(rapidjson::Value &target,
+                           JsonAllocator &allocator,
+                           v8::Isolate *isolate,
+                           v8::Local<v8::Value> vvalue,
+                           std::vector<char> &utf8) {
+  if (vvalue.IsEmpty() || vvalue->IsNullOrUndefined() || vvalue->IsFunction() || vvalue->IsSymbol()) {
+    target.SetNull();
+  } else if (vvalue->IsString()) {
+    v8StringToJson(target, allocator, isolate, vvalue.As<v8::String>(), utf8);
+  } else if (vvalue->IsBoolean()) {
+    target.SetBool(vvalue->IsTrue());
+  } else if (vvalue->IsInt32()) {
+    target.SetInt(vvalue.As<v8::Int32>()->Value());
+  } else if (vvalue->IsUint32()) {
+    target.SetUint(vvalue.As<v8::Uint32>()->Value());
+  } else if (vvalue->IsNumber()) {
+    target.SetDouble(vvalue.As<v8::Number>()->Value());
+  } else if (vvalue->IsBigInt()) {
+    bool lossless = false;
+    int64_t int64_value = vvalue.As<v8::BigInt>()->Int64Value(&lossless);
+    if (lossless) {
+      target.SetInt64(int64_value);
+    } else {
+      uint64_t uint64_value = vvalue.As<v8::BigInt>()->Uint64Value(&lossless);
+      if (lossless) {
+        target.SetUint64(uint64_value);
+      } else {
+        target.SetNull();
+      }
+    }
+  } else if (vvalue->IsStringObject()) {
+    v8StringToJson(target, allocator, isolate, vvalue.As<v8::StringObject>()->ValueOf(), utf8);
+  } else if (vvalue->IsNumberObject()) {
+    target.SetDouble(vvalue.As<v8::NumberObject>()->ValueOf());
+  } else if (vvalue->IsBooleanObject()) {
+    target.SetBool(vvalue.As<v8::BooleanObject>()->ValueOf());
+  } else if (vvalue->IsDate()) {
+    // Same as binaryToJson
+    target.SetDouble(vvalue.As<v8::Date>()->ValueOf());
+  } else if (!vvalue->IsObject()) {
+    target.SetNull();
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Internalized like the keys JsonKeyCache hands out, for fixed property names
+static v8::Local<v8::String> v8PropertyName(v8::Isolate *isolate, const char *name) {
+  return v8::String::NewFromUtf8(isolate, name, v8::NewStringType::kInternalized).ToLocalChecked();
+}
+
+static void v8ThrowTypeError(v8::Isolate *isolate, const char *msg) {
+  isolate->ThrowException(v8::Exception::TypeError(
+      v8::String::NewFromUtf8(isolate, msg, v8::NewStringType::kNormal).ToLocalChecked()));
+}
+
+/**
+ * Starts converting object. target is null when writing text.
+ */
+template<class JsonAllocator>
+static bool v8PushJsonFrame(std::vector<V8JsonFrame> &frames,
+                            rapidjson::Value *target,
+                            JsonAllocator &allocator,
+                            v8::Isolate *isolate,
+                            v8::Local<v8::Context> context,
+                            v8::Local<v8::Object> object) {
+  if (frames.size() >= json_max_depth.load(std::memory_order_relaxed)) {
+    v8ThrowTypeError(isolate, "Value is nested too deeply to convert to JSON");
+    return false;
+  }
+  // Only ancestors can close a cycle; shared references are copied.
+  for (auto iter = frames.begin(); iter != frames.end(); iter++) {
+    if (iter->object == object) {
+      v8ThrowTypeError(isolate, "Converting circular structure to JSON");
+      return false;
+    }
+  }
+
+  V8JsonFrame frame;
+  frame.target = target;
+  frame.object = object;
+  frame.index = 0;
+  if (object->IsArray()) {
+    frame.kind = V8JsonFrame::kArray;
+    frame.length = object.As<v8::Array>()->Length();
+    if (target) {
+      target->SetArray();
+      target->Reserve(frame.length, allocator);
+    }
+  } else if (object->IsMap()) {
+    frame.kind = V8JsonFrame::kMap;
+    frame.entries = object.As<v8::Map>()->AsArray();
+    frame.length = frame.entries->Length();
+    if (target) {
+      target->SetObject();
+    }
+  } else if (object->IsSet()) {
+    frame.kind = V8JsonFrame::kSet;
+    frame.entries = object.As<v8::Set>()->AsArray();
+    frame.length = frame.entries->Length();
+    if (target) {
+      target->SetArray();
+      target->Reserve(frame.length, allocator);
+    }
+  } else {
+    frame.kind = V8JsonFrame::kObject;
+#if NODE_MAJOR_VERSION >= 12
+    if (!object->GetOwnPropertyNames(context,
+                                     static_cast<v8::PropertyFilter>(v8::ONLY_ENUMERABLE | v8::SKIP_SYMBOLS),
+                                     v8::KeyConversionMode::kConvertToString).ToLocal(&frame.entries)) {
+      return false;
+    }
+#else
+    if (!object->GetOwnPropertyNames(context).ToLocal(&frame.entries)) {
+      return false;
+    }
+#endif
+    frame.length = frame.entries->Length();
+    if (target) {
+      target->SetObject();
+    }
+  }
+  frames.push_back(frame);
+  return true;
+}
+
+/**
+ * Converts a JS value with an explicit stack, so deep values cannot exhaust
+ * the native one. Objects contribute their own enumerable string keys.
+ * On a cycle, on exceeding the limits of AppBus::setJsonLimits(), or when a
+ * getter throws, an exception is left pending and false is returned.
+ */
+template<class JsonAllocator>
+static bool v8ValueToJsonObject(rapidjson::Value &target,
+                                JsonAllocator &allocator,
+                                v8::Isolate *isolate,
+                                v8::Local<v8::Value> vvalue) {
+  V8JsonScratch nested_scratch;
+  V8JsonScratch &scratch = v8_json_scratch.busy ? nested_scratch : v8_json_scratch;
+  std::vector<char> &utf8 = scratch.utf8;
+  if (v8ScalarToJson(target, allocator, isolate, vvalue, utf8)) {
+    return true;
+  }
+
+  struct BusyScope {
+    V8JsonScratch &scratch;
+    BusyScope(V8JsonScratch &_scratch) : scratch(_scratch) { scratch.busy = true; }
+    ~BusyScope() {
+      scratch.frames.clear();
+      scratch.busy = false;
+    }
+  } busy_scope(scratch);
+
+  v8::Local<v8::Context> vcontext = isolate->GetCurrentContext();
+  std::vector<V8JsonFrame> &frames = scratch.frames;
+  size_t max_values = json_max_values.load(std::memory_order_relaxed);
+  size_t values = 1;
+  if (!v8PushJsonFrame(frames, &target, allocator, isolate, vcontext, vvalue.As<v8::Object>())) {
+    target.SetNull();
+    return false;
+  }
+
+  while (!frames.empty()) {
+    V8JsonFrame &frame = frames.back();
+    if (frame.index >= frame.length) {
+      frames.pop_back();
+      continue;
+    }
+    uint32_t index = frame.index++;
+
+    if (++values > max_values) {
+      v8ThrowTypeError(isolate, "Value is too large to convert to JSON");
+      target.SetNull();
+      return false;
+    }
+
+    v8::Local<v8::Value> vchild;
+    rapidjson::Value *child = nullptr;
+    rapidjson::Value placeholder;
+    bool ok = false;
+    switch (frame.kind) {
+      case V8JsonFrame::kArray:
+        ok = frame.object->Get(vcontext, index).ToLocal(&vchild);
+        frame.target->PushBack(placeholder, allocator);
+        child = &(*frame.target)[frame.target->Size() - 1];
+        break;
+      case V8JsonFrame::kSet:
+        ok = frame.entries->Get(vcontext, index).ToLocal(&vchild);
+        frame.target->PushBack(placeholder, allocator);
+        child = &(*frame.target)[frame.target->Size() - 1];
+        break;
+      case V8JsonFrame::kMap:
+      case V8JsonFrame::kObject: {
+        v8::Local<v8::Value> vkey;
+        v8::Local<v8::String> vkey_string;
+        if (frame.kind == V8JsonFrame::kMap) {
+          frame.index++;
+          ok = frame.entries->Get(vcontext, index).ToLocal(&vkey) &&
+              frame.entries->Get(vcontext, index + 1).ToLocal(&vchild);
+        } else {
+          ok = frame.entries->Get(vcontext, index).ToLocal(&vkey) &&
+              frame.object->Get(vcontext, vkey).ToLocal(&vchild);
+        }
+        ok = ok && vkey->ToString(vcontext).ToLocal(&vkey_string);
+        if (!ok) {
+          break;
+        }
+        rapidjson::Value jkey;
+        v8StringToJson(jkey, allocator, isolate, vkey_string, utf8);
+        frame.target->AddMember(jkey, placeholder, allocator);
+        child = &(frame.target->MemberEnd() - 1)->value;
+        break;
+      }
+    }
+    if (!ok) {
+      target.SetNull();
+      return false;
+    }
+
+    if (!v8ScalarToJson(*child, allocator, isolate, vchild, utf8) &&
+        !v8PushJsonFrame(frames, child, allocator, isolate, vcontext, vchild.As<v8::Object>())) {
+      target.SetNull();
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Writer for the JSON text handed to host listeners. Like JSON.stringify it
+ * writes NaN and the infinities, which rapidjson::Writer rejects after the
+ * separator is already out, as null.
+ */
+struct JsonTextWriter : rapidjson::Writer<rapidjson::StringBuffer> {
+  explicit JsonTextWriter(rapidjson::StringBuffer &buffer) : rapidjson::Writer<rapidjson::StringBuffer>(buffer) {}
+
+  bool Double(double d) {
+    if (!std::isfinite(d)) {
+      return Null();
+    }
+    return rapidjson::Writer<rapidjson::StringBuffer>::Double(d);
+  }
+};
+
+/**
+ * Writes a scalar as v8ScalarToJson converts it. Returns false for containers.
+ */
+template<class JsonWriter>
+static bool v8ScalarToJsonText(JsonWriter &writer,
+                               rapidjson::MemoryPoolAllocator<> &allocator,
+                               v8::Isolate *isolate,
+                               v8::Local<v8::Value> vvalue,
+                               std::vector<char> &utf8) {
+  if (!vvalue.IsEmpty() && (vvalue->IsString() || vvalue->IsStringObject())) {
+    v8::Local<v8::String> vstring =
+        vvalue->IsString() ? vvalue.As<v8::String>() : vvalue.As<v8::StringObject>()->ValueOf();
+    size_t length = v8StringToUtf8(isolate, vstring, utf8);
+    writer.String(length ? utf8.data() : "", (rapidjson::SizeType) length);
+    return true;
+  }
+  // Anything else converts without allocating
+  rapidjson::Value scalar;
+  if (!v8ScalarToJson(scalar, allocator, isolate, vvalue, utf8)) {
+    return false;
+  }
+  return scalar.Accept(writer);
+}
+
+static void v8StartJsonText(JsonTextWriter &writer, const V8JsonFrame &frame) {
+  if (frame.kind == V8JsonFrame::kObject || frame.kind == V8JsonFrame::kMap) {
+    writer.StartObject();
+  } else {
+    writer.StartArray();
+  }
+}
+
+/**
+ * Same as v8ValueToJsonObject, but writes JSON text without building a
+ * Document. The writer's output is incomplete when false is returned.
+ */
+static bool v8ValueToJsonText(JsonTextWriter &writer,
+                              v8::Isolate *isolate,
+                              v8::Local<v8::Value> vvalue) {
+  V8JsonScratch nested_scratch;
+  V8JsonScratch &scratch = v8_json_scratch.busy ? nested_scratch : v8_json_scratch;
+  std::vector<char> &utf8 = scratch.utf8;
+  rapidjson::MemoryPoolAllocator<> allocator;
+  if (v8ScalarToJsonText(writer, allocator, isolate, vvalue, utf8)) {
+    return true;
+  }
+
+  struct BusyScope {
+    V8JsonScratch &scratch;
+    BusyScope(V8JsonScratch &_scratch) : scratch(_scratch) { scratch.busy = true; }
+    ~BusyScope() {
+      scratch.frames.clear();
+      scratch.busy = false;
+    }
+  } busy_scope(scratch);
+
+  v8::Local<v8::Context> vcontext = isolate->GetCurrentContext();
+  std::vector<V8JsonFrame> &frames = scratch.frames;
+  size_t max_values = json_max_values.load(std::memory_order_relaxed);
+  size_t values = 1;
+  if (!v8PushJsonFrame(frames, nullptr, allocator, isolate, vcontext, vvalue.As<v8::Object>())) {
+    return false;
+  }
+  v8StartJsonText(writer, frames.back());
+
+  while (!frames.empty()) {
+    V8JsonFrame &frame = frames.back();
+    if (frame.index >= frame.length) {
+      if (frame.kind == V8JsonFrame::kObject || frame.kind == V8JsonFrame::kMap) {
+        writer.EndObject();
+      } else {
+        writer.EndArray();
+      }
+      frames.pop_back();
+      continue;
+    }
+    uint32_t index = frame.index++;
+
+    if (++values > max_values) {
+      v8ThrowTypeError(isolate, "Value is too large to convert to JSON");
+      return false;
+    }
+
+    v8::Local<v8::Value> vchild;
+    bool ok = false;
+    switch (frame.kind) {
+      case V8JsonFrame::kArray:
+        ok = frame.object->Get(vcontext, index).ToLocal(&vchild);
+        break;
+      case V8JsonFrame::kSet:
+        ok = frame.entries->Get(vcontext, index).ToLocal(&vchild);
+        break;
+      case V8JsonFrame::kMap:
+      case V8JsonFrame::kObject: {
+        v8::Local<v8::Value> vkey;
+        v8::Local<v8::String> vkey_string;
+        if (frame.kind == V8JsonFrame::kMap) {
+          frame.index++;
+          ok = frame.entries->Get(vcontext, index).ToLocal(&vkey) &&
+              frame.entries->Get(vcontext, index + 1).ToLocal(&vchild);
+        } else {
+          ok = frame.entries->Get(vcontext, index).ToLocal(&vkey) &&
+              frame.object->Get(vcontext, vkey).ToLocal(&vchild);
+        }
+        ok = ok && vkey->ToString(vcontext).ToLocal(&vkey_string);
+        if (ok) {
+          size_t length = v8StringToUtf8(isolate, vkey_string, utf8);
+          writer.Key(length ? utf8.data() : "", (rapidjson::SizeType) length);
+        }
+        break;
+      }
+    }
+    if (!ok) {
+      return false;
+    }
+
+    if (!v8ScalarToJsonText(writer, allocator, isolate, vchild, utf8)) {
+      if (!v8PushJsonFrame(frames, nullptr, allocator, isolate, vcontext, vchild.As<v8::Object>())) {
+        return false;
+      }
+      v8StartJsonText(writer, frames.back());
+    }
+  }
+  return true;
+}
+
+static v8::Local<v8::Value> jsonScalarToV8Value(v8::Isolate *isolate, const rapidjson::Value &src) {
+  v8::Local<v8::Value> vtarget;
+  if (src.IsNull()) {
+    vtarget = v8::Null(isolate);
+  } else if (src.IsString()) {
+    vtarget = v8::String::NewFromUtf8(isolate,
+                                      src.GetString(),
+                                      v8::NewStringType::kNormal,
+                                      src.GetStringLength()).ToLocalChecked();
+  } else if (src.IsBool()) {
+    vtarget = v8::Boolean::New(isolate, src.GetBool());
+  } else if (src.IsUint64() && !src.IsUint()) {
+    vtarget = v8::BigInt::NewFromUnsigned(isolate, src.GetUint64());
+  } else if (src.IsInt64() && !src.IsInt()) {
+    vtarget = v8::BigInt::New(isolate, src.GetInt64());
+  } else if (src.IsUint()) {
+    vtarget = v8::Uint32::New(isolate, src.GetUint());
+  } else if (src.IsInt()) {
+    vtarget = v8::Int32::New(isolate, src.GetInt());
+  } else if (src.IsDouble()) {
+    vtarget = v8::Number::New(isolate, src.GetDouble());
+  } else if (src.IsFloat()) {
+    vtarget = v8::Number::New(isolate, src.GetFloat());
+  } else {
+    vtarget = v8::Undefined(isolate);
+  }
+  return vtarget;
+}
+
+/**
+ * Handles of the members being built, shared by all levels of one conversion.
+ * Each container pushes its children, creates itself from the top of the
+ * stacks in one call and pops them again. Also a rapidjson SAX handler, so
+ * JSON text is built into JS values without a Document.
+ */
+struct AppBus::JsonV8Builder {
+  v8::Isolate *isolate;
+  LoopQueue *queue;
+  std::vector<v8::Local<v8::Name>> names;
+  std::vector<v8::Local<v8::Value>> values;
+  v8::Local<v8::Value> prototype;
+  // Stack heights of names and values at each open container
+  std::vector<std::pair<size_t, size_t>> bases;
+  // Containers being built by build() and the index of their next child
+  std::vector<std::pair<const rapidjson::Value *, rapidjson::SizeType>> frames;
+  // Leaves the elements of a top level array on values
+  bool spread;
+  bool spread_done;
+
+  JsonV8Builder(v8::Isolate *_isolate, LoopQueue *_queue)
+      : isolate(_isolate), queue(_queue), spread(false), spread_done(false) {}
+
+  v8::Local<v8::String> key(const char *str, size_t length) {
+    return queue->jsonKey(isolate, str, length);
+  }
+
+  v8::Local<v8::Value> makeObject(size_t names_base, size_t values_base);
+  v8::Local<v8::Value> makeArray(size_t values_base);
+  v8::Local<v8::Value> build(const rapidjson::Value &src);
+
+  bool Null() {
+    values.push_back(v8::Null(isolate));
+    return true;
+  }
+  bool Bool(bool b) {
+    values.push_back(v8::Boolean::New(isolate, b));
+    return true;
+  }
+  bool Int(int i) {
+    values.push_back(v8::Int32::New(isolate, i));
+    return true;
+  }
+  bool Uint(unsigned u) {
+    values.push_back(v8::Uint32::New(isolate, u));
+    return true;
+  }
+  // Only called for values beyond 32 bits, same as jsonScalarToV8Value
+  bool Int64(int64_t i) {
+    values.push_back(v8::BigInt::New(isolate, i));
+    return true;
+  }
+  bool Uint64(uint64_t u) {
+    values.push_back(v8::BigInt::NewFromUnsigned(isolate, u));
+    return true;
+  }
+  bool Double(double d) {
+    values.push_back(v8::Number::New(isolate, d));
+    return true;
+  }
+  bool RawNumber(const char *str, rapidjson::SizeType length, bool copy) {
+    return String(str, length, copy);
+  }
+  bool String(const char *str, rapidjson::SizeType length, bool) {
+    values.push_back(v8::String::NewFromUtf8(isolate, str, v8::NewStringType::kNormal, length).ToLocalChecked());
+    return true;
+  }
+  bool StartObject() {
+    bases.emplace_back(names.size(), values.size());
+    return true;
+  }
+  bool Key(const char *str, rapidjson::SizeType length, bool) {
+    names.push_back(key(str, length));
+    return true;
+  }
+  bool EndObject(rapidjson::SizeType) {
+    std::pair<size_t, size_t> base = bases.back();
+    bases.pop_back();
+    v8::Local<v8::Value> vobject = makeObject(base.first, base.second);
+    values.push_back(vobject);
+    return true;
+  }
+  bool StartArray() {
+    bases.emplace_back(names.size(), values.size());
+    return true;
+  }
+  bool EndArray(rapidjson::SizeType) {
+    std::pair<size_t, size_t> base = bases.back();
+    bases.pop_back();
+    if (spread && bases.empty()) {
+      spread_done = true;
+      return true;
+    }
+    v8::Local<v8::Value> varr = makeArray(base.second);
+    values.push_back(varr);
+    return true;
+  }
+
+  static v8::Local<v8::Value> value(v8::Isolate *isolate, LoopQueue *queue, const rapidjson::Value &src);
+  static void args(std::vector<v8::Local<v8::Value>> &vargs,
+                   v8::Isolate *isolate,
+                   LoopQueue *queue,
+                   const rapidjson::Document &args);
+  static bool text(std::vector<v8::Local<v8::Value>> &vargs,
+                   v8::Isolate *isolate,
+                   LoopQueue *queue,
+                   std::string &text,
+                   bool spread,
+                   bool insitu);
+};
+
+v8::Local<v8::Value> AppBus::JsonV8Builder::makeObject(size_t names_base, size_t values_base) {
+#if NODE_MAJOR_VERSION >= 12
+  if (prototype.IsEmpty()) {
+    // Keeps Object.prototype so results behave like JSON.parse() output
+    prototype = queue->objectPrototype(isolate);
+  }
+  v8::Local<v8::Object> vobject = v8::Object::New(isolate, prototype, names.data() + names_base,
+                                                  values.data() + values_base, values.size() - values_base);
+#else
+  v8::Local<v8::Object> vobject = v8::Object::New(isolate);
+  for (size_t i = 0, n = values.size() - values_base; i < n; i++) {
+    vobject->Set(names[names_base + i], values[values_base + i]);
+  }
+#endif
+  names.resize(names_base);
+  values.resize(values_base);
+  return vobject;
+}
+
+v8::Local<v8::Value> AppBus::JsonV8Builder::makeArray(size_t values_base) {
+#if NODE_MAJOR_VERSION >= 12
+  v8::Local<v8::Array> varr = v8::Array::New(isolate, values.data() + values_base, values.size() - values_base);
+#else
+  v8::Local<v8::Array> varr = v8::Array::New(isolate, values.size() - values_base);
+  for (size_t i = 0, n = values.size() - values_base; i < n; i++) {
+    varr->Set((uint32_t) i, values[values_base + i]);
+  }
+#endif
+  values.resize(values_base);
+  return varr;
+}
+
+/**
+ * Walks src with an explicit stack, so deep documents cannot exhaust the
+ * loop thread's stack.
+ */
+v8::Local<v8::Value> AppBus::JsonV8Builder::build(const rapidjson::Value &src) {
+  if (!src.IsObject() && !src.IsArray()) {
+    return jsonScalarToV8Value(isolate, src);
+  }
+  frames.emplace_back(&src, 0);
+  bases.emplace_back(names.size(), values.size());
+  while (true) {
+    const rapidjson::Value &container = *frames.back().first;
+    rapidjson::SizeType index = frames.back().second;
+    const rapidjson::Value *child = nullptr;
+    if (container.IsObject()) {
+      if (index < container.MemberCount()) {
+        const rapidjson::Value::Member &member = container.MemberBegin()[index];
+        names.push_back(key(member.name.GetString(), member.name.GetStringLength()));
+        child = &member.value;
+      }
+    } else if (index < container.Size()) {
+      child = &container[index];
+    }
+
+    if (child) {
+      frames.back().second++;
+      if (child->IsObject() || child->IsArray()) {
+        frames.emplace_back(child, 0);
+        bases.emplace_back(names.size(), values.size());
+      } else {
+        values.push_back(jsonScalarToV8Value(isolate, *child));
+      }
+      continue;
+    }
+
+    std::pair<size_t, size_t> base = bases.back();
+    bases.pop_back();
+    frames.pop_back();
+    v8::Local<v8::Value> vcontainer = container.IsObject() ? makeObject(base.first, base.second)
+                                                           : makeArray(base.second);
+    if (frames.empty()) {
+      return vcontainer;
+    }
+    values.push_back(vcontainer);
+  }
+}
+
+v8::Local<v8::Value> AppBus::JsonV8Builder::value(v8::Isolate *isolate,
+                                                  LoopQueue *queue,
+                                                  const rapidjson::Value &src) {
+  if (!src.IsObject() && !src.IsArray()) {
+    return jsonScalarToV8Value(isolate, src);
+  }
+  JsonV8Builder builder(isolate, queue);
+  return builder.build(src);
+}
+
+void AppBus::JsonV8Builder::args(std::vector<v8::Local<v8::Value>> &vargs,
+                                 v8::Isolate *isolate,
+                                 LoopQueue *queue,
+                                 const rapidjson::Document &args) {
+  vargs.resize(args.Size());
+
+  JsonV8Builder builder(isolate, queue);
+  int index = 0;
+  for (auto iter = args.Begin(); iter != args.End(); iter++, index++) {
+    vargs[index] = builder.build(*iter);
+  }
+}
+
+bool AppBus::JsonV8Builder::text(std::vector<v8::Local<v8::Value>> &vargs,
+                                 v8::Isolate *isolate,
+                                 LoopQueue *queue,
+                                 std::string &text,
+                                 bool spread,
+                                 bool insitu) {
+  JsonV8Builder builder(isolate, queue);
+  builder.spread = spread;
+  rapidjson::Reader reader;
+  rapidjson::ParseResult result;
+  // Iterative, so deep text cannot exhaust the loop thread's stack
+  if (insitu) {
+    rapidjson::InsituStringStream stream(&text[0]);
+    result = reader.Parse<rapidjson::kParseInsituFlag | rapidjson::kParseIterativeFlag>(stream, builder);
+  } else {
+    rapidjson::StringStream stream(text.c_str());
+    result = reader.Parse<rapidjson::kParseIterativeFlag>(stream, builder);
+  }
+  if (result.IsError() || (spread ? !builder.spread_done : builder.values.size() != 1)) {
+    return false;
+  }
+  vargs.insert(vargs.end(), builder.values.begin(), builder.values.end());
+  return true;
+}
+
+void AppBus::LoopQueue::settleRequest(uint64_t id, const rapidjson::Value &retval, bool is_throw) {
+  auto iter = pending_requests_.find(id);
+  if (iter == pending_requests_.end()) {
+    return;
+  }
+  PendingRequest pending = std::move(iter->second);
+  pending_requests_.erase(iter);
+
+  v8::Isolate *isolate = pending.isolate;
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context = pending.context.Get(isolate);
+  v8::Context::Scope context_scope(context);
+#if NODE_MAJOR_VERSION >= 10
+  // Runs the promise reactions before returning to the loop
+  node::CallbackScope callback_scope(isolate, context->Global(), pending.async->async_context_);
+#endif
+  v8::Local<v8::Promise::Resolver> resolver = pending.resolver.Get(isolate);
+  v8::Local<v8::Value> value = JsonV8Builder::value(isolate, this, retval);
+  if (is_throw) {
+    resolver->Reject(context, value).FromMaybe(false);
+  } else {
+    resolver->Resolve(context, value).FromMaybe(false);
+  }
+}
+
+/** Copies length bytes at offset out of an ArrayBuffer. */
+static BinaryBuffer arrayBufferCopy(v8::Local<v8::ArrayBuffer> ab, size_t offset, size_t length) {
+  std::shared_ptr<std::vector<uint8_t>> copy(new std::vector<uint8_t>(length));
+  // Through a view: GetBackingStore() would register the memory with V8
+  v8::Uint8Array::New(ab, offset, length)->CopyContents(copy->data(), length);
+  return BinaryBuffer(copy->data(), copy->size(), copy);
+}
+
+#if NODE_MAJOR_VERSION >= 14
+/**
+ * Owns contents taken from a JS ArrayBuffer. newExternalArrayBuffer() finds
+ * it through std::get_deleter() and gives JS the same store back: V8 before
+ * 10 aborts when two stores over the same memory are both registered.
+ */
+struct BackingStoreOwner {
+  std::shared_ptr<v8::BackingStore> store;
+
+  void operator()(void *) { store.reset(); }
+};
+
+// Stores newExternalArrayBuffer() made over host memory, one per address
+static std::mutex external_stores_mutex;
+static std::map<const void *, std::weak_ptr<v8::BackingStore>> external_stores;
+#endif
+
+/**
+ * Takes the contents of an ArrayBuffer without copying.
+ * With detach the buffer is transferred out of JS, otherwise its backing
+ * store is pinned and JS keeps sharing it. Buffers that can not be
+ * transferred or pinned are copied.
+ */
+#if NODE_MAJOR_VERSION >= 14
+static BinaryBuffer arrayBufferContents(v8::Isolate *, v8::Local<v8::ArrayBuffer> ab, bool detach) {
+  if (!detach || ab->IsDetachable()) {
+    std::shared_ptr<v8::BackingStore> store = ab->GetBackingStore();
+    if (detach) ab->Detach();
+    const uint8_t *data = (const uint8_t *) store->Data();
+    size_t length = store->ByteLength();
+    return BinaryBuffer(data, length, std::shared_ptr<void>((void *) data, BackingStoreOwner{std::move(store)}));
+  }
+  return arrayBufferCopy(ab, 0, ab->ByteLength());
+}
+#elif NODE_MAJOR_VERSION >= 12
+static BinaryBuffer arrayBufferContents(v8::Isolate *isolate, v8::Local<v8::ArrayBuffer> ab, bool detach) {
+  // A pin would need a v8::Global released on the isolate thread; copy instead.
+  if (detach && !ab->IsExternal() && ab->IsDetachable()) {
+    v8::ArrayBuffer::Contents contents = ab->Externalize();
+    ab->Detach();
+    v8::ArrayBuffer::Allocator *allocator = isolate->GetArrayBufferAllocator();
+    size_t length = contents.ByteLength();
+    return BinaryBuffer((const uint8_t *) contents.Data(), length,
+                        std::shared_ptr<void>(contents.Data(), [allocator, length](void *data) {
+                          allocator->Free(data, length);
+                        }));
+  }
+  // Someone else owns external contents: copy them, but still transfer
+  BinaryBuffer copy = arrayBufferCopy(ab, 0, ab->ByteLength());
+  if (detach && ab->IsDetachable()) {
+    ab->Detach();
+  }
+  return copy;
+}
+#else
+static BinaryBuffer arrayBufferContents(v8::Isolate *isolate, v8::Local<v8::ArrayBuffer> ab, bool detach) {
+  // Externalized contents must go back to the isolate's allocator, which
+  // this V8 does not expose: transferred buffers are copied, then detached.
+  BinaryBuffer copy = arrayBufferCopy(ab, 0, ab->ByteLength());
+  if (detach && ab->IsNeuterable()) {
+    if (!ab->IsExternal()) {
+      // Neuter() takes external buffers only. The contents move to an
+      // unreferenced buffer that frees them when it is collected.
+      v8::ArrayBuffer::Contents contents = ab->Externalize();
+      v8::ArrayBuffer::New(isolate, contents.Data(), contents.ByteLength(),
+                           v8::ArrayBufferCreationMode::kInternalized);
+    }
+    ab->Neuter();
+  }
+  return copy;
+}
+#endif
+
+#if NODE_MAJOR_VERSION < 14
+template<class T>
+struct ExternalArrayBufferPin {
+  v8::Global<T> handle;
+  std::shared_ptr<void> owner;
+
+  static void weakCallback(const v8::WeakCallbackInfo<ExternalArrayBufferPin> &info) {
+    ExternalArrayBufferPin *pin = info.GetParameter();
+    pin->handle.Reset();
+    delete pin;
+  }
+};
+#endif
+
+/**
+ * Wraps bytes in an ArrayBuffer without copying.
+ * The buffer keeps owner alive until it is garbage collected.
+ */
+static v8::Local<v8::ArrayBuffer> newExternalArrayBuffer(v8::Isolate *isolate, const BinaryBuffer &buffer) {
+#if NODE_MAJOR_VERSION >= 14
+  BackingStoreOwner *taken = std::get_deleter<BackingStoreOwner>(buffer.owner);
+  if (taken && taken->store->Data() == buffer.data && taken->store->ByteLength() == buffer.length) {
+    return v8::ArrayBuffer::New(isolate, taken->store);
+  }
+  // replaced is released after the lock: its deleter takes it too
+  std::shared_ptr<v8::BackingStore> store, replaced;
+  {
+    std::unique_lock<std::mutex> lock(external_stores_mutex);
+    std::weak_ptr<v8::BackingStore> &cached = external_stores[buffer.data];
+    replaced = cached.lock();
+    if (replaced && replaced->ByteLength() == buffer.length) {
+      store = std::move(replaced);
+    } else {
+      store = v8::ArrayBuffer::NewBackingStore(
+          (void *) buffer.data, buffer.length,
+          [](void *data, size_t, void *deleter_data) {
+            delete (std::shared_ptr<void> *) deleter_data;
+            std::unique_lock<std::mutex> lock(external_stores_mutex);
+            auto iter = external_stores.find(data);
+            if (iter != external_stores.end() && iter->second.expired()) {
+              external_stores.erase(iter);
+            }
+          },
+          new std::shared_ptr<void>(buffer.owner));
+      cached = store;
+    }
+  }
+  return v8::ArrayBuffer::New(isolate, std::move(store));
+#else
+  v8::Local<v8::ArrayBuffer> ab = v8::ArrayBuffer::New(isolate, (void *) buffer.data, buffer.length,
+                                                       v8::ArrayBufferCreationMode::kExternalized);
+  ExternalArrayBufferPin<v8::ArrayBuffer> *pin = new ExternalArrayBufferPin<v8::ArrayBuffer>();
+  pin->handle.Reset(isolate, ab);
+  pin->owner = buffer.owner;
+  pin->handle.SetWeak(pin, ExternalArrayBufferPin<v8::ArrayBuffer>::weakCallback, v8::WeakCallbackType::kParameter);
+  return ab;
+#endif
+}
+
+static v8::Local<v8::SharedArrayBuffer> newExternalSharedArrayBuffer(v8::Isolate *isolate,
+                                                                     const BinaryBuffer &buffer) {
+#if NODE_MAJOR_VERSION >= 14
+  std::unique_ptr<v8::BackingStore> store = v8::SharedArrayBuffer::NewBackingStore(
+      (void *) buffer.data, buffer.length,
+      [](void *, size_t, void *deleter_data) {
+        delete (std::shared_ptr<void> *) deleter_data;
+      },
+      new std::shared_ptr<void>(buffer.owner));
+  return v8::SharedArrayBuffer::New(isolate, std::move(store));
+#else
+  v8::Local<v8::SharedArrayBuffer> sab = v8::SharedArrayBuffer::New(isolate, (void *) buffer.data, buffer.length,
+                                                                    v8::ArrayBufferCreationMode::kExternalized);
+  ExternalArrayBufferPin<v8::SharedArrayBuffer> *pin = new ExternalArrayBufferPin<v8::SharedArrayBuffer>();
+  pin->handle.Reset(isolate, sab);
+  pin->owner = buffer.owner;
+  pin->handle.SetWeak(pin, ExternalArrayBufferPin<v8::SharedArrayBuffer>::weakCallback,
+                      v8::WeakCallbackType::kParameter);
+  return sab;
+#endif
+}
+
+/**
+ * Transferred buffers are shared, not copied, by every listener of the message.
+ */
+static v8::MaybeLocal<v8::Value> binaryToV8Value(v8::Isolate *isolate,
+                                                 v8::Local<v8::Context> context,
+                                                 const BinaryPayload &payload) {
+  v8::ValueDeserializer deserializer(isolate, payload.data.data, payload.data.length);
+  for (uint32_t i = 0; i < payload.transfers.size(); i++) {
+    deserializer.TransferArrayBuffer(i, newExternalArrayBuffer(isolate, payload.transfers[i]));
+  }
+  if (!deserializer.ReadHeader(context).FromMaybe(false)) {
+    return v8::MaybeLocal<v8::Value>();
+  }
+  return deserializer.ReadValue(context);
+}
+
+/**
+ * Calls a JS callback inside its creation context through node::MakeCallback,
+ * so that microtasks are drained and async_hooks see a proper callback scope.
+ */
+static void v8CallWithArgs(v8::Isolate *isolate,
+                           v8::Local<v8::Context> context,
+                           v8::Local<v8::Function> vcallback,
+                           const node::async_context &async_context,
+                           std::vector<v8::Local<v8::Value>> &vargs) {
+  node::MakeCallback(isolate, context->Global(), vcallback, vargs.size(), vargs.data(), async_context);
+}
+
+void AppBus::v8ThrowError(const char *msg) {
+  v8::HandleScope scope(v8::Isolate::GetCurrent());
+  scope.GetIsolate()->ThrowException(v8::Exception::Error(
+      v8::String::NewFromUtf8(scope.GetIsolate(), msg, v8::NewStringType::kNormal).ToLocalChecked()));
+}
+
+std::shared_ptr<AppBus::LoopQueue> AppBus::getLoopQueue(uv_loop_t *loop) {
+  std::unique_lock<std::mutex> lock(loop_queues_mutex_);
+  auto iter = loop_queues_.find(loop);
+  return iter != loop_queues_.end() ? iter->second : nullptr;
+}
+
+/**
+ * Creates the delivery queue of loop. uv_async_init is only allowed on
+ * the loop thread, so this runs from init() and newV8EventBus() only.
+ */
+std::shared_ptr<AppBus::LoopQueue> AppBus::attachLoopQueue(uv_loop_t *loop) {
+  std::shared_ptr<LoopQueue> queue;
+  {
+    std::unique_lock<std::mutex> lock(loop_queues_mutex_);
+    auto iter = loop_queues_.find(loop);
+    if (iter != loop_queues_.end()) {
+      queue = iter->second;
+    } else {
+      queue.reset(new LoopQueue(loop));
+      loop_queues_.emplace(loop, queue);
+    }
+  }
+  queue->bindToCurrentThread();
+  return queue;
+}
+
+/**
+ * Queue of the loop a JS bus object is bound to; throws once the loop
+ * has been detached.
+ */
+std::shared_ptr<AppBus::LoopQueue> AppBus::v8LoopQueue(AppBus *self, uv_loop_t *loop) {
+  std::shared_ptr<LoopQueue> queue = self->getLoopQueue(loop);
+  if (!queue) {
+    v8ThrowError("The bus is detached from this loop");
+  }
+  return queue;
+}
+
+AppBus::SubscriptionId AppBus::on(const char *event_key, EventHandler_t handler, uv_loop_t *loop) {
+  if (!loop) loop = loop_;
+  std::shared_ptr<LoopQueue> queue = getLoopQueue(loop);
+  if (!queue) {
+    return 0;
+  }
+  std::shared_ptr<HostEventHandlerHolder> handler_holder(new HostEventHandlerHolder(loop, std::move(queue), handler));
+  return addEventHandler(event_key, std::move(handler_holder));
+}
+
+AppBus::SubscriptionId AppBus::once(const char *event_key, EventHandler_t handler, uv_loop_t *loop) {
+  if (!loop) loop = loop_;
+  std::shared_ptr<LoopQueue> queue = getLoopQueue(loop);
+  if (!queue) {
+    return 0;
+  }
+  std::shared_ptr<HostEventHandlerHolder> handler_holder(new HostEventHandlerHolder(loop, std::move(queue), handler));
+  return addEventHandler(event_key, std::move(handler_holder), true);
+}
+
+AppBus::SubscriptionId AppBus::onJsonText(const char *event_key, JsonTextHandler_t handler, uv_loop_t *loop) {
+  if (!loop) loop = loop_;
+  std::shared_ptr<LoopQueue> queue = getLoopQueue(loop);
+  if (!queue) {
+    return 0;
+  }
+  std::shared_ptr<HostJsonTextHandlerHolder>
+      handler_holder(new HostJsonTextHandlerHolder(loop, std::move(queue), std::move(handler)));
+  return addEventHandler(event_key, std::move(handler_holder));
+}
+
+AppBus::SubscriptionId AppBus::onBinary(const char *event_key, BinaryEventHandler_t handler, uv_loop_t *loop) {
+  if (!loop) loop = loop_;
+  std::shared_ptr<LoopQueue> queue = getLoopQueue(loop);
+  if (!queue) {
+    return 0;
+  }
+  std::shared_ptr<HostBinaryEventHandlerHolder>
+      handler_holder(new HostBinaryEventHandlerHolder(loop, std::move(queue), handler));
+  return addEventHandler(event_key, std::move(handler_holder));
+}
+
+bool AppBus::onRequest(const char *key, RequestHandler_t handler, uv_loop_t *loop) {
+  if (!loop) loop = loop_;
+  std::shared_ptr<LoopQueue> queue = getLoopQueue(loop);
+  if (!queue) {
+    return false;
+  }
+  std::shared_ptr<HostRequestHandlerHolder>
+      handler_holder(new HostRequestHandlerHolder(this, loop, std::move(queue), handler));
+  return addRequestHandler(key, std::move(handler_holder));
+}
+
+AppBus::RequestId AppBus::request(const char *key,
+                                  rapidjson::Value &args,
+                                  ResponseHandler_t callback,
+                                  uint64_t timeout_ms) {
+  if (!args.IsArray()) {
+    rapidjson::Document error;
+    makeRequestError(error, "EINVAL", -22, "Request arguments must be an array");
+    callback(error, true);
+    return 0;
+  }
+  std::shared_ptr<RequestHandlerHolder> req_handler = findRequestHandler(key, strlen(key));
+  if (!req_handler) {
+    rapidjson::Document error;
+    makeRequestError(error, "ENOFUNC", -2, "Not registered request key");
+    callback(error, true);
+    return 0;
+  }
+
+  std::shared_ptr<OutgoingRequest> outgoing;
+  {
+    std::unique_lock<std::mutex> lock(requests_mutex_);
+    RequestId id = ++next_request_id_;
+    outgoing.reset(new OutgoingRequest(this, id, req_handler->loop(), req_handler->queue_, timeout_ms,
+                                       std::move(callback)));
+    outgoing_requests_.emplace(id, outgoing);
+  }
+  // Registered first: a detachLoop() past this check fails the request itself
+  if (req_handler->queue()->detached()) {
+    rapidjson::Document error;
+    makeRequestError(error, "ECANCELED", -125, "Request handler was detached");
+    outgoing->complete(error, true);
+    return 0;
+  }
+
+  std::shared_ptr<RequestMessage> message(new RequestMessage(std::string()));
+  for (auto iter = args.Begin(); iter != args.End(); iter++) {
+    rapidjson::Value jsonValue;
+    jsonValue.CopyFrom(*iter, message->args.GetAllocator());
+    message->args.PushBack(jsonValue, message->args.GetAllocator());
+  }
+  message->respond = [outgoing](const rapidjson::Document &retval, bool is_throw) -> void {
+    outgoing->complete(retval, is_throw);
+  };
+
+  RequestId id = outgoing->id_;
+  if (timeout_ms > 0) {
+    req_handler->queue()->push(new RequestTimeout(outgoing));
+  }
+  req_handler->handle(std::move(message));
+  return id;
+}
+
+bool AppBus::cancelRequest(RequestId id) {
+  std::shared_ptr<OutgoingRequest> outgoing;
+  {
+    std::unique_lock<std::mutex> lock(requests_mutex_);
+    auto iter = outgoing_requests_.find(id);
+    if (iter == outgoing_requests_.end()) {
+      return false;
+    }
+    outgoing = std::move(iter->second);
+    outgoing_requests_.erase(iter);
+  }
+  return outgoing->finish();
+}
+
+void AppBus::forgetRequest(RequestId id) {
+  std::unique_lock<std::mutex> lock(requests_mutex_);
+  outgoing_requests_.erase(id);
+}
+
+void AppBus::cancelOutgoingRequests(uv_loop_t *loop, const char *message) {
+  std::vector<std::shared_ptr<OutgoingRequest>> cancelled;
+  {
+    std::unique_lock<std::mutex> lock(requests_mutex_);
+    for (auto iter = outgoing_requests_.begin(); iter != outgoing_requests_.end(); iter++) {
+      if (!loop || iter->second->loop_ == loop) {
+        cancelled.push_back(iter->second);
+      }
+    }
+  }
+  for (auto iter = cancelled.begin(); iter != cancelled.end(); iter++) {
+    rapidjson::Document error;
+    makeRequestError(error, "ECANCELED", -125, message);
+    (*iter)->complete(error, true);
+  }
+}
+
+bool AppBus::off(SubscriptionId id) {
+  std::shared_ptr<EventHandlerHolder> removed;
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto sub_iter = subscriptions_.find(id);
+    if (sub_iter == subscriptions_.end()) {
+      return false;
+    }
+    std::string event_key = std::move(sub_iter->second);
+    subscriptions_.erase(sub_iter);
+
+    std::shared_ptr<const Registry> current = registry_;
+    const std::shared_ptr<const EventEntry> *found = current->events.find(event_key.c_str(), event_key.length());
+    if (!found) {
+      return false;
+    }
+
+    std::shared_ptr<EventEntry> entry(new EventEntry(**found));
+    entry->handlers.clear();
+    for (auto iter = (*found)->handlers.begin(); iter != (*found)->handlers.end(); iter++) {
+      if ((*iter)->id_ == id) {
+        removed = *iter;
+      } else {
+        entry->handlers.push_back(*iter);
+      }
+    }
+
+    std::shared_ptr<Registry> next(new Registry(*current));
+    if (entry->unused()) {
+      next->events.erase(event_key.c_str(), event_key.length());
+    } else {
+      next->events.set(event_key.c_str(), event_key.length(), std::move(entry));
+    }
+    publishRegistry(std::move(next));
+  }
+
+  if (!removed) {
+    return false;
+  }
+  // Deliveries already queued for the handler are skipped
+  removed->markRemoved();
+  return true;
+}
+
+/**
+ * State shared by both ends of a stream.
+ * credit_ is the number of chunks the writer may still send; it goes
+ * negative when the writer ignores write() returning false.
+ */
+struct AppBus::Stream : std::enable_shared_from_this<Stream> {
+  uint64_t id_;
+  std::mutex mutex_;
+  std::condition_variable writable_;
+  int64_t credit_;
+  bool ended_;
+  std::atomic<bool> aborted_;
+  std::string abort_reason_;
+
+  std::shared_ptr<LoopQueue> reader_queue_;
+  // Set when the writer is a JS object on that loop
+  std::shared_ptr<LoopQueue> writer_queue_;
+
+  // Reader loop only
+  bool finished_;
+  bool paused_;
+  size_t withheld_;
+  StreamReader::DataHandler_t data_handler_;
+  StreamReader::EndHandler_t end_handler_;
+  StreamReader::AbortHandler_t abort_handler_;
+
+  Stream(uint64_t id, size_t window, std::shared_ptr<LoopQueue> reader_queue)
+      : id_(id), credit_((int64_t) window), ended_(false), aborted_(false),
+        reader_queue_(std::move(reader_queue)), finished_(false), paused_(false), withheld_(0) {}
+
+  bool write(BinaryBuffer chunk);
+  void end();
+  void abort(const std::string &reason);
+  void abortUnlessEnded(const char *reason);
+  bool waitWritable();
+  // Marks the stream aborted without notifying the ends; used on loop shutdown
+  void close(const char *reason);
+
+  // Reader loop
+  void grant(size_t credits);
+  void pause();
+  void resume();
+  void deliverData(LoopQueue *queue, const BinaryBuffer &chunk);
+  void deliverEnd(LoopQueue *queue);
+  void deliverAbort(LoopQueue *queue);
+
+  // Writer loop, JS writers only
+  void notifyWriter(LoopQueue *queue, const char *method);
+
+  struct StreamRef;
+  static v8::MaybeLocal<v8::Object> newV8Object(v8::Isolate *isolate,
+                                                v8::Local<v8::Context> context,
+                                                std::shared_ptr<Stream> stream,
+                                                bool writer);
+  static Stream *fromV8This(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8Write(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8End(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8Abort(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8Pause(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8Resume(const v8::FunctionCallbackInfo<v8::Value> &info);
+};
+
+struct AppBus::StreamTask : LoopTask {
+  enum Kind {
+    kData,
+    kEnd,
+    kAbort,
+    kWriterDrain,
+    kWriterAbort
+  };
+
+  Kind kind_;
+  LoopQueue *queue_;
+  std::shared_ptr<Stream> stream_;
+  BinaryBuffer chunk_;
+
+  StreamTask(Kind kind, LoopQueue *queue, std::shared_ptr<Stream> stream)
+      : kind_(kind), queue_(queue), stream_(std::move(stream)) {}
+
+  void run() override {
+    switch (kind_) {
+      case kData:
+        stream_->deliverData(queue_, chunk_);
+        break;
+      case kEnd:
+        stream_->deliverEnd(queue_);
+        break;
+      case kAbort:
+        stream_->deliverAbort(queue_);
+        break;
+      case kWriterDrain:
+        stream_->notifyWriter(queue_, "ondrain");
+        break;
+      case kWriterAbort:
+        stream_->notifyWriter(queue_, "onabort");
+        queue_->streams_.erase(std::make_pair(stream_->id_, true));
+        break;
+    }
+  }
+};
+
+struct AppBus::StreamHandlerHolder {
+  uv_loop_t *loop_;
+  std::shared_ptr<LoopQueue> queue_;
+  StreamHandlerHolder(uv_loop_t *loop, std::shared_ptr<LoopQueue> queue)
+      : loop_(loop), queue_(std::move(queue)) {}
+  virtual ~StreamHandlerHolder() {}
+  uv_loop_t *loop() const { return loop_; }
+  LoopQueue *queue() const { return queue_.get(); }
+  virtual void release() {}
+  // Called on the loop thread ahead of the stream's chunks
+  virtual void open(const std::shared_ptr<Stream> &stream) = 0;
+};
+
+struct AppBus::HostStreamHandlerHolder : StreamHandlerHolder {
+  StreamHandler_t func_;
+
+  HostStreamHandlerHolder(uv_loop_t *loop, std::shared_ptr<LoopQueue> queue, StreamHandler_t func)
+      : StreamHandlerHolder(loop, std::move(queue)), func_(func) {}
+
+  void open(const std::shared_ptr<Stream> &stream) override {
+    queue()->streams_[std::make_pair(stream->id_, false)].stream = stream;
+    func_(std::make_shared<StreamReader>(stream));
+  }
+};
+
+struct AppBus::V8StreamHandlerHolder : StreamHandlerHolder {
+  std::unique_ptr<V8Callback> callback_;
+
+  V8StreamHandlerHolder(uv_loop_t *loop,
+                        std::shared_ptr<LoopQueue> queue,
+                        v8::Isolate *isolate,
+                        v8::Local<v8::Context> context,
+                        v8::Local<v8::Function> func)
+      : StreamHandlerHolder(loop, std::move(queue)),
+        callback_(new V8Callback(isolate, context, func, "AppBus.stream")) {}
+
+  ~V8StreamHandlerHolder() override {
+    disposeV8Callback(std::move(callback_), queue());
+  }
+
+  void release() override {
+    callback_.reset();
+  }
+
+  void open(const std::shared_ptr<Stream> &stream) override {
+    if (!callback_) {
+      stream->abort("Stream handler released");
+      return;
+    }
+    v8::Isolate *isolate = callback_->isolate_;
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = callback_->context_.Get(isolate);
+    v8::Context::Scope context_scope(context);
+
+    v8::Local<v8::Object> object;
+    if (!Stream::newV8Object(isolate, context, stream, false).ToLocal(&object)) {
+      stream->abort("Stream handler failed");
+      return;
+    }
+    // Held strongly until the stream ends or is aborted
+    LoopQueue::StreamEnd &end = queue()->streams_[std::make_pair(stream->id_, false)];
+    end.stream = stream;
+    end.isolate = isolate;
+    end.context.Reset(isolate, context);
+    end.object.Reset(isolate, object);
+    end.async.reset(new V8AsyncContext(isolate, "AppBus.stream"));
+
+    std::vector<v8::Local<v8::Value>> vargs(1, object);
+    v8CallWithArgs(isolate, context, callback_->func_.Get(isolate), callback_->async_context_, vargs);
+  }
+};
+
+void AppBus::detachLoop(uv_loop_t *loop) {
+  std::vector<std::shared_ptr<EventHandlerHolder>> removed_events;
+  std::vector<std::shared_ptr<RequestHandlerHolder>> removed_requests;
+  std::vector<std::shared_ptr<StreamHandlerHolder>> removed_streams;
+  std::shared_ptr<LoopQueue> queue;
+
+  // No handler can be added for loop from here on, and no host call
+  // creates its queue again.
+  {
+    std::unique_lock<std::mutex> lock(loop_queues_mutex_);
+    auto iter = loop_queues_.find(loop);
+    if (iter != loop_queues_.end()) {
+      queue = std::move(iter->second);
+      loop_queues_.erase(iter);
+      queue->markDetached();
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::shared_ptr<const Registry> current = registry_;
+    std::shared_ptr<Registry> next(new Registry());
+
+    current->events.forEach([&](const std::string &event_key, const std::shared_ptr<const EventEntry> &old_entry) {
+      std::shared_ptr<EventEntry> entry(new EventEntry(*old_entry));
+      entry->handlers.clear();
+      for (auto iter = old_entry->handlers.begin(); iter != old_entry->handlers.end(); iter++) {
+        if ((*iter)->loop() == loop) {
+          subscriptions_.erase((*iter)->id_);
+          removed_events.push_back(*iter);
+        } else {
+          entry->handlers.push_back(*iter);
+        }
+      }
+      if (!entry->unused()) {
+        next->events.set(event_key.c_str(), event_key.length(), std::move(entry));
+      }
+    });
+    current->requests.forEach([&](const std::string &key, const std::shared_ptr<RequestHandlerHolder> &handler) {
+      if (handler->loop() == loop) {
+        removed_requests.push_back(handler);
+      } else {
+        next->requests.set(key.c_str(), key.length(), handler);
+      }
+    });
+    current->streams.forEach([&](const std::string &key, const std::shared_ptr<StreamHandlerHolder> &handler) {
+      if (handler->loop() == loop) {
+        removed_streams.push_back(handler);
+      } else {
+        next->streams.set(key.c_str(), key.length(), handler);
+      }
+    });
+
+    publishRegistry(std::move(next));
+  }
+
+  for (auto iter = removed_events.begin(); iter != removed_events.end(); iter++) {
+    (*iter)->markRemoved();
+    (*iter)->release();
+  }
+  for (auto iter = removed_requests.begin(); iter != removed_requests.end(); iter++) {
+    (*iter)->release();
+  }
+  for (auto iter = removed_streams.begin(); iter != removed_streams.end(); iter++) {
+    (*iter)->release();
+  }
+
+  // Nobody is left to answer requests routed to loop
+  cancelOutgoingRequests(loop, "Request handler was detached");
+
+  if (queue) {
+    LoopQueue::close(std::move(queue));
+  }
+}
+
+void AppBus::environmentCleanupHook(void *arg) {
+  EnvironmentCleanup *cleanup = static_cast<EnvironmentCleanup *>(arg);
+  AppBus *appbus = cleanup->appbus;
+  {
+    std::unique_lock<std::mutex> lock(appbus->loop_queues_mutex_);
+    std::vector<EnvironmentCleanup *> &cleanups = appbus->environment_cleanups_;
+    cleanups.erase(std::remove(cleanups.begin(), cleanups.end(), cleanup), cleanups.end());
+  }
+  appbus->detachLoop(cleanup->loop);
+  delete cleanup;
+}
+
+void AppBus::removeEnvironmentCleanup(EnvironmentCleanup *cleanup) {
+#if NODE_MAJOR_VERSION >= 10
+  node::RemoveEnvironmentCleanupHook(cleanup->isolate, environmentCleanupHook, cleanup);
+#endif
+  delete cleanup;
+}
+
+struct AppBus::EnvironmentCleanupRemove : LoopTask {
+  EnvironmentCleanup *cleanup_;
+
+  EnvironmentCleanupRemove(EnvironmentCleanup *cleanup) : cleanup_(cleanup) {}
+
+  void run() override {
+    removeEnvironmentCleanup(cleanup_);
+  }
+};
+
+void AppBus::v8Subscribe(const v8::FunctionCallbackInfo<v8::Value> &info, bool once) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Object> v_event_bus = info.This();
+  AppBus *self = static_cast<AppBus *>(v_event_bus->GetAlignedPointerFromInternalField(0));
+  uv_loop_t *loop = static_cast<uv_loop_t *>(v_event_bus->GetAlignedPointerFromInternalField(1));
+
+  if (info.Length() < 2) {
+    v8ThrowError("It must be two arguments");
+    return;
+  }
+
+  if (!info[0]->IsString()) {
+    v8ThrowError("The key must be a string");
+    return;
+  }
+
+  if (!info[1]->IsFunction()) {
+    v8ThrowError("The handler must be a function");
+    return;
+  }
+
+  std::shared_ptr<LoopQueue> queue = v8LoopQueue(self, loop);
+  if (!queue) {
+    return;
+  }
+  v8::String::Utf8Value event_key(isolate, info[0]);
+  std::shared_ptr<V8EventHandlerHolder>
+      handler_holder(new V8EventHandlerHolder(loop, std::move(queue), isolate, context, info[1].As<v8::Function>()));
+  SubscriptionId id = self->addEventHandler(*event_key, std::move(handler_holder), once);
+  info.GetReturnValue().Set(v8::Number::New(isolate, (double) id));
+}
+
+void AppBus::v8CallbackOn(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8Subscribe(info, false);
+}
+
+void AppBus::v8CallbackOnce(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8Subscribe(info, true);
+}
+
+/**
+ * off(subscriptionId) or off(key, handler)
+ */
+void AppBus::v8CallbackOff(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Object> v_event_bus = info.This();
+  AppBus *self = static_cast<AppBus *>(v_event_bus->GetAlignedPointerFromInternalField(0));
+
+  if (info.Length() >= 1 && info[0]->IsNumber()) {
+    SubscriptionId id = (SubscriptionId) info[0]->NumberValue(context).FromMaybe(0);
+    info.GetReturnValue().Set(v8::Boolean::New(isolate, self->off(id)));
+    return;
+  }
+
+  if (info.Length() < 2 || !info[0]->IsString() || !info[1]->IsFunction()) {
+    v8ThrowError("It must be a subscription id, or a key and a handler");
+    return;
+  }
+
+  v8::String::Utf8Value event_key(isolate, info[0]);
+  v8::Local<v8::Function> func = info[1].As<v8::Function>();
+  std::vector<SubscriptionId> ids;
+
+  {
+    RegistryRef snapshot = self->registry();
+    const std::shared_ptr<const EventEntry> *found = snapshot->events.find(*event_key, event_key.length());
+    if (found) {
+      for (auto iter = (*found)->handlers.begin(); iter != (*found)->handlers.end(); iter++) {
+        if ((*iter)->isolate() != isolate) {
+          continue;
+        }
+        V8EventHandlerHolder *holder = static_cast<V8EventHandlerHolder *>(iter->get());
+        if (holder->callback_ && holder->callback_->func_ == func) {
+          ids.push_back(holder->id_);
+        }
+      }
+    }
+  }
+
+  bool removed = false;
+  for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+    removed = self->off(*iter) || removed;
+  }
+  info.GetReturnValue().Set(v8::Boolean::New(isolate, removed));
+}
+
+AppBus::RegistryRef AppBus::registry() const {
+  RegistryCache &cache = registry_cache_;
+  uint64_t version = registry_version_.load(std::memory_order_acquire);
+  if (cache.instance_id == instance_id_ && cache.version == version) {
+    if (cache.pins) {
+      return RegistryRef(&cache);
+    }
+    // Unchanged since it was cached, so registry_ still holds it
+    cache.registry = cache.weak.lock();
+    if (cache.registry) {
+      return RegistryRef(&cache);
+    }
+  }
+
+  std::shared_ptr<const Registry> current;
+  {
+    std::unique_lock<std::mutex> lock(registry_mutex_);
+    current = registry_;
+    version = registry_version_.load(std::memory_order_relaxed);
+  }
+  if (cache.pins) {
+    return RegistryRef(std::move(current));
+  }
+  cache.instance_id = instance_id_;
+  cache.version = version;
+  cache.weak = current;
+  cache.registry = std::move(current);
+  return RegistryRef(&cache);
+}
+
+void AppBus::publishRegistry(std::shared_ptr<Registry> next) {
+  std::shared_ptr<TopicTrie<std::shared_ptr<const EventEntry>>> topics;
+  next->has_schemas = false;
+  next->events.forEach([&topics, &next](const std::string &event_key, const std::shared_ptr<const EventEntry> &entry) {
+    if (entry->schema) {
+      next->has_schemas = true;
+    }
+    if (TopicTrie<std::shared_ptr<const EventEntry>>::isPattern(event_key.data(), event_key.length())) {
+      if (!topics) {
+        topics.reset(new TopicTrie<std::shared_ptr<const EventEntry>>());
+      }
+      topics->insert(event_key.data(), event_key.length(), entry);
+    }
+  });
+  next->topics = std::move(topics);
+
+  next->event_ids.clear();
+  next->event_ids.resize(event_ids_.size());
+  for (size_t i = 0; i < event_ids_.size(); i++) {
+    const std::string &event_key = event_ids_[i];
+    std::vector<std::shared_ptr<const EventEntry>> &entries = next->event_ids[i];
+    const std::shared_ptr<const EventEntry> *found = next->events.find(event_key.c_str(), event_key.length());
+    if (found) {
+      entries.push_back(*found);
+    }
+    if (next->topics) {
+      auto match = [&entries, found](const std::shared_ptr<const EventEntry> &entry) -> void {
+        if (!found || entry != *found) {
+          entries.push_back(entry);
+        }
+      };
+      next->topics->match(event_key.c_str(), event_key.length(), match);
+    }
+  }
+  // The old registry is released outside the lock
+  std::shared_ptr<const Registry> previous;
+  {
+    std::unique_lock<std::mutex> lock(registry_mutex_);
+    previous = std::move(registry_);
+    registry_ = std::move(next);
+    registry_version_.fetch_add(1, std::memory_order_release);
+  }
+}
+
+AppBus::SubscriptionId AppBus::addEventHandler(const char *event_key,
+                                               std::shared_ptr<EventHandlerHolder> handler,
+                                               bool once) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // detachLoop() marks the queue before it takes mutex_ to remove handlers
+  if (handler->queue()->detached()) {
+    return 0;
+  }
+  SubscriptionId id = ++next_subscription_id_;
+  handler->appbus_ = this;
+  handler->id_ = id;
+  handler->once_ = once;
+  subscriptions_.emplace(id, event_key);
+
+  std::shared_ptr<const Registry> current = registry_;
+  std::shared_ptr<EventEntry> entry(new EventEntry());
+  const std::shared_ptr<const EventEntry> *found = current->events.find(event_key);
+  if (found) {
+    *entry = **found;
+  }
+  entry->handlers.push_back(std::move(handler));
+
+  std::shared_ptr<Registry> next(new Registry(*current));
+  next->events.set(event_key, std::move(entry));
+  publishRegistry(std::move(next));
+  return id;
+}
+
+bool AppBus::addRequestHandler(const char *key, std::shared_ptr<RequestHandlerHolder> handler) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (handler->queue()->detached()) {
+    return false;
+  }
+  std::shared_ptr<const Registry> current = registry_;
+  std::shared_ptr<Registry> next(new Registry(*current));
+  next->requests.set(key, std::move(handler));
+  publishRegistry(std::move(next));
+  return true;
+}
+
+void AppBus::setQueueLimit(const char *event_key, size_t limit, OverflowPolicy policy) {
+  updateEventEntry(event_key, [limit, policy](EventEntry &entry) -> void {
+    entry.queue_limit = limit;
+    entry.overflow = policy;
+  });
+}
+
+void AppBus::setKeyCacheLimit(size_t max_keys) {
+  json_key_cache_limit.store(max_keys, std::memory_order_relaxed);
+}
+
+AppBus::KeyCacheStats AppBus::getKeyCacheStats(uv_loop_t *loop) {
+  if (!loop) loop = loop_;
+  std::shared_ptr<LoopQueue> queue = getLoopQueue(loop);
+  if (!queue) {
+    KeyCacheStats stats = {0, 0, 0};
+    return stats;
+  }
+  return queue->keyCacheStats();
+}
+
+bool AppBus::setDrainBudget(uv_loop_t *loop, uint64_t budget_us, size_t max_messages, uint64_t bulk_budget_us) {
+  std::shared_ptr<LoopQueue> queue = getLoopQueue(loop);
+  if (!queue) {
+    return false;
+  }
+  queue->setBudget(budget_us * 1000, max_messages, bulk_budget_us * 1000);
+  return true;
+}
+
+void AppBus::setPriority(const char *event_key, Priority priority) {
+  updateEventEntry(event_key, [priority](EventEntry &entry) -> void {
+    entry.priority = priority;
+  });
+}
+
+void AppBus::setCoalescing(const char *event_key, bool enabled) {
+  updateEventEntry(event_key, [enabled](EventEntry &entry) -> void {
+    entry.coalesce = enabled;
+  });
+}
+
+template<class F>
+void AppBus::updateEventEntry(const char *event_key, F update) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::shared_ptr<const Registry> current = registry_;
+  std::shared_ptr<EventEntry> entry(new EventEntry());
+  const std::shared_ptr<const EventEntry> *found = current->events.find(event_key);
+  if (found) {
+    *entry = **found;
+  }
+  update(*entry);
+
+  std::shared_ptr<Registry> next(new Registry(*current));
+  if (entry->unused()) {
+    next->events.erase(event_key, strlen(event_key));
+  } else {
+    next->events.set(event_key, std::move(entry));
+  }
+  publishRegistry(std::move(next));
+}
+
+bool AppBus::deliverBounded(const EventEntry &entry,
+                            const std::shared_ptr<EventHandlerHolder> &handler,
+                            const std::shared_ptr<EventMessage> &message) {
+  bool accepted = true;
+  bool schedule = false;
+  std::shared_ptr<EventMessage> dropped;
+  std::deque<std::shared_ptr<EventMessage>> replaced;
+  {
+    std::unique_lock<std::mutex> lock(handler->mailbox_mutex_);
+    if (entry.coalesce) {
+      // Only the newest value is worth delivering
+      accepted = handler->mailbox_.empty();
+      replaced.swap(handler->mailbox_);
+    } else if (handler->mailbox_.size() >= entry.queue_limit) {
+      switch (entry.overflow) {
+        case kOverflowBlock:
+          // Waiting on the handler's own loop would never end
+          if (!handler->queue()->onLoopThread()) {
+            handler->mailbox_space_.wait(lock, [&handler, &entry]() -> bool {
+              return handler->mailbox_.size() < entry.queue_limit ||
+                  handler->removed_.load(std::memory_order_acquire);
+            });
+          }
+          break;
+        case kOverflowDropOldest:
+          dropped = std::move(handler->mailbox_.front());
+          handler->mailbox_.pop_front();
+          accepted = false;
+          break;
+        case kOverflowDropNewest:
+          return false;
+        case kOverflowCoalesce:
+          dropped = std::move(handler->mailbox_.back());
+          handler->mailbox_.pop_back();
+          accepted = false;
+          break;
+      }
+    }
+    if (handler->removed_.load(std::memory_order_acquire)) {
+      return accepted;
+    }
+    handler->mailbox_.push_back(message);
+    if (!handler->mailbox_scheduled_) {
+      handler->mailbox_scheduled_ = true;
+      schedule = true;
+    }
+  }
+  if (schedule) {
+    handler->queue()->push(new MailboxDrain(handler), entry.priority);
+  }
+  return accepted;
+}
+
+bool AppBus::deliver(const EventEntry &entry, const std::shared_ptr<EventMessage> &message) {
+  bool accepted = true;
+  for (auto iter = entry.handlers.begin(); iter != entry.handlers.end(); iter++) {
+    if (entry.bounded()) {
+      accepted = deliverBounded(entry, *iter, message) && accepted;
+    } else {
+      (*iter)->queue()->push(new EventDelivery(message, *iter), entry.priority);
+    }
+  }
+  return accepted;
+}
+
+static std::atomic<uint64_t> next_schema_id(0);
+
+AppBus::Schema::Schema(const void *type, std::function<std::shared_ptr<void>()> create)
+    : id_(++next_schema_id), type_(type), create_(std::move(create)) {}
+
+AppBus::SchemaCache &AppBus::Schema::cache(LoopQueue *queue, v8::Isolate *isolate) const {
+  std::unique_ptr<SchemaCache> &cache = queue->schema_caches_[std::make_pair(id_, isolate)];
+  if (!cache) {
+    // One hidden class per schema: every instance gets the fields in order
+    cache.reset(new SchemaCache());
+    v8::Local<v8::ObjectTemplate> templ = v8::ObjectTemplate::New(isolate);
+    for (auto iter = fields_.begin(); iter != fields_.end(); iter++) {
+      v8::Local<v8::String> name = v8::String::NewFromUtf8(isolate, iter->name.c_str(),
+                                                           v8::NewStringType::kInternalized,
+                                                           iter->name.length()).ToLocalChecked();
+      templ->Set(name, v8::Undefined(isolate));
+      cache->names.emplace_back(isolate, name);
+    }
+    cache->templ.Reset(isolate, templ);
+  }
+  return *cache;
+}
+
+v8::Local<v8::Object> AppBus::Schema::toV8(LoopQueue *queue,
+                                           v8::Isolate *isolate,
+                                           v8::Local<v8::Context> context,
+                                           const void *record) const {
+  SchemaCache &schema_cache = cache(queue, isolate);
+  v8::Local<v8::Object> object = schema_cache.templ.Get(isolate)->NewInstance(context).ToLocalChecked();
+  const char *base = static_cast<const char *>(record);
+  for (size_t i = 0; i < fields_.size(); i++) {
+    const Field &field = fields_[i];
+    const void *member = base + field.offset;
+    v8::Local<v8::Value> value;
+    switch (field.type) {
+      case kBool:
+        value = v8::Boolean::New(isolate, *static_cast<const bool *>(member));
+        break;
+      case kInt32:
+        value = v8::Int32::New(isolate, *static_cast<const int32_t *>(member));
+        break;
+      case kUint32:
+        value = v8::Uint32::NewFromUnsigned(isolate, *static_cast<const uint32_t *>(member));
+        break;
+      case kInt64: {
+        // Same as JsonV8Builder
+        int64_t int64_value = *static_cast<const int64_t *>(member);
+        if (int64_value >= INT32_MIN && int64_value <= INT32_MAX) {
+          value = v8::Int32::New(isolate, (int32_t) int64_value);
+        } else {
+          value = v8::BigInt::New(isolate, int64_value);
+        }
+        break;
+      }
+      case kDouble:
+        value = v8::Number::New(isolate, *static_cast<const double *>(member));
+        break;
+      case kString: {
+        const std::string &string_value = *static_cast<const std::string *>(member);
+        value = v8::String::NewFromUtf8(isolate, string_value.data(), v8::NewStringType::kNormal,
+                                        string_value.length()).ToLocalChecked();
+        break;
+      }
+    }
+    object->Set(context, schema_cache.names[i].Get(isolate), value).FromMaybe(false);
+  }
+  return object;
+}
+
+std::shared_ptr<void> AppBus::Schema::fromV8(LoopQueue *queue,
+                                             v8::Isolate *isolate,
+                                             v8::Local<v8::Context> context,
+                                             v8::Local<v8::Object> object) const {
+  SchemaCache &schema_cache = cache(queue, isolate);
+  std::shared_ptr<void> record = create_();
+  char *base = static_cast<char *>(record.get());
+  for (size_t i = 0; i < fields_.size(); i++) {
+    const Field &field = fields_[i];
+    void *member = base + field.offset;
+    v8::Local<v8::Value> value;
+    if (!object->Get(context, schema_cache.names[i].Get(isolate)).ToLocal(&value)) {
+      return nullptr;
+    }
+    switch (field.type) {
+      case kBool:
+        if (value->IsBoolean()) *static_cast<bool *>(member) = value->IsTrue();
+        break;
+      case kInt32:
+        if (value->IsNumber()) *static_cast<int32_t *>(member) = value->Int32Value(context).FromMaybe(0);
+        break;
+      case kUint32:
+        if (value->IsNumber()) *static_cast<uint32_t *>(member) = value->Uint32Value(context).FromMaybe(0);
+        break;
+      case kInt64:
+        if (value->IsBigInt()) {
+          *static_cast<int64_t *>(member) = value.As<v8::BigInt>()->Int64Value();
+        } else if (value->IsNumber()) {
+          *static_cast<int64_t *>(member) = (int64_t) value.As<v8::Number>()->Value();
+        }
+        break;
+      case kDouble:
+        if (value->IsNumber()) *static_cast<double *>(member) = value.As<v8::Number>()->Value();
+        break;
+      case kString:
+        if (value->IsString()) {
+          v8::String::Utf8Value utf8_value(isolate, value);
+          static_cast<std::string *>(member)->assign(*utf8_value, utf8_value.length());
+        }
+        break;
+    }
+  }
+  return record;
+}
+
+void AppBus::Schema::toJson(const void *record,
+                            rapidjson::Value &target,
+                            rapidjson::Document::AllocatorType &allocator) const {
+  const char *base = static_cast<const char *>(record);
+  target.SetObject();
+  for (auto iter = fields_.begin(); iter != fields_.end(); iter++) {
+    const void *member = base + iter->offset;
+    rapidjson::Value name(iter->name.c_str(), iter->name.length(), allocator);
+    rapidjson::Value value;
+    switch (iter->type) {
+      case kBool:
+        value.SetBool(*static_cast<const bool *>(member));
+        break;
+      case kInt32:
+        value.SetInt(*static_cast<const int32_t *>(member));
+        break;
+      case kUint32:
+        value.SetUint(*static_cast<const uint32_t *>(member));
+        break;
+      case kInt64:
+        value.SetInt64(*static_cast<const int64_t *>(member));
+        break;
+      case kDouble:
+        value.SetDouble(*static_cast<const double *>(member));
+        break;
+      case kString: {
+        const std::string &string_value = *static_cast<const std::string *>(member);
+        value.SetString(string_value.data(), string_value.length(), allocator);
+        break;
+      }
+    }
+    target.AddMember(name, value, allocator);
+  }
+}
+
+std::shared_ptr<void> AppBus::Schema::fromJson(const rapidjson::Value &object) const {
+  if (!object.IsObject()) {
+    return nullptr;
+  }
+  std::shared_ptr<void> record = create_();
+  char *base = static_cast<char *>(record.get());
+  for (auto iter = fields_.begin(); iter != fields_.end(); iter++) {
+    void *member = base + iter->offset;
+    rapidjson::Value::ConstMemberIterator found =
+        object.FindMember(rapidjson::Value(rapidjson::StringRef(iter->name.c_str(), iter->name.length())));
+    if (found == object.MemberEnd()) {
+      continue;
+    }
+    const rapidjson::Value &value = found->value;
+    switch (iter->type) {
+      case kBool:
+        if (value.IsBool()) *static_cast<bool *>(member) = value.GetBool();
+        break;
+      case kInt32:
+        if (value.IsInt()) *static_cast<int32_t *>(member) = value.GetInt();
+        break;
+      case kUint32:
+        if (value.IsUint()) *static_cast<uint32_t *>(member) = value.GetUint();
+        break;
+      case kInt64:
+        if (value.IsInt64()) *static_cast<int64_t *>(member) = value.GetInt64();
+        break;
+      case kDouble:
+        if (value.IsNumber()) *static_cast<double *>(member) = value.GetDouble();
+        break;
+      case kString:
+        if (value.IsString()) static_cast<std::string *>(member)->assign(value.GetString(), value.GetStringLength());
+        break;
+    }
+  }
+  return record;
+}
+
+void AppBus::setSchema(const char *event_key, std::shared_ptr<const Schema> schema) {
+  updateEventEntry(event_key, [&schema](EventEntry &entry) -> void {
+    entry.schema = std::move(schema);
+  });
+}
+
+AppBus::SubscriptionId AppBus::onRecordImpl(const char *event_key,
+                                            const void *type,
+                                            std::function<void(const void *record)> handler,
+                                            uv_loop_t *loop) {
+  if (!loop) loop = loop_;
+  std::shared_ptr<LoopQueue> queue = getLoopQueue(loop);
+  if (!queue) {
+    return 0;
+  }
+  std::shared_ptr<HostRecordHandlerHolder>
+      handler_holder(new HostRecordHandlerHolder(loop, std::move(queue), type, std::move(handler)));
+  return addEventHandler(event_key, std::move(handler_holder));
+}
+
+bool AppBus::emitRecordImpl(const char *event_key, const void *type, std::shared_ptr<const void> record) {
+  RegistryRef snapshot = registry();
+  size_t length = strlen(event_key);
+  const std::shared_ptr<const EventEntry> *found = snapshot->events.find(event_key, length);
+  if (!found || !(*found)->schema || (*found)->schema->type_ != type) {
+    return false;
+  }
+
+  std::shared_ptr<EventMessage> message = std::make_shared<EventMessage>();
+  message->schema = (*found)->schema;
+  message->record = std::move(record);
+  bool needs_json = false;
+  snapshot->forEachEntry(event_key, length, [&needs_json](const EventEntry &entry) -> void {
+    for (auto iter = entry.handlers.begin(); iter != entry.handlers.end(); iter++) {
+      if (!((*iter)->formats() & EventHandlerHolder::kTakesRecords)) {
+        needs_json = true;
+      }
+    }
+  });
+  if (needs_json) {
+    rapidjson::Value jsonValue;
+    message->schema->toJson(message->record.get(), jsonValue, message->args.GetAllocator());
+    message->args.PushBack(jsonValue, message->args.GetAllocator());
+  }
+
+  bool accepted = true;
+  snapshot->forEachEntry(event_key, length, [&accepted, &message](const EventEntry &entry) -> void {
+    accepted = deliver(entry, message) && accepted;
+  });
+  return accepted;
+}
+
+AppBus::EventId AppBus::eventId(const char *event_key) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < event_ids_.size(); i++) {
+    if (event_ids_[i] == event_key) {
+      return (EventId) i;
+    }
+  }
+  EventId event_id = (EventId) event_ids_.size();
+  event_ids_.push_back(event_key);
+
+  std::shared_ptr<const Registry> current = registry_;
+  publishRegistry(std::make_shared<Registry>(*current));
+  return event_id;
+}
+
+/**
+ * Gives a JSON message of a single object a record as well, when it goes
+ * to a schema channel with listeners that take records only.
+ */
+template<class... Key>
+void AppBus::attachRecord(const Registry &snapshot, EventMessage &message, Key... key) {
+  if (!snapshot.has_schemas || message.binary || message.args.Size() != 1 || !message.args[0].IsObject()) {
+    return;
+  }
+  std::shared_ptr<const Schema> schema;
+  bool needs_record = false;
+  snapshot.forEachEntry(key..., [&schema, &needs_record](const EventEntry &entry) -> void {
+    if (entry.schema && !schema) {
+      schema = entry.schema;
+    }
+    for (auto iter = entry.handlers.begin(); iter != entry.handlers.end(); iter++) {
+      if (!((*iter)->formats() & EventHandlerHolder::kTakesJson)) {
+        needs_record = true;
+      }
+    }
+  });
+  if (schema && needs_record) {
+    message.record = schema->fromJson(message.args[0]);
+    if (message.record) {
+      message.schema = std::move(schema);
+    }
+  }
+}
+
+bool AppBus::emitImpl(const char *event_key, std::shared_ptr<EventMessage> message) {
+  RegistryRef snapshot = registry();
+  size_t length = strlen(event_key);
+  attachRecord(*snapshot, *message, event_key, length);
+  bool accepted = true;
+  snapshot->forEachEntry(event_key, length, [&accepted, &message](const EventEntry &entry) -> void {
+    accepted = deliver(entry, message) && accepted;
+  });
+  return accepted;
+}
+
+bool AppBus::emitImpl(EventId event_id, std::shared_ptr<EventMessage> message) {
+  RegistryRef snapshot = registry();
+  attachRecord(*snapshot, *message, event_id);
+  bool accepted = true;
+  snapshot->forEachEntry(event_id, [&accepted, &message](const EventEntry &entry) -> void {
+    accepted = deliver(entry, message) && accepted;
+  });
+  return accepted;
+}
+
+std::shared_ptr<AppBus::EventMessage> AppBus::newJsonMessage(rapidjson::Value &args, bool single_argument) {
+  if (!single_argument && !args.IsArray()) {
+    return nullptr;
+  }
+  std::shared_ptr<EventMessage> message = std::make_shared<EventMessage>();
+  if (single_argument) {
+    rapidjson::Value jsonValue;
+    jsonValue.CopyFrom(args, message->args.GetAllocator());
+    message->args.PushBack(jsonValue, message->args.GetAllocator());
+  } else {
+    for (auto iter = args.Begin(); iter != args.End(); iter++) {
+      rapidjson::Value jsonValue;
+      jsonValue.CopyFrom(*iter, message->args.GetAllocator());
+      message->args.PushBack(jsonValue, message->args.GetAllocator());
+    }
+  }
+  return message;
+}
+
+std::shared_ptr<AppBus::EventMessage> AppBus::newJsonMessage(rapidjson::Document &&args, bool single_argument) {
+  if (!single_argument && !args.IsArray()) {
+    return nullptr;
+  }
+  std::shared_ptr<EventMessage> message = std::make_shared<EventMessage>();
+  // Swapping documents exchanges their allocators too
+  message->args.Swap(args);
+  if (single_argument) {
+    rapidjson::Value jsonValue;
+    jsonValue.Swap(message->args);
+    message->args.SetArray();
+    message->args.PushBack(jsonValue, message->args.GetAllocator());
+  }
+  return message;
+}
+
+std::shared_ptr<AppBus::EventMessage> AppBus::newBinaryMessage(BinaryWriter &writer) {
+  std::shared_ptr<EventMessage> message = std::make_shared<EventMessage>();
+  message->binary.reset(new BinaryPayload(writer.release()));
+  return message;
+}
+
+bool AppBus::emitBatch(std::vector<std::pair<std::string, std::shared_ptr<EventMessage>>> &events) {
+  RegistryRef snapshot = registry();
+  bool accepted = true;
+  // A bus rarely spans more than a couple of loops and lanes
+  std::vector<std::pair<LoopQueue *, BatchDelivery *>> tasks;
+
+  for (auto event_iter = events.begin(); event_iter != events.end(); event_iter++) {
+    const std::shared_ptr<EventMessage> &message = event_iter->second;
+    attachRecord(*snapshot, *message, event_iter->first.c_str(), event_iter->first.length());
+    snapshot->forEachEntry(event_iter->first.c_str(), event_iter->first.length(), [&](const EventEntry &entry) -> void {
+      if (entry.bounded()) {
+        // Bounded listeners are fed through their mailboxes
+        accepted = deliver(entry, message) && accepted;
+        return;
+      }
+      for (auto iter = entry.handlers.begin(); iter != entry.handlers.end(); iter++) {
+        LoopQueue *queue = (*iter)->queue();
+        BatchDelivery *task = nullptr;
+        for (auto task_iter = tasks.begin(); task_iter != tasks.end(); task_iter++) {
+          if (task_iter->first == queue && task_iter->second->priority_ == entry.priority) {
+            task = task_iter->second;
+            break;
+          }
+        }
+        if (!task) {
+          task = new BatchDelivery(entry.priority);
+          tasks.emplace_back(queue, task);
+        }
+        task->deliveries_.emplace_back(*iter, message);
+      }
+    });
+  }
+
+  for (auto iter = tasks.begin(); iter != tasks.end(); iter++) {
+    iter->first->push(iter->second, iter->second->priority_);
+  }
+  return accepted;
+}
+
+bool AppBus::emit(EventId event_id, rapidjson::Value &args, bool single_argument) {
+  std::shared_ptr<EventMessage> message = newJsonMessage(args, single_argument);
+  return message && this->emitImpl(event_id, std::move(message));
+}
+
+bool AppBus::emit(EventId event_id, rapidjson::Document &&args, bool single_argument) {
+  std::shared_ptr<EventMessage> message = newJsonMessage(std::move(args), single_argument);
+  return message && this->emitImpl(event_id, std::move(message));
+}
+
+bool AppBus::emit(EventId event_id) {
+  std::shared_ptr<EventMessage> message = std::make_shared<EventMessage>();
+  return this->emitImpl(event_id, message);
+}
+
+bool AppBus::emitBinary(EventId event_id, BinaryWriter &writer) {
+  return this->emitImpl(event_id, newBinaryMessage(writer));
+}
+
+bool AppBus::emit(const char *event_key, rapidjson::Value &args, bool single_argument) {
+  std::shared_ptr<EventMessage> message = newJsonMessage(args, single_argument);
+  return message && this->emitImpl(event_key, std::move(message));
+}
+
+bool AppBus::emit(const char *event_key, rapidjson::Document &&args, bool single_argument) {
+  std::shared_ptr<EventMessage> message = newJsonMessage(std::move(args), single_argument);
+  return message && this->emitImpl(event_key, std::move(message));
+}
+
+bool AppBus::emit(const char *event_key) {
+  std::shared_ptr<EventMessage> message = std::make_shared<EventMessage>();
+  return this->emitImpl(event_key, message);
+}
+
+bool AppBus::emit(const char *event_key, BinaryBuffer buffer) {
+  BinaryWriter writer;
+  writer.writeArrayBuffer(std::move(buffer));
+  return emitBinary(event_key, writer);
+}
+
+bool AppBus::emitBinary(const char *event_key, BinaryWriter &writer) {
+  return this->emitImpl(event_key, newBinaryMessage(writer));
+}
+
+bool AppBus::emitJson(const char *event_key, const char *json, size_t length) {
+  return emitJson(event_key, std::string(json, length));
+}
+
+bool AppBus::emitJson(const char *event_key, std::string &&json) {
+  RegistryRef snapshot = registry();
+  size_t length = strlen(event_key);
+  size_t text_handlers = 0;
+  bool needs_json = false;
+  snapshot->forEachEntry(event_key, length, [&text_handlers, &needs_json](const EventEntry &entry) -> void {
+    for (auto iter = entry.handlers.begin(); iter != entry.handlers.end(); iter++) {
+      if ((*iter)->formats() & EventHandlerHolder::kTakesJsonText) {
+        text_handlers++;
+      } else {
+        needs_json = true;
+      }
+    }
+  });
+
+  std::shared_ptr<EventMessage> message = std::make_shared<EventMessage>();
+  if (needs_json) {
+    rapidjson::Document parsed(&message->args.GetAllocator());
+    parsed.Parse(json.data(), json.length());
+    if (parsed.HasParseError()) {
+      return false;
+    }
+    message->args.PushBack(static_cast<rapidjson::Value &>(parsed), message->args.GetAllocator());
+    attachRecord(*snapshot, *message, event_key, length);
+  }
+  if (text_handlers) {
+    message->text.reset(new std::string(std::move(json)));
+    message->text_insitu = text_handlers == 1;
+  }
+
+  bool accepted = true;
+  snapshot->forEachEntry(event_key, length, [&accepted, &message](const EventEntry &entry) -> void {
+    accepted = deliver(entry, message) && accepted;
+  });
+  return accepted;
+}
+
+void AppBus::Batch::emit(const char *event_key, rapidjson::Value &args, bool single_argument) {
+  std::shared_ptr<EventMessage> message = newJsonMessage(args, single_argument);
+  if (message) {
+    events_.emplace_back(event_key, std::move(message));
+  }
+}
+
+void AppBus::Batch::emit(const char *event_key, rapidjson::Document &&args, bool single_argument) {
+  std::shared_ptr<EventMessage> message = newJsonMessage(std::move(args), single_argument);
+  if (message) {
+    events_.emplace_back(event_key, std::move(message));
+  }
+}
+
+void AppBus::Batch::emit(const char *event_key) {
+  events_.emplace_back(event_key, std::make_shared<EventMessage>());
+}
+
+void AppBus::Batch::emit(const char *event_key, BinaryBuffer buffer) {
+  BinaryWriter writer;
+  writer.writeArrayBuffer(std::move(buffer));
+  emitBinary(event_key, writer);
+}
+
+void AppBus::Batch::emitBinary(const char *event_key, BinaryWriter &writer) {
+  events_.emplace_back(event_key, newBinaryMessage(writer));
+}
+
+bool AppBus::Batch::flush() {
+  if (events_.empty()) {
+    return true;
+  }
+  bool accepted = appbus_->emitBatch(events_);
+  events_.clear();
+  return accepted;
+}
+
+/** The JS counterpart of makeRequestError(). */
+static v8::Local<v8::Value> v8MakeError(v8::Isolate *isolate, const char *code, int err, const std::string &message) {
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::String> obj_code_key = v8PropertyName(isolate, "code");
+  v8::Local<v8::String> obj_code_value =
+      v8::String::NewFromUtf8(isolate, code, v8::NewStringType::kNormal).ToLocalChecked();
+  v8::Local<v8::String> obj_errno_key = v8PropertyName(isolate, "errno");
+  v8::Local<v8::Integer> obj_errno_value = v8::Integer::New(isolate, err);
+  v8::Local<v8::String> msg =
+      v8::String::NewFromUtf8(isolate, message.c_str(), v8::NewStringType::kNormal, (int) message.length())
+          .ToLocalChecked();
+  v8::Local<v8::Value> err_value = v8::Exception::Error(msg);
+  v8::Local<v8::Object> err_obj = err_value.As<v8::Object>();
+  err_obj->Set(context, obj_code_key, obj_code_value).FromMaybe(false);
+  err_obj->Set(context, obj_errno_key, obj_errno_value).FromMaybe(false);
+  return err_obj;
+}
+
+v8::Local<v8::Value> AppBus::v8NoRequestHandlerError(v8::Isolate *isolate) {
+  return v8MakeError(isolate, "ENOFUNC", -2, "Not registered request key");
+}
+
+std::shared_ptr<AppBus::RequestHandlerHolder> AppBus::findRequestHandler(const char *key, size_t length) const {
+  RegistryRef snapshot = registry();
+  const std::shared_ptr<RequestHandlerHolder> *found = snapshot->requests.find(key, length);
+  return found ? *found : nullptr;
+}
+
+void AppBus::requestFromNode(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::String::Utf8Value reqid(isolate, info[1]);
+  v8::String::Utf8Value key(isolate, info[2]);
+  v8::Local<v8::Array> v8args = info[3].As<v8::Array>();
+  std::shared_ptr<RequestHandlerHolder> req_handler = findRequestHandler(*key, key.length());
+
+  if (req_handler) {
+    std::shared_ptr<RequestMessage> message(new RequestMessage(*reqid));
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+    for (uint32_t i = 0, n = v8args->Length(); i < n; i++) {
+      rapidjson::Value jsonValue;
+      v8::Local<v8::Value> varg;
+      if (!v8args->Get(context, i).ToLocal(&varg) ||
+          !v8ValueToJsonObject(jsonValue, message->args.GetAllocator(), isolate, varg)) {
+        return;
+      }
+      message->args.PushBack(jsonValue, message->args.GetAllocator());
+    }
+    message->respond =
+        [appbus = this, reqid = message->reqid](const rapidjson::Document &retval, bool is_throw) -> void {
+          rapidjson::Document args(rapidjson::kArrayType);
+          rapidjson::Value json_reqid;
+          rapidjson::Value json_type;
+          rapidjson::Value json_data;
+          json_reqid.SetString(reqid.c_str(), reqid.length(), args.GetAllocator());
+          json_type.SetInt(is_throw ? 0 : 1);
+          json_data.CopyFrom(retval, args.GetAllocator());
+          args.PushBack(json_reqid, args.GetAllocator());
+          args.PushBack(json_type, args.GetAllocator());
+          args.PushBack(json_data, args.GetAllocator());
+          appbus->emit("$response.node", args);
+        };
+    req_handler->handle(message);
+  } else {
+    isolate->ThrowException(v8NoRequestHandlerError(isolate));
+  }
+}
+
+/**
+ * request(key, ...args): returns a promise settled by the host's response.
+ */
+void AppBus::v8CallbackRequest(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Object> v_event_bus = info.This();
+  AppBus *self = static_cast<AppBus *>(v_event_bus->GetAlignedPointerFromInternalField(0));
+  uv_loop_t *loop = static_cast<uv_loop_t *>(v_event_bus->GetAlignedPointerFromInternalField(1));
+
+  if (info.Length() < 1 || !info[0]->IsString()) {
+    v8ThrowError("The key must be a string");
+    return;
+  }
+
+  v8::Local<v8::Promise::Resolver> resolver;
+  if (!v8::Promise::Resolver::New(context).ToLocal(&resolver)) {
+    return;
+  }
+  info.GetReturnValue().Set(resolver->GetPromise());
+
+  v8::String::Utf8Value key(isolate, info[0]);
+  std::shared_ptr<RequestHandlerHolder> req_handler = self->findRequestHandler(*key, key.length());
+  if (!req_handler) {
+    resolver->Reject(context, v8NoRequestHandlerError(isolate)).FromMaybe(false);
+    return;
+  }
+
+  std::shared_ptr<RequestMessage> message(new RequestMessage(std::string()));
+  {
+    v8::TryCatch try_catch(isolate);
+    for (int i = 1; i < info.Length(); i++) {
+      rapidjson::Value jsonValue;
+      if (!v8ValueToJsonObject(jsonValue, message->args.GetAllocator(), isolate, info[i])) {
+        resolver->Reject(context, try_catch.Exception()).FromMaybe(false);
+        return;
+      }
+      message->args.PushBack(jsonValue, message->args.GetAllocator());
+    }
+  }
+  std::shared_ptr<LoopQueue> queue = self->getLoopQueue(loop);
+  if (!queue) {
+    v8::Local<v8::Value> error = v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "The bus is detached from this loop", v8::NewStringType::kNormal)
+            .ToLocalChecked());
+    resolver->Reject(context, error).FromMaybe(false);
+    return;
+  }
+  uint64_t id = queue->addPendingRequest(isolate, context, resolver);
+  message->respond = [queue, id](const rapidjson::Document &retval, bool is_throw) -> void {
+    queue->push(new ResponseTask(queue.get(), id, retval, is_throw));
+  };
+  req_handler->handle(message);
+}
+
+/**
+ * onRequest(key, handler): handler(...args) returns the response or a promise of it.
+ */
+void AppBus::v8CallbackOnRequest(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Object> v_event_bus = info.This();
+  AppBus *self = static_cast<AppBus *>(v_event_bus->GetAlignedPointerFromInternalField(0));
+  uv_loop_t *loop = static_cast<uv_loop_t *>(v_event_bus->GetAlignedPointerFromInternalField(1));
+
+  if (info.Length() < 2) {
+    v8ThrowError("It must be two arguments");
+    return;
+  }
+
+  if (!info[0]->IsString()) {
+    v8ThrowError("The key must be a string");
+    return;
+  }
+
+  if (!info[1]->IsFunction()) {
+    v8ThrowError("The handler must be a function");
+    return;
+  }
+
+  std::shared_ptr<LoopQueue> queue = v8LoopQueue(self, loop);
+  if (!queue) {
+    return;
+  }
+  v8::String::Utf8Value key(isolate, info[0]);
+  std::shared_ptr<V8RequestHandlerHolder> handler_holder(
+      new V8RequestHandlerHolder(self, loop, std::move(queue), isolate, context, info[1].As<v8::Function>()));
+  self->addRequestHandler(*key, std::move(handler_holder));
+}
+
+void AppBus::v8CallbackEmit(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Object> v_event_bus = info.This();
+  AppBus *self = static_cast<AppBus *>(v_event_bus->GetAlignedPointerFromInternalField(0));
+
+  if (info.Length() < 1) {
+    v8ThrowError("At least one argument is required");
+    return;
+  }
+
+  if (info[0]->IsUint32()) {
+    v8EmitTo(info, self, (EventId) info[0].As<v8::Uint32>()->Value());
+    return;
+  }
+
+  if (!info[0]->IsString()) {
+    v8ThrowError("The key must be a string or an event id");
+    return;
+  }
+
+  v8::String::Utf8Value event_key(isolate, info[0]);
+
+  if (strcmp(*event_key, "$request") == 0) {
+    self->requestFromNode(info);
+    return;
+  }
+
+  v8EmitTo(info, self, (const char *) *event_key, (size_t) event_key.length());
+}
+
+/**
+ * key is either an EventId or a key and its length.
+ */
+template<class... Key>
+void AppBus::v8EmitTo(const v8::FunctionCallbackInfo<v8::Value> &info, AppBus *self, Key... key) {
+  v8::Isolate *isolate = info.GetIsolate();
+
+  // One snapshot is used both for choosing the payload representation
+  // and for queueing the deliveries.
+  RegistryRef snapshot = self->registry();
+  bool has_handlers = false;
+  bool same_isolate_only = true;
+  bool needs_json = false;
+  bool needs_document = false;
+  size_t handler_count = 0;
+  std::shared_ptr<const Schema> schema;
+  snapshot->forEachEntry(key..., [&](const EventEntry &entry) -> void {
+    if (entry.schema && !schema) {
+      schema = entry.schema;
+    }
+    for (auto iter = entry.handlers.begin(); iter != entry.handlers.end(); iter++) {
+      has_handlers = true;
+      handler_count++;
+      if (!((*iter)->formats() & EventHandlerHolder::kTakesJsonText)) {
+        needs_document = true;
+      }
+      if ((*iter)->isolate() != isolate) {
+        same_isolate_only = false;
+      }
+      if (!((*iter)->formats() & EventHandlerHolder::kTakesRecords)) {
+        needs_json = true;
+      }
+    }
+  });
+  if (!has_handlers) {
+    info.GetReturnValue().Set(v8::True(isolate));
+    return;
+  }
+
+  std::shared_ptr<EventMessage> message = std::make_shared<EventMessage>();
+
+  if (same_isolate_only) {
+    message->visolate = isolate;
+    message->vargs.reserve(info.Length() > 1 ? info.Length() - 1 : 0);
+    for (int i = 1, n = info.Length(); i < n; i++) {
+      message->vargs.emplace_back(isolate, info[i]);
+    }
+  } else if (schema && info.Length() == 2 && info[1]->IsObject() && !info[1]->IsArray()) {
+    uv_loop_t *loop = static_cast<uv_loop_t *>(info.This()->GetAlignedPointerFromInternalField(1));
+    std::shared_ptr<LoopQueue> queue = v8LoopQueue(self, loop);
+    if (!queue) {
+      return;
+    }
+    message->record = schema->fromV8(queue.get(), isolate, isolate->GetCurrentContext(), info[1].As<v8::Object>());
+    if (!message->record) {
+      return;
+    }
+    message->schema = schema;
+    if (needs_json) {
+      rapidjson::Value jsonValue;
+      schema->toJson(message->record.get(), jsonValue, message->args.GetAllocator());
+      message->args.PushBack(jsonValue, message->args.GetAllocator());
+    }
+  } else if (!needs_document) {
+    // Every listener reads text: serialize the arguments directly
+    rapidjson::StringBuffer buffer;
+    JsonTextWriter writer(buffer);
+    writer.StartArray();
+    for (int i = 1, n = info.Length(); i < n; i++) {
+      if (!v8ValueToJsonText(writer, isolate, info[i])) {
+        return;
+      }
+    }
+    writer.EndArray();
+    message->text.reset(new std::string(buffer.GetString(), buffer.GetSize()));
+    message->text_args = true;
+    message->text_insitu = handler_count == 1;
+  } else {
+    for (int i = 1, n = info.Length(); i < n; i++) {
+      rapidjson::Value jsonValue;
+      if (!v8ValueToJsonObject(jsonValue, message->args.GetAllocator(), isolate, info[i])) {
+        return;
+      }
+      message->args.PushBack(jsonValue, message->args.GetAllocator());
+    }
+  }
+
+  bool accepted = true;
+  snapshot->forEachEntry(key..., [&accepted, &message](const EventEntry &entry) -> void {
+    accepted = deliver(entry, message) && accepted;
+  });
+  info.GetReturnValue().Set(v8::Boolean::New(isolate, accepted));
+}
+
+/**
+ * eventId(key): returns the id of key for emit().
+ */
+void AppBus::v8CallbackEventId(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Object> v_event_bus = info.This();
+  AppBus *self = static_cast<AppBus *>(v_event_bus->GetAlignedPointerFromInternalField(0));
+
+  if (info.Length() < 1 || !info[0]->IsString()) {
+    v8ThrowError("The key must be a string");
+    return;
+  }
+
+  v8::String::Utf8Value event_key(isolate, info[0]);
+  info.GetReturnValue().Set(v8::Integer::NewFromUnsigned(isolate, self->eventId(*event_key)));
+}
+
+void AppBus::v8CallbackEmitBinary(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Object> v_event_bus = info.This();
+  AppBus *self = static_cast<AppBus *>(v_event_bus->GetAlignedPointerFromInternalField(0));
+
+  if (info.Length() < 2) {
+    v8ThrowError("It must be two arguments");
+    return;
+  }
+
+  if (!info[0]->IsString()) {
+    v8ThrowError("The key must be a string");
+    return;
+  }
+
+  // transferList entries are detached from JS, pinList entries stay shared.
+  std::vector<v8::Local<v8::ArrayBuffer>> transfer_list;
+  size_t num_detached = 0;
+  for (int arg = 2; arg < 4 && arg < info.Length(); arg++) {
+    if (info[arg]->IsUndefined()) {
+      continue;
+    }
+    if (!info[arg]->IsArray()) {
+      v8ThrowError("The transfer list must be an array");
+      return;
+    }
+    v8::Local<v8::Array> varr = info[arg].As<v8::Array>();
+    for (uint32_t i = 0, n = varr->Length(); i < n; i++) {
+      v8::Local<v8::Value> item;
+      if (!varr->Get(context, i).ToLocal(&item)) return;
+      if (!item->IsArrayBuffer()) {
+        v8ThrowError("The transfer list may only contain ArrayBuffers");
+        return;
+      }
+      transfer_list.push_back(item.As<v8::ArrayBuffer>());
+    }
+    if (arg == 2) {
+      num_detached = transfer_list.size();
+    }
+  }
+
+  v8::ValueSerializer serializer(isolate);
+  for (uint32_t i = 0; i < transfer_list.size(); i++) {
+    serializer.TransferArrayBuffer(i, transfer_list[i]);
+  }
+  serializer.WriteHeader();
+  if (!serializer.WriteValue(context, info[1]).FromMaybe(false)) {
+    // DataCloneError is pending
+    return;
+  }
+
+  std::pair<uint8_t *, size_t> data = serializer.Release();
+  std::unique_ptr<BinaryPayload> payload(new BinaryPayload());
+  payload->data = BinaryBuffer(data.first, data.second, std::shared_ptr<void>(data.first, free));
+  for (size_t i = 0; i < transfer_list.size(); i++) {
+    payload->transfers.push_back(arrayBufferContents(isolate, transfer_list[i], i < num_detached));
+  }
+
+  std::shared_ptr<EventMessage> message = std::make_shared<EventMessage>();
+  message->binary = std::move(payload);
+
+  v8::String::Utf8Value event_key(isolate, info[0]);
+  info.GetReturnValue().Set(v8::Boolean::New(isolate, self->emitImpl(*event_key, message)));
+}
+
+void AppBus::V8EventHandlerHolder::handle(std::shared_ptr<EventMessage> message) {
+  if (!callback_) {
+    return;
+  }
+  v8::HandleScope handle_scope(isolate_);
+  v8::Local<v8::Context> context = callback_->context_.Get(isolate_);
+  v8::Context::Scope context_scope(context);
+  v8::Local<v8::Function> vcallback = callback_->func_.Get(isolate_);
+
+  std::vector<v8::Local<v8::Value>> vargs;
+  if (message->binary) {
+    v8::TryCatch try_catch(isolate_);
+    v8::Local<v8::Value> value;
+    if (!binaryToV8Value(isolate_, context, *message->binary).ToLocal(&value)) {
+      return;
+    }
+    vargs.push_back(value);
+  } else if (message->text) {
+    if (!JsonV8Builder::text(vargs, isolate_, queue(), *message->text, message->text_args, message->text_insitu)) {
+      return;
+    }
+  } else if (message->record) {
+    v8::Local<v8::Object> record = message->schema->toV8(queue(), isolate_, context, message->record.get());
+    vargs.push_back(record);
+  } else if (message->visolate == isolate_) {
+    vargs.reserve(message->vargs.size());
+    for (auto iter = message->vargs.begin(); iter != message->vargs.end(); iter++) {
+      vargs.push_back(iter->Get(isolate_));
+    }
+  } else {
+    JsonV8Builder::args(vargs, isolate_, queue(), message->args);
+  }
+  v8CallWithArgs(isolate_, context, vcallback, callback_->async_context_, vargs);
+}
+
+void AppBus::HostEventHandlerHolder::handle(std::shared_ptr<EventMessage> message) {
+  if (message->binary) {
+    rapidjson::Document args(rapidjson::kArrayType);
+    rapidjson::Value value;
+    BinaryReader reader(*message->binary);
+    if (!reader.readHeader() || !binaryToJson(value, args.GetAllocator(), reader)) {
+      return;
+    }
+    args.PushBack(value, args.GetAllocator());
+    func_(args);
+    return;
+  }
+  func_(message->args);
+}
+
+void AppBus::HostJsonTextHandlerHolder::handle(std::shared_ptr<EventMessage> message) {
+  if (message->text) {
+    if (message->text_args) {
+      func_(message->text->data(), message->text->length());
+    } else {
+      std::string wrapped;
+      wrapped.reserve(message->text->length() + 2);
+      wrapped += '[';
+      wrapped += *message->text;
+      wrapped += ']';
+      func_(wrapped.data(), wrapped.length());
+    }
+    return;
+  }
+  rapidjson::StringBuffer buffer;
+  JsonTextWriter writer(buffer);
+  if (message->binary) {
+    rapidjson::Document args(rapidjson::kArrayType);
+    rapidjson::Value value;
+    BinaryReader reader(*message->binary);
+    if (!reader.readHeader() || !binaryToJson(value, args.GetAllocator(), reader)) {
+      return;
+    }
+    args.PushBack(value, args.GetAllocator());
+    if (!args.Accept(writer)) {
+      return;
+    }
+  } else if (!message->args.Accept(writer)) {
+    return;
+  }
+  func_(buffer.GetString(), buffer.GetSize());
+}
+
+void AppBus::HostBinaryEventHandlerHolder::handle(std::shared_ptr<EventMessage> message) {
+  if (message->binary) {
+    BinaryReader reader(*message->binary);
+    if (reader.readHeader()) {
+      func_(reader);
+    }
+    return;
+  }
+  BinaryWriter writer;
+  jsonToBinary(writer, message->args);
+  BinaryPayload payload(writer.release());
+  BinaryReader reader(payload);
+  reader.readHeader();
+  func_(reader);
+}
+
+void AppBus::V8RequestHandlerHolder::handle(std::shared_ptr<RequestMessage> message) {
+  queue()->push(new RequestDelivery(shared_from_this(), std::move(message)));
+}
+
+struct PromiseReply {
+  AppBus::ResponseHandler_t respond;
+};
+
+/**
+ * Returns false, with retval holding the conversion error, if value cannot be
+ * converted; the response is then sent as thrown.
+ */
+static bool v8ResponseToJson(rapidjson::Document &retval,
+                             v8::Isolate *isolate,
+                             v8::Local<v8::Context> context,
+                             v8::Local<v8::Value> value) {
+  v8::TryCatch try_catch(isolate);
+  if (!v8ValueToJsonObject(retval, retval.GetAllocator(), isolate, value)) {
+    retval.SetObject();
+    if (try_catch.HasCaught()) {
+      v8::String::Utf8Value error(isolate, try_catch.Exception());
+      rapidjson::Value jmessage;
+      jmessage.SetString(*error ? *error : "", *error ? error.length() : 0, retval.GetAllocator());
+      retval.AddMember("message", jmessage, retval.GetAllocator());
+    }
+    return false;
+  }
+  // Error properties are not enumerable
+  if (value->IsNativeError() && retval.IsObject() && !retval.HasMember("message")) {
+    v8::Local<v8::Value> vmessage;
+    if (value.As<v8::Object>()->Get(context, v8PropertyName(isolate, "message")).ToLocal(&vmessage)) {
+      rapidjson::Value jmessage;
+      v8ValueToJsonObject(jmessage, retval.GetAllocator(), isolate, vmessage);
+      retval.AddMember("message", jmessage, retval.GetAllocator());
+    }
+  }
+  return true;
+}
+
+template<bool IsThrow>
+static void v8PromiseSettled(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  std::unique_ptr<PromiseReply> reply(static_cast<PromiseReply *>(info.Data().As<v8::External>()->Value()));
+  rapidjson::Document retval;
+  bool converted = v8ResponseToJson(retval, isolate, isolate->GetCurrentContext(), info[0]);
+  reply->respond(retval, IsThrow || !converted);
+}
+
+void AppBus::V8RequestHandlerHolder::invoke(const std::shared_ptr<RequestMessage> &message) {
+  if (!callback_) {
+    return;
+  }
+  v8::Isolate *isolate = callback_->isolate_;
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context = callback_->context_.Get(isolate);
+  v8::Context::Scope context_scope(context);
+  v8::Local<v8::Function> vcallback = callback_->func_.Get(isolate);
+
+  std::vector<v8::Local<v8::Value>> vargs;
+  JsonV8Builder::args(vargs, isolate, queue(), message->args);
+
+  // The scope runs the microtasks when it closes, so the reactions below are
+  // attached before a promise the handler rejected is checked for handlers
+  node::CallbackScope callback_scope(isolate, context->Global(), callback_->async_context_);
+  v8::TryCatch try_catch(isolate);
+  v8::Local<v8::Value> result;
+  if (!vcallback->Call(context, context->Global(), vargs.size(), vargs.data()).ToLocal(&result)) {
+    if (try_catch.HasCaught() && message->respond) {
+      rapidjson::Document retval;
+      v8ResponseToJson(retval, isolate, context, try_catch.Exception());
+      message->respond(retval, true);
+    }
+    return;
+  }
+  if (!message->respond) {
+    return;
+  }
+
+  if (result->IsPromise()) {
+    // Freed by whichever reaction runs
+    PromiseReply *reply = new PromiseReply{message->respond};
+    v8::Local<v8::External> data = v8::External::New(isolate, reply);
+    v8::Local<v8::Function> on_fulfilled = v8::Function::New(context, v8PromiseSettled<false>, data).ToLocalChecked();
+    v8::Local<v8::Function> on_rejected = v8::Function::New(context, v8PromiseSettled<true>, data).ToLocalChecked();
+#if NODE_MAJOR_VERSION >= 12
+    if (result.As<v8::Promise>()->Then(context, on_fulfilled, on_rejected).IsEmpty()) {
+      delete reply;
+    }
+#else
+    // No two-handler Then(). on_fulfilled swallows its own exceptions, so
+    // on_rejected only runs when the promise itself rejects.
+    v8::Local<v8::Promise> fulfilled;
+    if (!result.As<v8::Promise>()->Then(context, on_fulfilled).ToLocal(&fulfilled)) {
+      delete reply;
+    } else {
+      // Fails only when terminating; reply is then left to on_fulfilled
+      fulfilled->Catch(context, on_rejected).IsEmpty();
+    }
+#endif
+    return;
+  }
+
+  rapidjson::Document retval;
+  bool converted = v8ResponseToJson(retval, isolate, context, result);
+  message->respond(retval, !converted);
+}
+
+void AppBus::HostRequestHandlerHolder::handle(std::shared_ptr<RequestMessage> message) {
+  ResponseHandler_t response_handler = message->respond;
+  func_(message->args, response_handler);
+}
+
+struct AppBus::Stream::StreamRef {
+  std::shared_ptr<Stream> stream;
+  bool writer;
+  v8::Global<v8::Object> handle;
+
+  static void weakCallback(const v8::WeakCallbackInfo<StreamRef> &info) {
+    StreamRef *ref = info.GetParameter();
+    if (ref->writer) {
+      ref->stream->abortUnlessEnded("Stream writer was garbage collected");
+    }
+    ref->handle.Reset();
+    delete ref;
+  }
+};
+
+void AppBus::LoopQueue::abortStreams() {
+  for (auto iter = streams_.begin(); iter != streams_.end(); iter++) {
+    std::shared_ptr<Stream> stream = iter->second.stream.lock();
+    if (stream) {
+      stream->close("Event loop closed");
+    }
+  }
+  streams_.clear();
+}
+
+bool AppBus::Stream::write(BinaryBuffer chunk) {
+  bool more;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (ended_ || aborted_) {
+      return false;
+    }
+    more = --credit_ > 0;
+  }
+  StreamTask *task = new StreamTask(StreamTask::kData, reader_queue_.get(), shared_from_this());
+  task->chunk_ = std::move(chunk);
+  reader_queue_->push(task);
+  return more;
+}
+
+void AppBus::Stream::end() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (ended_ || aborted_) {
+      return;
+    }
+    ended_ = true;
+  }
+  reader_queue_->push(new StreamTask(StreamTask::kEnd, reader_queue_.get(), shared_from_this()));
+}
+
+void AppBus::Stream::abort(const std::string &reason) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (aborted_) {
+      return;
+    }
+    aborted_ = true;
+    abort_reason_ = reason;
+  }
+  writable_.notify_all();
+  reader_queue_->push(new StreamTask(StreamTask::kAbort, reader_queue_.get(), shared_from_this()));
+  if (writer_queue_) {
+    writer_queue_->push(new StreamTask(StreamTask::kWriterAbort, writer_queue_.get(), shared_from_this()));
+  }
+}
+
+void AppBus::Stream::abortUnlessEnded(const char *reason) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (ended_) {
+      return;
+    }
+  }
+  abort(reason);
+}
+
+void AppBus::Stream::close(const char *reason) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!aborted_) {
+      aborted_ = true;
+      abort_reason_ = reason;
+    }
+  }
+  writable_.notify_all();
+}
+
+bool AppBus::Stream::waitWritable() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  writable_.wait(lock, [this]() -> bool { return credit_ > 0 || aborted_; });
+  return !aborted_;
+}
+
+void AppBus::Stream::grant(size_t credits) {
+  bool drained;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    drained = credit_ <= 0 && credit_ + (int64_t) credits > 0;
+    credit_ += (int64_t) credits;
+  }
+  if (!drained) {
+    return;
+  }
+  writable_.notify_all();
+  if (writer_queue_) {
+    writer_queue_->push(new StreamTask(StreamTask::kWriterDrain, writer_queue_.get(), shared_from_this()));
+  }
+}
+
+void AppBus::Stream::pause() {
+  paused_ = true;
+}
+
+void AppBus::Stream::resume() {
+  paused_ = false;
+  if (withheld_) {
+    size_t credits = withheld_;
+    withheld_ = 0;
+    grant(credits);
+  }
+}
+
+void AppBus::Stream::deliverData(LoopQueue *queue, const BinaryBuffer &chunk) {
+  if (aborted_ || finished_) {
+    return;
+  }
+  auto iter = queue->streams_.find(std::make_pair(id_, false));
+  if (iter != queue->streams_.end() && iter->second.isolate) {
+    LoopQueue::StreamEnd &end = iter->second;
+    v8::Isolate *isolate = end.isolate;
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = end.context.Get(isolate);
+    v8::Context::Scope context_scope(context);
+    v8::Local<v8::Object> object = end.object.Get(isolate);
+    v8::Local<v8::Value> ondata;
+    if (object->Get(context, v8PropertyName(isolate, "ondata")).ToLocal(&ondata) && ondata->IsFunction()) {
+      v8::Local<v8::Value> argv[] = {newExternalArrayBuffer(isolate, chunk)};
+      node::MakeCallback(isolate, object, ondata.As<v8::Function>(), 1, argv, end.async->async_context_);
+    }
+  } else if (data_handler_) {
+    data_handler_(chunk);
+  }
+  if (paused_) {
+    withheld_++;
+  } else {
+    grant(1);
+  }
+}
+
+void AppBus::Stream::deliverEnd(LoopQueue *queue) {
+  if (aborted_ || finished_) {
+    return;
+  }
+  finished_ = true;
+  auto iter = queue->streams_.find(std::make_pair(id_, false));
+  if (iter != queue->streams_.end() && iter->second.isolate) {
+    LoopQueue::StreamEnd &end = iter->second;
+    v8::Isolate *isolate = end.isolate;
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = end.context.Get(isolate);
+    v8::Context::Scope context_scope(context);
+    v8::Local<v8::Object> object = end.object.Get(isolate);
+    v8::Local<v8::Value> onend;
+    if (object->Get(context, v8PropertyName(isolate, "onend")).ToLocal(&onend) && onend->IsFunction()) {
+      node::MakeCallback(isolate, object, onend.As<v8::Function>(), 0, nullptr, end.async->async_context_);
+    }
+  } else if (end_handler_) {
+    end_handler_();
+  }
+  queue->streams_.erase(std::make_pair(id_, false));
+  data_handler_ = nullptr;
+  end_handler_ = nullptr;
+  abort_handler_ = nullptr;
+}
+
+void AppBus::Stream::deliverAbort(LoopQueue *queue) {
+  if (finished_) {
+    return;
+  }
+  finished_ = true;
+  auto iter = queue->streams_.find(std::make_pair(id_, false));
+  if (iter != queue->streams_.end() && iter->second.isolate) {
+    LoopQueue::StreamEnd &end = iter->second;
+    v8::Isolate *isolate = end.isolate;
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = end.context.Get(isolate);
+    v8::Context::Scope context_scope(context);
+    v8::Local<v8::Object> object = end.object.Get(isolate);
+    v8::Local<v8::Value> onabort;
+    if (object->Get(context, v8PropertyName(isolate, "onabort")).ToLocal(&onabort) && onabort->IsFunction()) {
+      v8::Local<v8::Value> argv[] = {
+          v8::String::NewFromUtf8(isolate, abort_reason_.c_str(), v8::NewStringType::kNormal,
+                                  abort_reason_.length()).ToLocalChecked()};
+      node::MakeCallback(isolate, object, onabort.As<v8::Function>(), 1, argv, end.async->async_context_);
+    }
+  } else if (abort_handler_) {
+    abort_handler_(abort_reason_);
+  }
+  queue->streams_.erase(std::make_pair(id_, false));
+  data_handler_ = nullptr;
+  end_handler_ = nullptr;
+  abort_handler_ = nullptr;
+}
+
+void AppBus::Stream::notifyWriter(LoopQueue *queue, const char *method) {
+  auto iter = queue->streams_.find(std::make_pair(id_, true));
+  if (iter == queue->streams_.end() || iter->second.object.IsEmpty()) {
+    return;
+  }
+  LoopQueue::StreamEnd &end = iter->second;
+  v8::Isolate *isolate = end.isolate;
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context = end.context.Get(isolate);
+  v8::Context::Scope context_scope(context);
+  v8::Local<v8::Object> object = end.object.Get(isolate);
+  v8::Local<v8::Value> func;
+  if (object->Get(context, v8PropertyName(isolate, method)).ToLocal(&func) && func->IsFunction()) {
+    // The reader's loop may be aborting the stream meanwhile
+    bool aborted;
+    std::string reason;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      aborted = aborted_;
+      reason = abort_reason_;
+    }
+    v8::Local<v8::Value> argv[] = {
+        v8::String::NewFromUtf8(isolate, reason.c_str(), v8::NewStringType::kNormal,
+                                (int) reason.length()).ToLocalChecked()};
+    node::MakeCallback(isolate, object, func.As<v8::Function>(), aborted ? 1 : 0, argv,
+                       end.async->async_context_);
+  }
+}
+
+// Its address marks stream objects in internal field 1
+static int v8_stream_tag;
+
+/**
+ * Readers get pause(), resume() and abort(reason) and call the ondata(chunk),
+ * onend() and onabort(reason) properties set on them. Writers get
+ * write(buffer), end() and abort(reason) and call ondrain() and onabort(reason).
+ * write() copies the buffer, so the caller may reuse it right away.
+ */
+v8::MaybeLocal<v8::Object> AppBus::Stream::newV8Object(v8::Isolate *isolate,
+                                                       v8::Local<v8::Context> context,
+                                                       std::shared_ptr<Stream> stream,
+                                                       bool writer) {
+  v8::Local<v8::ObjectTemplate> v_templ = v8::ObjectTemplate::New(isolate);
+  v_templ->SetInternalFieldCount(2);
+  v8::Local<v8::Object> object;
+  if (!v_templ->NewInstance(context).ToLocal(&object)) {
+    return v8::MaybeLocal<v8::Object>();
+  }
+
+  StreamRef *ref = new StreamRef();
+  ref->stream = std::move(stream);
+  ref->writer = writer;
+  ref->handle.Reset(isolate, object);
+  ref->handle.SetWeak(ref, StreamRef::weakCallback, v8::WeakCallbackType::kParameter);
+  object->SetAlignedPointerInInternalField(0, ref);
+  object->SetAlignedPointerInInternalField(1, &v8_stream_tag);
+
+  auto setMethod = [&](const char *name, v8::FunctionCallback callback) -> bool {
+    v8::Local<v8::Function> func;
+    return v8::Function::New(context, callback).ToLocal(&func) &&
+           object->Set(context, v8PropertyName(isolate, name), func).FromMaybe(false);
+  };
+  bool ok = writer ? setMethod("write", v8Write) && setMethod("end", v8End)
+                   : setMethod("pause", v8Pause) && setMethod("resume", v8Resume);
+  if (!ok || !setMethod("abort", v8Abort)) {
+    return v8::MaybeLocal<v8::Object>();
+  }
+  return object;
+}
+
+AppBus::Stream *AppBus::Stream::fromV8This(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Local<v8::Object> self = info.This();
+  // The bus object has two internal fields as well
+  if (self->InternalFieldCount() != 2 || self->GetAlignedPointerFromInternalField(1) != &v8_stream_tag) {
+    v8ThrowError("Not a stream");
+    return nullptr;
+  }
+  return static_cast<StreamRef *>(self->GetAlignedPointerFromInternalField(0))->stream.get();
+}
+
+void AppBus::Stream::v8Write(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  Stream *stream = fromV8This(info);
+  if (!stream) {
+    return;
+  }
+
+  // The chunk is copied: JS may reuse the buffer as soon as write() returns
+  BinaryBuffer chunk;
+  if (info.Length() >= 1 && info[0]->IsArrayBuffer()) {
+    v8::Local<v8::ArrayBuffer> ab = info[0].As<v8::ArrayBuffer>();
+    chunk = arrayBufferCopy(ab, 0, ab->ByteLength());
+  } else if (info.Length() >= 1 && info[0]->IsArrayBufferView()) {
+    v8::Local<v8::ArrayBufferView> view = info[0].As<v8::ArrayBufferView>();
+    chunk = arrayBufferCopy(view->Buffer(), view->ByteOffset(), view->ByteLength());
+  } else {
+    v8ThrowError("The chunk must be an ArrayBuffer or a view of one");
+    return;
+  }
+  info.GetReturnValue().Set(v8::Boolean::New(isolate, stream->write(std::move(chunk))));
+}
+
+void AppBus::Stream::v8End(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  Stream *stream = fromV8This(info);
+  if (stream) {
+    stream->end();
+  }
+}
+
+void AppBus::Stream::v8Abort(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  Stream *stream = fromV8This(info);
+  if (!stream) {
+    return;
+  }
+  std::string reason("Aborted");
+  if (info.Length() >= 1 && !info[0]->IsUndefined()) {
+    v8::String::Utf8Value utf8_reason(isolate, info[0]);
+    reason.assign(*utf8_reason, utf8_reason.length());
+  }
+  stream->abort(reason);
+}
+
+void AppBus::Stream::v8Pause(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  Stream *stream = fromV8This(info);
+  if (stream) {
+    stream->pause();
+  }
+}
+
+void AppBus::Stream::v8Resume(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  Stream *stream = fromV8This(info);
+  if (stream) {
+    stream->resume();
+  }
+}
+
+AppBus::StreamWriter::~StreamWriter() {
+  stream_->abortUnlessEnded("Stream writer released");
+}
+
+bool AppBus::StreamWriter::write(BinaryBuffer chunk) {
+  return stream_->write(std::move(chunk));
+}
+
+bool AppBus::StreamWriter::write(const void *data, size_t length) {
+  const uint8_t *bytes = (const uint8_t *) data;
+  std::shared_ptr<std::vector<uint8_t>> copy(new std::vector<uint8_t>(bytes, bytes + length));
+  return stream_->write(BinaryBuffer(copy->data(), copy->size(), copy));
+}
+
+bool AppBus::StreamWriter::waitWritable() {
+  return stream_->waitWritable();
+}
+
+void AppBus::StreamWriter::end() {
+  stream_->end();
+}
+
+void AppBus::StreamWriter::abort(const char *reason) {
+  stream_->abort(reason);
+}
+
+void AppBus::StreamReader::onData(DataHandler_t handler) {
+  stream_->data_handler_ = std::move(handler);
+}
 
-  void handle(std::shared_ptr<RequestMessage> message) override;
-};
+void AppBus::StreamReader::onEnd(EndHandler_t handler) {
+  stream_->end_handler_ = std::move(handler);
+}
 
-struct AppBus::V8RequestHandlerHolder : RequestHandlerHolder {
-  AppBus *appbus_;
-  v8::Persistent<v8::Function> vpfunc_;
+void AppBus::StreamReader::onAbort(AbortHandler_t handler) {
+  stream_->abort_handler_ = std::move(handler);
+}
 
-  V8RequestHandlerHolder(AppBus *appbus, uv_loop_t *loop, v8::Isolate *isolate, v8::Local<v8::Function> func)
-      : appbus_(appbus), RequestHandlerHolder(loop), vpfunc_(isolate, func) {}
+void AppBus::StreamReader::pause() {
+  stream_->pause();
+}
 
-  void handle(std::shared_ptr<RequestMessage> message) override;
-};
+void AppBus::StreamReader::resume() {
+  stream_->resume();
+}
 
-struct AppBus::EventEmitTask {
-  uv_async_t async_;
-  std::shared_ptr<EventMessage> message_;
-  std::shared_ptr<EventHandlerHolder> handler_;
+void AppBus::StreamReader::abort(const char *reason) {
+  stream_->abort(reason);
+}
 
-  static void callback(uv_async_t *handle) {
-    EventEmitTask *pthis = (EventEmitTask *) (handle->data);
-    pthis->handler_->handle(pthis->message_);
-    uv_close((uv_handle_t *) handle, [](uv_handle_t *handle) {
-      EventEmitTask *pthis = (EventEmitTask *) (handle->data);
-      delete pthis;
-    });
-  }
+std::shared_ptr<AppBus::StreamHandlerHolder> AppBus::findStreamHandler(const char *key, size_t length) const {
+  RegistryRef snapshot = registry();
+  const std::shared_ptr<StreamHandlerHolder> *found = snapshot->streams.find(key, length);
+  return found ? *found : nullptr;
+}
 
-  EventEmitTask(std::shared_ptr<EventMessage> message, std::shared_ptr<EventHandlerHolder> handler)
-      : message_(message), handler_(handler) {
-    memset(&async_, 0, sizeof(async_));
-    uv_async_init(handler->loop(), &async_, callback);
-    async_.data = this;
+bool AppBus::addStreamHandler(const char *key, std::shared_ptr<StreamHandlerHolder> handler) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (handler->queue()->detached()) {
+    return false;
   }
+  std::shared_ptr<const Registry> current = registry_;
+  std::shared_ptr<Registry> next(new Registry(*current));
+  next->streams.set(key, std::move(handler));
+  publishRegistry(std::move(next));
+  return true;
+}
 
-  void send() {
-    uv_async_send(&async_);
-  }
-};
+std::shared_ptr<AppBus::Stream> AppBus::openStreamImpl(const char *key, size_t length, size_t window) {
+  struct OpenTask : LoopTask {
+    std::shared_ptr<StreamHandlerHolder> handler_;
+    std::shared_ptr<Stream> stream_;
 
-template<class JsonAllocator>
-static void v8ValueToJsonObject(rapidjson::Value &target,
-                                JsonAllocator &allocator,
-                                v8::Isolate *isolate,
-                                v8::Local<v8::Value> vvalue) {
-  v8::Local<v8::Context> vcontext = isolate->GetCurrentContext();
-  if (vvalue.IsEmpty()) {
-    target.SetNull();
-    return;
-  }
-  if (vvalue->IsString()) {
-    v8::Local<v8::String> vimpl = vvalue.As<v8::String>();
-    v8::String::Utf8Value str(isolate, vimpl);
-    target.SetString(*str, str.length(), allocator);
-  } else if (vvalue->IsStringObject()) {
-    v8::Local<v8::StringObject> vimpl = vvalue.As<v8::StringObject>();
-    v8::String::Utf8Value str(isolate, vimpl->ValueOf());
-    target.SetString(*str, str.length(), allocator);
-  } else if (vvalue->IsBoolean()) {
-    v8::Local<v8::StringObject> vimpl = vvalue.As<v8::StringObject>();
-    target.SetBool(vimpl->Int32Value(vcontext).ToChecked());
-  } else if (vvalue->IsInt32()) {
-    v8::Local<v8::Integer> vimpl = vvalue.As<v8::Integer>();
-    target.SetInt(vimpl->Int32Value(vcontext).ToChecked());
-  } else if (vvalue->IsUint32()) {
-    v8::Local<v8::Integer> vimpl = vvalue.As<v8::Integer>();
-    target.SetUint(vimpl->Uint32Value(vcontext).ToChecked());
-  } else if (vvalue->IsNumber()) {
-    v8::Local<v8::Number> vimpl = vvalue.As<v8::Number>();
-    target.SetDouble(vimpl->NumberValue(vcontext).ToChecked());
-  } else if (vvalue->IsNumberObject()) {
-    v8::Local<v8::NumberObject> vimpl = vvalue.As<v8::NumberObject>();
-    target.SetDouble(vimpl->ValueOf());
-  } else if (vvalue->IsObject()) {
-    v8::Local<v8::Object> vmap = vvalue.As<v8::Object>();
-    v8::Local<v8::Array> keys = vmap->GetPropertyNames(vcontext).ToLocalChecked();
-    target.SetObject();
-    for (size_t i = 0; i < keys->Length(); i++) {
-      // For-In Next:
-      v8::Local<v8::Value> vkey = keys->Get(i);
-      v8::String::Utf8Value utf8_key(isolate, vkey);
-      rapidjson::Value jkey;
-      rapidjson::Value jvalue;
-      jkey.SetString(*utf8_key, utf8_key.length(), allocator);
-      v8ValueToJsonObject(jvalue, allocator, isolate, vmap->Get(vcontext, vkey).ToLocalChecked());
-      target.AddMember(jkey, jvalue, allocator);
-    }
-  } else if (vvalue->IsMap()) {
-    v8::Local<v8::Map> vmap = vvalue.As<v8::Map>();
-    v8::Local<v8::Array> keys = vmap->GetPropertyNames(vcontext).ToLocalChecked();
-    target.SetObject();
-    for (size_t i = 0; i < keys->Length(); i++) {
-      // For-In Next:
-      v8::Local<v8::Value> vkey = keys->Get(i);
-      v8::String::Utf8Value utf8_key(isolate, vkey);
-      rapidjson::Value jkey;
-      rapidjson::Value jvalue;
-      jkey.SetString(*utf8_key, utf8_key.length(), allocator);
-      v8ValueToJsonObject(jvalue, allocator, isolate, vmap->Get(vcontext, vkey).ToLocalChecked());
-      target.AddMember(jkey, jvalue, allocator);
-    }
-  } else if (vvalue->IsArray()) {
-    v8::Local<v8::Array> varr = vvalue.As<v8::Array>();
-    target.SetArray();
-    for (size_t i = 0; i < varr->Length(); i++) {
-      // For-In Next:
-      v8::Local<v8::Value> vkey = varr->Get(i);
-      rapidjson::Value jvalue;
-      v8ValueToJsonObject(jvalue, allocator, isolate, vkey);
-      target.PushBack(jvalue, allocator);
-    }
-  }
-}
-
-static v8::Local<v8::Value> jsonObjectToV8Value(v8::Isolate *isolate, const rapidjson::Value &src) {
-  v8::Local<v8::Value> vtarget;
-  if (src.IsNull()) {
-    vtarget = v8::Null(isolate);
-  } else if (src.IsString()) {
-    vtarget = v8::String::NewFromUtf8(isolate,
-                                      src.GetString(),
-                                      v8::NewStringType::kNormal,
-                                      src.GetStringLength()).ToLocalChecked();
-  } else if (src.IsBool()) {
-    vtarget = v8::Boolean::New(isolate, src.GetBool());
-  } else if (src.IsUint64() && !src.IsUint()) {
-    vtarget = v8::BigInt::NewFromUnsigned(isolate, src.GetUint64());
-  } else if (src.IsInt64() && !src.IsInt()) {
-    vtarget = v8::BigInt::New(isolate, src.GetInt64());
-  } else if (src.IsUint()) {
-    vtarget = v8::Uint32::New(isolate, src.GetUint());
-  } else if (src.IsInt()) {
-    vtarget = v8::Int32::New(isolate, src.GetInt());
-  } else if (src.IsDouble()) {
-    vtarget = v8::Number::New(isolate, src.GetDouble());
-  } else if (src.IsFloat()) {
-    vtarget = v8::Number::New(isolate, src.GetFloat());
-  } else if (src.IsObject()) {
-    v8::Local<v8::Object> vmap = v8::Object::New(isolate);
-    for (auto iter = src.MemberBegin(); iter != src.MemberEnd(); iter++) {
-      v8::Local<v8::Value> vkey = jsonObjectToV8Value(isolate, iter->name);
-      v8::Local<v8::Value> vvalue = jsonObjectToV8Value(isolate, iter->value);
-      vmap->Set(vkey, vvalue);
-    }
-    vtarget = vmap;
-  } else if (src.IsArray()) {
-    v8::Local<v8::Array> varr = v8::Array::New(isolate);
-    uint32_t index = 0;
-    for (auto iter = src.Begin(); iter != src.End(); iter++, index++) {
-      v8::Local<v8::Value> vvalue = jsonObjectToV8Value(isolate, *iter);
-      varr->Set(index, vvalue);
-    }
-    vtarget = varr;
-  } else {
-    vtarget = v8::Undefined(isolate);
-  }
-  return vtarget;
-}
+    OpenTask(std::shared_ptr<StreamHandlerHolder> handler, std::shared_ptr<Stream> stream)
+        : handler_(std::move(handler)), stream_(std::move(stream)) {}
 
-void AppBus::v8ThrowError(const char *msg) {
-  v8::HandleScope scope(v8::Isolate::GetCurrent());
-  scope.GetIsolate()->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(scope.GetIsolate(), msg)));
-}
+    void run() override {
+      handler_->open(stream_);
+    }
+  };
 
-void AppBus::on(const char *event_key, EventHandler_t handler, uv_loop_t *loop) {
-  std::unique_ptr<HostEventHandlerHolder> handler_holder(new HostEventHandlerHolder(loop ? loop : loop_, handler));
+  std::shared_ptr<StreamHandlerHolder> handler = findStreamHandler(key, length);
+  if (!handler) {
+    return nullptr;
+  }
+  std::shared_ptr<Stream> stream(new Stream(++next_stream_id_, window ? window : 1, handler->queue_));
+  // Queued ahead of every chunk of the stream
+  handler->queue()->push(new OpenTask(handler, stream));
+  return stream;
+}
 
-  {
-    EventLock lock(this, event_key, true);
-    lock.holder()->list.emplace_back(std::move(handler_holder));
+bool AppBus::onStream(const char *key, StreamHandler_t handler, uv_loop_t *loop) {
+  if (!loop) loop = loop_;
+  std::shared_ptr<LoopQueue> queue = getLoopQueue(loop);
+  if (!queue) {
+    return false;
   }
+  std::shared_ptr<HostStreamHandlerHolder>
+      handler_holder(new HostStreamHandlerHolder(loop, std::move(queue), handler));
+  return addStreamHandler(key, std::move(handler_holder));
 }
 
-void AppBus::onRequest(const char *key, RequestHandler_t handler, uv_loop_t *loop) {
-  std::unique_ptr<HostRequestHandlerHolder>
-      handler_holder(new HostRequestHandlerHolder(this, loop ? loop : loop_, handler));
-  {
-    EventLock lock(this, "$request", true);
-    lock.holder()->reqs[key] = std::move(handler_holder);
+std::shared_ptr<AppBus::StreamWriter> AppBus::openStream(const char *key, size_t window) {
+  std::shared_ptr<Stream> stream = openStreamImpl(key, strlen(key), window);
+  if (!stream) {
+    return nullptr;
   }
+  return std::make_shared<StreamWriter>(std::move(stream));
 }
 
-void AppBus::v8CallbackOn(const v8::FunctionCallbackInfo<v8::Value> &info) {
+/**
+ * onStream(key, handler): handler(stream) is called with the reading end.
+ */
+void AppBus::v8CallbackOnStream(const v8::FunctionCallbackInfo<v8::Value> &info) {
   v8::Isolate *isolate = info.GetIsolate();
   v8::HandleScope scope(isolate);
   v8::Local<v8::Context> context = isolate->GetCurrentContext();
@@ -275,198 +4501,298 @@ void AppBus::v8CallbackOn(const v8::FunctionCallbackInfo<v8::Value> &info) {
     return;
   }
 
-  v8::String::Utf8Value event_key(isolate, info[0]);
-  std::unique_ptr<V8EventHandlerHolder>
-      handler_holder(new V8EventHandlerHolder(loop, isolate, info[1].As<v8::Function>()));
+  std::shared_ptr<LoopQueue> queue = v8LoopQueue(self, loop);
+  if (!queue) {
+    return;
+  }
+  v8::String::Utf8Value key(isolate, info[0]);
+  std::shared_ptr<V8StreamHandlerHolder> handler_holder(
+      new V8StreamHandlerHolder(loop, std::move(queue), isolate, context, info[1].As<v8::Function>()));
+  self->addStreamHandler(*key, std::move(handler_holder));
+}
 
-  {
-    EventLock lock(self, *event_key, true);
-    lock.holder()->list.emplace_back(std::move(handler_holder));
+/**
+ * openStream(key[, window]): returns the writing end.
+ */
+void AppBus::v8CallbackOpenStream(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Object> v_event_bus = info.This();
+  AppBus *self = static_cast<AppBus *>(v_event_bus->GetAlignedPointerFromInternalField(0));
+  uv_loop_t *loop = static_cast<uv_loop_t *>(v_event_bus->GetAlignedPointerFromInternalField(1));
+
+  if (info.Length() < 1 || !info[0]->IsString()) {
+    v8ThrowError("The key must be a string");
+    return;
+  }
+  size_t window = 16;
+  if (info.Length() >= 2 && info[1]->IsNumber()) {
+    window = (size_t) info[1]->NumberValue(context).FromMaybe(16);
+  }
+
+  std::shared_ptr<LoopQueue> queue = v8LoopQueue(self, loop);
+  if (!queue) {
+    return;
+  }
+  v8::String::Utf8Value key(isolate, info[0]);
+  std::shared_ptr<Stream> stream = self->openStreamImpl(*key, key.length(), window);
+  if (!stream) {
+    isolate->ThrowException(v8MakeError(isolate, "ENOFUNC", -2,
+                                        "No stream handler registered for key: " + std::string(*key, key.length())));
+    return;
   }
+
+  stream->writer_queue_ = queue;
+  v8::Local<v8::Object> object;
+  if (!Stream::newV8Object(isolate, context, stream, true).ToLocal(&object)) {
+    stream->abort("Stream writer failed");
+    return;
+  }
+  // Held weakly: a writer that is dropped without end() aborts the stream
+  LoopQueue::StreamEnd &end = queue->streams_[std::make_pair(stream->id_, true)];
+  end.stream = stream;
+  end.isolate = isolate;
+  end.context.Reset(isolate, context);
+  end.object.Reset(isolate, object);
+  end.object.SetWeak();
+  end.async.reset(new V8AsyncContext(isolate, "AppBus.stream"));
+  info.GetReturnValue().Set(object);
 }
 
-void AppBus::emitImpl(const char *event_key, std::shared_ptr<EventMessage> message) {
-  {
-    EventLock lock(this, event_key, false);
-    if (lock.alive()) {
-      auto &list = lock.holder()->list;
-      for (auto iter = list.begin(); iter != list.end(); iter++) {
-        EventEmitTask *task = new EventEmitTask(message, *iter);
-        task->send();
-      }
+struct AppBus::RingWakeup : LoopTask {
+  LoopQueue *queue_;
+  std::shared_ptr<Ring> ring_;
+
+  RingWakeup(LoopQueue *queue, std::shared_ptr<Ring> ring)
+      : queue_(queue), ring_(std::move(ring)) {}
+
+  void run() override {
+    auto iter = queue_->rings_.find(ring_->id_);
+    if (iter == queue_->rings_.end()) {
+      return;
+    }
+    LoopQueue::RingEnd &end = iter->second;
+    v8::Isolate *isolate = end.isolate;
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = end.context.Get(isolate);
+    v8::Context::Scope context_scope(context);
+    v8::Local<v8::Object> object = end.object.Get(isolate);
+    v8::Local<v8::Value> onreadable;
+    if (object->Get(context, v8PropertyName(isolate, "onreadable")).ToLocal(&onreadable) &&
+        onreadable->IsFunction()) {
+      node::MakeCallback(isolate, object, onreadable.As<v8::Function>(), 0, nullptr, end.async->async_context_);
     }
   }
+};
+
+struct AppBus::RingClose : LoopTask {
+  LoopQueue *queue_;
+  uint64_t id_;
+
+  RingClose(LoopQueue *queue, uint64_t id) : queue_(queue), id_(id) {}
+
+  void run() override {
+    queue_->rings_.erase(id_);
+  }
+};
+
+/**
+ * Rings by key. Rings unregister themselves on destruction, so the table
+ * must not go away with the bus while a host still holds one.
+ */
+struct AppBus::RingTable {
+  std::mutex mutex;
+  std::map<std::string, std::weak_ptr<Ring>> rings;
+};
+
+AppBus::Ring::Ring(std::weak_ptr<RingTable> table, uint64_t id, const char *key, size_t capacity)
+    : table_(std::move(table)), id_(id), key_(key), capacity_(64) {
+  while (capacity_ < capacity) capacity_ <<= 1;
+  // int32_t storage keeps the counters aligned for Atomics
+  memory_.reset((uint8_t *) new int32_t[(kDataOffset + capacity_) / sizeof(int32_t)](),
+                [](uint8_t *memory) { delete[] (int32_t *) memory; });
 }
 
-void AppBus::emit(const char *event_key, rapidjson::Value &args, bool single_argument) {
-  std::shared_ptr<EventMessage> message(new EventMessage());
-  if (single_argument) {
-    rapidjson::Value jsonValue;
-    jsonValue.CopyFrom(args, message->args.GetAllocator());
-    message->args.PushBack(jsonValue, message->args.GetAllocator());
-  } else {
-    for (auto iter = args.Begin(); iter != args.End(); iter++) {
-      rapidjson::Value jsonValue;
-      jsonValue.CopyFrom(*iter, message->args.GetAllocator());
-      message->args.PushBack(jsonValue, message->args.GetAllocator());
+AppBus::Ring::~Ring() {
+  std::shared_ptr<RingTable> table = table_.lock();
+  if (table) {
+    std::unique_lock<std::mutex> lock(table->mutex);
+    auto iter = table->rings.find(key_);
+    if (iter != table->rings.end() && iter->second.expired()) {
+      table->rings.erase(iter);
     }
   }
-  this->emitImpl(event_key, message);
+  if (consumer_) {
+    consumer_->push(new RingClose(consumer_.get(), id_));
+  }
 }
 
-void AppBus::emit(const char *event_key) {
-  std::shared_ptr<EventMessage> message(new EventMessage());
-  this->emitImpl(event_key, message);
-}
+bool AppBus::Ring::write(const void *data, size_t length) {
+  size_t record = sizeof(uint32_t) + ((length + 3) & ~(size_t) 3);
+  if (record > capacity_) {
+    return false;
+  }
 
-void AppBus::requestFromNode(const v8::FunctionCallbackInfo<v8::Value> &info) {
-  v8::Isolate *isolate = info.GetIsolate();
-  v8::String::Utf8Value reqid(isolate, info[1]);
-  v8::String::Utf8Value key(isolate, info[2]);
-  v8::Local<v8::Array> v8args = info[3].As<v8::Array>();
-  std::shared_ptr<RequestHandlerHolder> req_handler;
+  uint32_t write_offset = (uint32_t) counter(kWriteOffset).load(std::memory_order_relaxed);
+  uint32_t read_offset = (uint32_t) counter(kReadOffset).load(std::memory_order_acquire);
+  size_t position = write_offset & (capacity_ - 1);
+  size_t tail = capacity_ - position;
+  size_t needed = record <= tail ? record : tail + record;
+  if (capacity_ - (uint32_t) (write_offset - read_offset) < needed) {
+    return false;
+  }
+
+  uint8_t *base = memory_.get() + kDataOffset;
+  if (record > tail) {
+    uint32_t marker = kWrapMarker;
+    memcpy(base + position, &marker, sizeof(uint32_t));
+    write_offset += (uint32_t) tail;
+    position = 0;
+  }
+  uint32_t prefix = (uint32_t) length;
+  memcpy(base + position, &prefix, sizeof(uint32_t));
+  memcpy(base + position + sizeof(uint32_t), data, length);
+
+  counter(kWriteOffset).store((int32_t) (write_offset + record), std::memory_order_seq_cst);
+  if (counter(kWaiting).exchange(0, std::memory_order_seq_cst)) {
+    wake();
+  }
+  return true;
+}
 
+void AppBus::Ring::wake() {
+  std::shared_ptr<LoopQueue> queue;
   {
-    EventLock lock(this, "$request", true);
-    auto &reqs = lock.holder()->reqs;
-    auto it = reqs.find(*key);
-    if (it != reqs.end()) {
-      req_handler = it->second;
-    }
+    std::unique_lock<std::mutex> lock(consumer_mutex_);
+    queue = consumer_;
   }
-  if (req_handler) {
-    std::shared_ptr<RequestMessage> message(new RequestMessage(*reqid));
-    for (int i = 0, n = v8args->Length(); i < n; i++) {
-      rapidjson::Value jsonValue;
-      v8ValueToJsonObject(jsonValue, message->args.GetAllocator(), isolate, v8args->Get(i));
-      message->args.PushBack(jsonValue, message->args.GetAllocator());
-    }
-    req_handler->handle(message);
-  } else {
-    v8::Local<v8::String> obj_code_key = v8::String::NewFromUtf8(isolate, "code");
-    v8::Local<v8::String> obj_code_value = v8::String::NewFromUtf8(isolate, "ENOFUNC");
-    v8::Local<v8::String> obj_errno_key = v8::String::NewFromUtf8(isolate, "errno");
-    v8::Local<v8::Integer> obj_errno_value = v8::Integer::New(isolate, -2);
-    v8::Local<v8::String> msg = v8::String::NewFromUtf8(isolate, "Not registered request key");
-    v8::Local<v8::Value> err = v8::Exception::Error(msg);
-    v8::Local<v8::Object> err_obj = err.As<v8::Object>();
-    err_obj->Set(isolate->GetCurrentContext(), obj_code_key, obj_code_value);
-    err_obj->Set(isolate->GetCurrentContext(), obj_errno_key, obj_errno_value);
-    isolate->ThrowException(err_obj);
+  if (queue) {
+    queue->push(new RingWakeup(queue.get(), shared_from_this()), kPriorityHigh);
   }
 }
 
-void AppBus::v8CallbackEmit(const v8::FunctionCallbackInfo<v8::Value> &info) {
-  v8::HandleScope scope(v8::Isolate::GetCurrent());
+std::shared_ptr<AppBus::Ring> AppBus::createRing(const char *key, size_t capacity) {
+  std::shared_ptr<Ring> ring(new Ring(rings_, ++next_ring_id_, key, capacity));
+  std::unique_lock<std::mutex> lock(rings_->mutex);
+  rings_->rings[key] = ring;
+  return ring;
+}
+
+/**
+ * openRing(key): attaches this loop as the consumer of the ring created for key.
+ */
+void AppBus::v8CallbackOpenRing(const v8::FunctionCallbackInfo<v8::Value> &info) {
   v8::Isolate *isolate = info.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
   v8::Local<v8::Object> v_event_bus = info.This();
   AppBus *self = static_cast<AppBus *>(v_event_bus->GetAlignedPointerFromInternalField(0));
   uv_loop_t *loop = static_cast<uv_loop_t *>(v_event_bus->GetAlignedPointerFromInternalField(1));
 
-  if (info.Length() < 1) {
-    v8ThrowError("At least one argument is required");
+  if (info.Length() < 1 || !info[0]->IsString()) {
+    v8ThrowError("The key must be a string");
     return;
   }
 
-  if (!info[0]->IsString()) {
-    v8ThrowError("The key must be a string");
+  std::shared_ptr<LoopQueue> queue = v8LoopQueue(self, loop);
+  if (!queue) {
     return;
   }
-
-  v8::String::Utf8Value event_key(isolate, info[0]);
-
-  if (strcmp(*event_key, "$request") == 0) {
-    self->requestFromNode(info);
+  v8::String::Utf8Value key(isolate, info[0]);
+  std::shared_ptr<Ring> ring;
+  {
+    std::unique_lock<std::mutex> lock(self->rings_->mutex);
+    auto iter = self->rings_->rings.find(std::string(*key, key.length()));
+    if (iter != self->rings_->rings.end()) {
+      ring = iter->second.lock();
+    }
+  }
+  if (!ring) {
+    isolate->ThrowException(v8MakeError(isolate, "ENOENT", -2,
+                                        "No ring created for key: " + std::string(*key, key.length())));
     return;
   }
 
-  std::shared_ptr<EventMessage> message(new EventMessage());
-
-  for (int i = 1, n = info.Length(); i < n; i++) {
-    rapidjson::Value jsonValue;
-    v8ValueToJsonObject(jsonValue, message->args.GetAllocator(), isolate, info[i]);
-    message->args.PushBack(jsonValue, message->args.GetAllocator());
+  {
+    std::unique_lock<std::mutex> lock(ring->consumer_mutex_);
+    if (ring->consumer_) {
+      v8ThrowError("The ring already has a consumer");
+      return;
+    }
+    ring->consumer_ = queue;
   }
 
-  self->emitImpl(*event_key, message);
-}
-
-void AppBus::V8EventHandlerHolder::handle(std::shared_ptr<EventMessage> message) {
-  v8::Isolate *isolate = v8::Isolate::GetCurrent();
-  v8::HandleScope handle_scope(isolate);
-  v8::Local<v8::Context> context = v8::Context::New(isolate);
-  v8::Context::Scope context_scope(context);
-
-  v8::Local<v8::Context> temp = isolate->GetCurrentContext();
-
-  v8::Local<v8::Function> vcallback = v8::Local<v8::Function>::New(isolate, vpfunc_);
+  v8::Local<v8::Object> object = v8::Object::New(isolate);
+  BinaryBuffer memory(ring->memory_.get(), Ring::kDataOffset + ring->capacity_, ring->memory_);
+  if (object->Set(context, v8PropertyName(isolate, "buffer"), newExternalSharedArrayBuffer(isolate, memory))
+          .IsNothing() ||
+      object->Set(context, v8PropertyName(isolate, "capacity"),
+                  v8::Integer::NewFromUnsigned(isolate, (uint32_t) ring->capacity_)).IsNothing() ||
+      object->Set(context, v8PropertyName(isolate, "dataOffset"), v8::Integer::New(isolate, Ring::kDataOffset))
+          .IsNothing()) {
+    // Leave the ring to the next consumer
+    std::unique_lock<std::mutex> lock(ring->consumer_mutex_);
+    ring->consumer_.reset();
+    return;
+  }
 
-  const rapidjson::Document &args = message->args;
-  std::vector<v8::Local<v8::Value>> vargs(args.Size());
+  LoopQueue::RingEnd &end = queue->rings_[ring->id_];
+  end.isolate = isolate;
+  end.context.Reset(isolate, context);
+  end.object.Reset(isolate, object);
+  end.async.reset(new V8AsyncContext(isolate, "AppBus.ring"));
 
-  int index = 0;
-  for (auto iter = args.Begin(); iter != args.End(); iter++, index++) {
-    vargs[index] = jsonObjectToV8Value(isolate, *iter);
+  // Records written before the consumer attached wake it up as well
+  if (ring->counter(Ring::kWriteOffset).load() != ring->counter(Ring::kReadOffset).load()) {
+    queue->push(new RingWakeup(queue.get(), ring), kPriorityHigh);
+  } else {
+    ring->counter(Ring::kWaiting).store(1);
+    if (ring->counter(Ring::kWriteOffset).load() != ring->counter(Ring::kReadOffset).load() &&
+        ring->counter(Ring::kWaiting).exchange(0)) {
+      queue->push(new RingWakeup(queue.get(), ring), kPriorityHigh);
+    }
   }
-
-  vcallback->Call(temp, v8::Null(isolate), vargs.size(), vargs.data());
-  //node::async_context async_context = node::EmitAsyncInit(isolate, v8::Object::New(isolate), "AppBus emit");
-  //node::MakeCallback(isolate, v8::Null(isolate).As<v8::Object>(), vcallback, vargs.size(), vargs.data(), async_context);
-  //node::EmitAsyncDestroy(isolate, async_context);
+  info.GetReturnValue().Set(object);
 }
 
-void AppBus::HostEventHandlerHolder::handle(std::shared_ptr<EventMessage> message) {
-  func_(message->args);
+AppBus::AppBus()
+    : loop_(nullptr), registry_(new Registry()), registry_version_(0), instance_id_(++next_instance_id),
+      next_subscription_id_(0), next_request_id_(0),
+      next_stream_id_(0), next_ring_id_(0), rings_(new RingTable()) {
 }
 
-void AppBus::V8RequestHandlerHolder::handle(std::shared_ptr<RequestMessage> message) {
-  v8::Isolate *isolate = v8::Isolate::GetCurrent();
-  v8::HandleScope handle_scope(isolate);
-  v8::Local<v8::Context> context = v8::Context::New(isolate);
-  v8::Context::Scope context_scope(context);
-
-  v8::Local<v8::Context> temp = isolate->GetCurrentContext();
-
-  v8::Local<v8::Function> vcallback = v8::Local<v8::Function>::New(isolate, vpfunc_);
-
-  const rapidjson::Document &args = message->args;
-  std::vector<v8::Local<v8::Value>> vargs(args.Size());
+/**
+ * Hooks and queues belong to their loop's thread, so those of other loops
+ * are handed to their queue; the high lane runs the hook removals first.
+ */
+AppBus::~AppBus() {
+  // Done requests leave their timers alone, so none reaches back into the bus
+  cancelOutgoingRequests(nullptr, "The bus was destroyed");
 
-  int index = 0;
-  for (auto iter = args.Begin(); iter != args.End(); iter++, index++) {
-    vargs[index] = jsonObjectToV8Value(isolate, *iter);
+  std::map<uv_loop_t *, std::shared_ptr<LoopQueue>> queues;
+  std::vector<EnvironmentCleanup *> cleanups;
+  {
+    std::unique_lock<std::mutex> lock(loop_queues_mutex_);
+    queues.swap(loop_queues_);
+    cleanups.swap(environment_cleanups_);
+  }
+  for (auto iter = cleanups.begin(); iter != cleanups.end(); iter++) {
+    auto queue = queues.find((*iter)->loop);
+    if (queue != queues.end() && !queue->second->onLoopThread()) {
+      queue->second->push(new EnvironmentCleanupRemove(*iter), kPriorityHigh);
+    } else {
+      removeEnvironmentCleanup(*iter);
+    }
+  }
+  for (auto iter = queues.begin(); iter != queues.end(); iter++) {
+    LoopQueue::closeOnLoop(std::move(iter->second));
   }
-
-  vcallback->Call(temp, v8::Null(isolate), vargs.size(), vargs.data());
-  //node::async_context async_context = node::EmitAsyncInit(isolate, v8::Object::New(isolate), "AppBus emit");
-  //node::MakeCallback(isolate, v8::Null(isolate).As<v8::Object>(), vcallback, vargs.size(), vargs.data(), async_context);
-  //node::EmitAsyncDestroy(isolate, async_context);
-}
-
-void AppBus::HostRequestHandlerHolder::handle(std::shared_ptr<RequestMessage> message) {
-  ResponseHandler_t response_handler =
-      [appbus = appbus_, reqid = message->reqid](const rapidjson::Document &retval, bool is_throw) -> void {
-        rapidjson::Document args(rapidjson::kArrayType);
-        rapidjson::Value json_reqid;
-        rapidjson::Value json_type;
-        rapidjson::Value json_data;
-        json_reqid.SetString(reqid.c_str(), reqid.length(), args.GetAllocator());
-        json_type.SetInt(is_throw ? 0 : 1);
-        json_data.CopyFrom(retval, args.GetAllocator());
-        args.PushBack(json_reqid, args.GetAllocator());
-        args.PushBack(json_type, args.GetAllocator());
-        args.PushBack(json_data, args.GetAllocator());
-        appbus->emit("$response.node", args);
-      };
-  func_(message->args, response_handler);
-}
-
-AppBus::AppBus()
-    : loop_(nullptr) {
 }
 
 void AppBus::init(uv_loop_t *loop) {
   loop_ = loop;
+  attachLoopQueue(loop);
 }
 
 void AppBus::registerToContext(uv_loop_t *loop, v8::Local<v8::Context> context, const char *globalKey) {
@@ -474,22 +4800,37 @@ void AppBus::registerToContext(uv_loop_t *loop, v8::Local<v8::Context> context,
 
   v8::Isolate *isolate = context->GetIsolate();
 
-  v8::Local<v8::ObjectTemplate> v_templ = v8::ObjectTemplate::New(isolate);
+  v8::Local<v8::String> v_global_key(
+      v8::String::NewFromUtf8(isolate, globalKey, v8::NewStringType::kNormal).ToLocalChecked());
+  v8::Local<v8::Object> v_event_bus = newV8EventBus(loop, context);
+
+  context->Global()->Set(context, v_global_key, v_event_bus).FromMaybe(false);
+}
 
-  v8::Local<v8::String> v_global_key(v8::String::NewFromUtf8(isolate, globalKey));
+/**
+ * Creates the JS face of the bus for context, bound to loop.
+ * loop defaults to the event loop of the context's isolate.
+ */
+v8::Local<v8::Object> AppBus::newV8EventBus(uv_loop_t *loop, v8::Local<v8::Context> context) {
+  v8::Isolate *isolate = context->GetIsolate();
+  v8::EscapableHandleScope handle_scope(isolate);
+
+  v8::Local<v8::ObjectTemplate> v_templ = v8::ObjectTemplate::New(isolate);
   v8::Local<v8::Object> v_event_bus;
-  v8::Local<v8::Function> v_func_on;
 
   if (!loop) {
 #if NODE_MAJOR_VERSION >= 10 || \
   NODE_MAJOR_VERSION == 9 && NODE_MINOR_VERSION >= 3 || \
   NODE_MAJOR_VERSION == 8 && NODE_MINOR_VERSION >= 10
-    loop = node::GetCurrentEventLoop(v8::Isolate::GetCurrent());
+    loop = node::GetCurrentEventLoop(isolate);
 #else
     loop = uv_default_loop();
 #endif
   }
 
+  // Create the delivery queue on the loop thread ahead of the first emit.
+  attachLoopQueue(loop);
+
   v_templ->SetInternalFieldCount(2);
 
   v_event_bus = v_templ->NewInstance(context).ToLocalChecked();
@@ -498,17 +4839,103 @@ void AppBus::registerToContext(uv_loop_t *loop, v8::Local<v8::Context> context,
   v_event_bus->SetAlignedPointerInInternalField(1, loop);
 
   {
-    v8::Local<v8::Value> key = v8::String::NewFromUtf8(isolate, "on");
+    v8::Local<v8::String> key = v8PropertyName(isolate, "on");
     v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackOn).ToLocalChecked();
-    v_event_bus->Set(key, func);
+    v_event_bus->Set(context, key, func).FromMaybe(false);
+  }
+  {
+    v8::Local<v8::String> key = v8PropertyName(isolate, "once");
+    v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackOnce).ToLocalChecked();
+    v_event_bus->Set(context, key, func).FromMaybe(false);
   }
   {
-    v8::Local<v8::Value> key = v8::String::NewFromUtf8(isolate, "emit");
+    v8::Local<v8::String> key = v8PropertyName(isolate, "off");
+    v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackOff).ToLocalChecked();
+    v_event_bus->Set(context, key, func).FromMaybe(false);
+  }
+  {
+    v8::Local<v8::String> key = v8PropertyName(isolate, "emit");
     v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackEmit).ToLocalChecked();
-    v_event_bus->Set(key, func);
+    v_event_bus->Set(context, key, func).FromMaybe(false);
+  }
+  {
+    v8::Local<v8::String> key = v8PropertyName(isolate, "request");
+    v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackRequest).ToLocalChecked();
+    v_event_bus->Set(context, key, func).FromMaybe(false);
+  }
+  {
+    v8::Local<v8::String> key = v8PropertyName(isolate, "eventId");
+    v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackEventId).ToLocalChecked();
+    v_event_bus->Set(context, key, func).FromMaybe(false);
+  }
+  {
+    v8::Local<v8::String> key = v8PropertyName(isolate, "onRequest");
+    v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackOnRequest).ToLocalChecked();
+    v_event_bus->Set(context, key, func).FromMaybe(false);
+  }
+  {
+    v8::Local<v8::String> key = v8PropertyName(isolate, "onStream");
+    v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackOnStream).ToLocalChecked();
+    v_event_bus->Set(context, key, func).FromMaybe(false);
+  }
+  {
+    v8::Local<v8::String> key = v8PropertyName(isolate, "openStream");
+    v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackOpenStream).ToLocalChecked();
+    v_event_bus->Set(context, key, func).FromMaybe(false);
+  }
+  {
+    v8::Local<v8::String> key = v8PropertyName(isolate, "openRing");
+    v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackOpenRing).ToLocalChecked();
+    v_event_bus->Set(context, key, func).FromMaybe(false);
+  }
+  {
+    v8::Local<v8::String> key = v8PropertyName(isolate, "emitBinary");
+    v8::Local<v8::Function> func = v8::Function::New(context, v8CallbackEmitBinary).ToLocalChecked();
+    v_event_bus->Set(context, key, func).FromMaybe(false);
   }
 
-  context->Global()->Set(context, v_global_key, v_event_bus);
+#if NODE_MAJOR_VERSION >= 10
+  // Drop this loop's handlers before the isolate goes away.
+  EnvironmentCleanup *cleanup = new EnvironmentCleanup{this, loop, isolate};
+  {
+    std::unique_lock<std::mutex> lock(loop_queues_mutex_);
+    environment_cleanups_.push_back(cleanup);
+  }
+  node::AddEnvironmentCleanupHook(isolate, environmentCleanupHook, cleanup);
+#endif
+
+  return handle_scope.Escape(v_event_bus);
+}
+
+#ifdef NODE_APP_HAS_LINKED_BINDING
+void AppBus::linkToEnvironment(v8::Local<v8::Context> context, const char *name) {
+  linked_binding_names_.emplace_back(name);
+  node::AddLinkedBinding(node::GetCurrentEnvironment(context), linked_binding_names_.back().c_str(),
+                         linkedBindingInit, this);
+}
+
+/**
+ * Runs once per environment that loads the binding, on its own thread:
+ * the bus object is bound to that environment's loop and isolate.
+ */
+void AppBus::linkedBindingInit(v8::Local<v8::Object>,
+                               v8::Local<v8::Value> module,
+                               v8::Local<v8::Context> context,
+                               void *priv) {
+  AppBus *self = static_cast<AppBus *>(priv);
+  v8::Isolate *isolate = context->GetIsolate();
+  v8::Local<v8::Object> v_event_bus = self->newV8EventBus(nullptr, context);
+  if (!module->IsObject()) {
+    v8ThrowError("The linked binding has no module object");
+    return;
+  }
+  v8::Local<v8::String> v_exports_key =
+      v8::String::NewFromUtf8(isolate, "exports", v8::NewStringType::kInternalized).ToLocalChecked();
+  if (module.As<v8::Object>()->Set(context, v_exports_key, v_event_bus).IsNothing()) {
+    // Set() left its exception pending for the require() caller
+    return;
+  }
 }
+#endif
 
 }
\ No newline at end of file
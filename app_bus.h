@@ -13,31 +13,281 @@
 #include <uv.h>
 #include <node.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <map>
-#include <list>
+#include <string>
+#include <vector>
 #include <functional>
 
 #include "rapidjson/document.h"
 
+#include "binary_message.h"
+
+// node::AddLinkedBinding(env, name, fn, priv)
+#if NODE_MAJOR_VERSION >= 15 || \
+  NODE_MAJOR_VERSION == 14 && NODE_MINOR_VERSION >= 8 || \
+  NODE_MAJOR_VERSION == 12 && NODE_MINOR_VERSION >= 19
+#define NODE_APP_HAS_LINKED_BINDING 1
+#endif
+
 namespace node_app {
 
 class AppBus {
  public:
   typedef std::function<void(const rapidjson::Document &)> EventHandler_t;
+  /**
+   * Binary messages carry a single value.
+   * Messages emitted as JSON are presented as an array of their arguments.
+   */
+  typedef std::function<void(BinaryReader &reader)> BinaryEventHandler_t;
+  /**
+   * Receives the arguments as the text of a JSON array, as written by
+   * rapidjson::Writer. JS emits are serialized without building a Document.
+   */
+  typedef std::function<void(const char *json, size_t length)> JsonTextHandler_t;
   typedef std::function<void(const rapidjson::Document &retval, bool is_throw)> ResponseHandler_t;
   typedef std::function<void(const rapidjson::Document &args, ResponseHandler_t &response)> RequestHandler_t;
+  typedef uint64_t SubscriptionId;
+  typedef uint64_t RequestId;
+  typedef uint32_t EventId;
+
+  enum Priority {
+    kPriorityHigh,
+    kPriorityNormal,
+    // Runs under a per-turn time budget
+    kPriorityBulk,
+    kPriorityCount
+  };
+
+  enum OverflowPolicy {
+    kOverflowBlock,
+    kOverflowDropOldest,
+    kOverflowDropNewest,
+    kOverflowCoalesce
+  };
 
   AppBus();
+  ~AppBus();
+  /**
+   * init() and registerToContext() attach a loop to the bus and must run on
+   * that loop's thread. Host listeners may be added from any thread, but
+   * only for attached loops: on a loop that is not attached, or has been
+   * detached, they return 0 or false.
+   */
   void init(uv_loop_t *loop);
   void registerToContext(uv_loop_t *loop, v8::Local<v8::Context> context, const char *globalKey);
 
-  void on(const char *event_key, EventHandler_t handler, uv_loop_t *loop = NULL);
-  void emit(const char *event_key, rapidjson::Value &args, bool single_argument = false);
-  void emit(const char *event_key);
+#ifdef NODE_APP_HAS_LINKED_BINDING
+  /**
+   * Makes the bus available as process._linkedBinding(name) in the
+   * environment of context and in every worker thread it creates.
+   * Each environment gets a bus object bound to its own isolate and loop;
+   * handlers registered there run on that thread.
+   * Node versions without node::AddLinkedBinding (before 12.19 and 14.8)
+   * have no way to reach worker threads: there only contexts passed to
+   * registerToContext get a bus object.
+   */
+  void linkToEnvironment(v8::Local<v8::Context> context, const char *name = "app_bus");
+#endif
+
+  /**
+   * event_key may be a topic pattern: segments are separated by '.' or '/',
+   * '*' or '+' matches one segment and a trailing '#' or '**' matches the
+   * rest, e.g. "download.*" or "ui/+/click". A handler matching an emit
+   * through several subscriptions runs once for each of them.
+   */
+  SubscriptionId on(const char *event_key, EventHandler_t handler, uv_loop_t *loop = NULL);
+  SubscriptionId once(const char *event_key, EventHandler_t handler, uv_loop_t *loop = NULL);
+  bool off(SubscriptionId id);
+
+  /**
+   * Bounds the messages of event_key waiting for each of its listeners.
+   * Once a listener has limit messages queued, policy either blocks the
+   * producer, drops the oldest or the new message, or replaces the newest
+   * queued message with the new one. Producers on the listener's own loop
+   * are never blocked. A limit of 0 removes the bound.
+   */
+  void setQueueLimit(const char *event_key, size_t limit, OverflowPolicy policy);
+
+  /**
+   * Makes event_key a latest-value-wins channel: a message still waiting
+   * for a listener is replaced by the next one, so each listener runs at
+   * most once per loop turn with the newest value. An emit that replaces
+   * a waiting message returns false.
+   */
+  void setCoalescing(const char *event_key, bool enabled);
+
+  /**
+   * Delivery lane of event_key on every loop. High messages run first on
+   * each wakeup, bulk messages only while the loop's bulk budget lasts.
+   */
+  void setPriority(const char *event_key, Priority priority);
+
+  /**
+   * Limits the time and the number of deliveries a single wakeup of loop
+   * may spend; the rest runs on a later turn, after timers and I/O.
+   * Bulk deliveries also stop after bulk_budget_us. 0 means no limit.
+   * Returns false if loop is not attached.
+   */
+  bool setDrainBudget(uv_loop_t *loop, uint64_t budget_us, size_t max_messages, uint64_t bulk_budget_us = 4000);
+
+  /**
+   * Bounds the nesting depth and the number of values of JS arguments
+   * converted to JSON, for every bus. Exceeding them, or passing a cyclic
+   * value, makes the JS call throw a TypeError. 0 means no limit.
+   */
+  static void setJsonLimits(uint32_t max_depth, size_t max_values);
+
+  struct KeyCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    size_t keys;
+  };
+
+  /**
+   * Object keys of JSON delivered to JS are looked up in a cache of
+   * internalized strings per loop and isolate, holding at most max_keys
+   * keys each. Keys longer than 64 bytes are not cached. 0 disables it.
+   */
+  static void setKeyCacheLimit(size_t max_keys);
+  KeyCacheStats getKeyCacheStats(uv_loop_t *loop = NULL);
+
+  /**
+   * The emit functions return false when a bounded listener dropped or
+   * coalesced a message. Unless single_argument is set, args must be an
+   * array of arguments; anything else is not emitted and returns false.
+   */
+  bool emit(const char *event_key, rapidjson::Value &args, bool single_argument = false);
+  /**
+   * Takes over args and its allocator instead of copying it, so args must
+   * own its allocator: a Document constructed with a caller-supplied
+   * allocator would leave the message pointing into memory the caller frees.
+   */
+  bool emit(const char *event_key, rapidjson::Document &&args, bool single_argument = false);
+  bool emit(const char *event_key);
+
+  /**
+   * JS listeners receive one ArrayBuffer backed by buffer, without a copy.
+   * buffer.owner is released once every listener's ArrayBuffer is collected.
+   */
+  bool emit(const char *event_key, BinaryBuffer buffer);
+  bool emit(const char *event_key, std::shared_ptr<const uint8_t> data, size_t length) {
+    const uint8_t *ptr = data.get();
+    return emit(event_key, BinaryBuffer(ptr, length, std::const_pointer_cast<uint8_t>(std::move(data))));
+  }
+  template<class Deleter>
+  bool emit(const char *event_key, std::unique_ptr<uint8_t[], Deleter> data, size_t length) {
+    const uint8_t *ptr = data.get();
+    Deleter deleter = data.get_deleter();
+    return emit(event_key, BinaryBuffer(ptr, length, std::shared_ptr<uint8_t>(data.release(), deleter)));
+  }
+
+  SubscriptionId onBinary(const char *event_key, BinaryEventHandler_t handler, uv_loop_t *loop = NULL);
+  SubscriptionId onJsonText(const char *event_key, JsonTextHandler_t handler, uv_loop_t *loop = NULL);
+  bool emitBinary(const char *event_key, BinaryWriter &writer);
+
+  /**
+   * Emits one argument given as JSON text. JS listeners parse it straight
+   * into JS values on their loop, without a rapidjson Document; the text
+   * is parsed in place when a single listener reads it. Host listeners get
+   * it parsed at emit, and malformed text then makes emitJson return false;
+   * otherwise malformed text is dropped on delivery.
+   */
+  bool emitJson(const char *event_key, const char *json, size_t length);
+  bool emitJson(const char *event_key, std::string &&json);
+
+  /**
+   * Interns event_key and returns its id; the same key always gets the same id.
+   * Emitting by id skips hashing and pattern matching: the listeners of each
+   * id are resolved whenever subscriptions change.
+   * In JS, eventId(key) returns a number that emit() accepts in place of the key.
+   */
+  EventId eventId(const char *event_key);
+  bool emit(EventId event_id, rapidjson::Value &args, bool single_argument = false);
+  bool emit(EventId event_id, rapidjson::Document &&args, bool single_argument = false);
+  bool emit(EventId event_id);
+  bool emitBinary(EventId event_id, BinaryWriter &writer);
+
+  bool onRequest(const char *key, RequestHandler_t handler, uv_loop_t *loop = NULL);
+
+  /**
+   * Calls the handler registered for key by onRequest, host or JS.
+   * callback runs once: with the handler's result, or with an ETIMEDOUT
+   * error after timeout_ms (0 waits forever), or with an ECANCELED error
+   * when the handler's loop is detached or the bus is destroyed first.
+   * For JS handlers it runs on the handler's loop thread. Returns an id for cancelRequest(), or 0 when
+   * the request never went out and callback has already run: args is not an
+   * array (EINVAL), no handler is registered for key (ENOFUNC), or the
+   * handler's loop is already detached (ECANCELED).
+   */
+  RequestId request(const char *key, rapidjson::Value &args, ResponseHandler_t callback, uint64_t timeout_ms = 0);
+  /**
+   * Drops a pending request; its callback is not called.
+   * Returns false if it was already answered.
+   */
+  bool cancelRequest(RequestId id);
+
+  class Batch;
+
+  class Schema;
+  template<class T>
+  class RecordSchema;
+
+  /**
+   * Gives event_key a fixed message shape. Messages carrying a record skip
+   * the JSON DOM: JS listeners get objects from a per-isolate template with
+   * the fields in schema order, onRecord() listeners get the struct itself.
+   * A message carries a record when it comes from emitRecord(), or from a
+   * JS or host JSON emit of a single object on event_key.
+   */
+  void setSchema(const char *event_key, std::shared_ptr<const Schema> schema);
+
+  /** Returns false, delivering nothing, unless event_key has a schema for T. */
+  template<class T>
+  bool emitRecord(const char *event_key, const T &record) {
+    return emitRecordImpl(event_key, typeTag<T>(), std::make_shared<const T>(record));
+  }
+
+  /** handler only sees messages carrying a record of the schema of event_key. */
+  template<class T>
+  SubscriptionId onRecord(const char *event_key, std::function<void(const T &record)> handler, uv_loop_t *loop = NULL) {
+    return onRecordImpl(event_key, typeTag<T>(), [handler](const void *record) -> void {
+      handler(*static_cast<const T *>(record));
+    }, loop);
+  }
+
+  class StreamWriter;
+  class StreamReader;
+  typedef std::function<void(std::shared_ptr<StreamReader> reader)> StreamHandler_t;
+
+  /**
+   * Streams carry chunks of bytes from one writer to the handler registered
+   * for key with onStream, host or JS. The reader hands back a credit for
+   * each chunk it consumed; a writer may have window chunks in flight.
+   */
+  bool onStream(const char *key, StreamHandler_t handler, uv_loop_t *loop = NULL);
+  /** Returns null if no handler is registered for key. */
+  std::shared_ptr<StreamWriter> openStream(const char *key, size_t window = 16);
 
-  void onRequest(const char *key, RequestHandler_t handler, uv_loop_t *loop = NULL);
+  class Ring;
+
+  /**
+   * Creates a shared-memory ring for key, see Ring. JS on one loop attaches
+   * to it with openRing(key). capacity is rounded up to a power of two.
+   * The ring is unregistered once the returned pointer is released.
+   */
+  std::shared_ptr<Ring> createRing(const char *key, size_t capacity);
+
+  /**
+   * Removes every handler bound to loop and closes its delivery queue.
+   * Must be called on the loop thread. Contexts passed to registerToContext
+   * are detached automatically when their node environment is cleaned up.
+   */
+  void detachLoop(uv_loop_t *loop);
 
  private:
   uv_loop_t *loop_;
@@ -45,62 +295,471 @@ class AppBus {
   struct EventMessage {
     rapidjson::Document args;
 
+    // Set when every subscriber lives on the emitting isolate:
+    // the arguments are kept as V8 values and args is left empty.
+    v8::Isolate *visolate;
+    std::vector<v8::Global<v8::Value>> vargs;
+
+    // Set for messages in the v8::ValueSerializer format; args is left empty.
+    std::unique_ptr<BinaryPayload> binary;
+
+    // Set for messages of a channel with a schema; args is filled as well
+    // when a listener cannot take records.
+    std::shared_ptr<const Schema> schema;
+    std::shared_ptr<const void> record;
+
+    // Set for listeners taking JSON text; args is filled as well when a
+    // listener cannot. Holds one argument from emitJson(), or the argument
+    // array if text_args is set. Parsed in place if text_insitu is set.
+    std::unique_ptr<std::string> text;
+    bool text_args;
+    bool text_insitu;
+
     EventMessage()
-        : args(rapidjson::kArrayType) {
+        : args(rapidjson::kArrayType), visolate(nullptr), text_args(false), text_insitu(false) {
     }
   };
 
+  class LoopQueue;
+
   struct RequestMessage {
     std::string reqid;
     rapidjson::Document args;
 
+    // Hands the response back to whoever made the request
+    ResponseHandler_t respond;
+
     RequestMessage(const std::string &_reqid)
         : reqid(_reqid), args(rapidjson::kArrayType) {
     }
   };
+  struct V8Callback;
 
   struct EventHandlerHolder {
     uv_loop_t *loop_;
-    EventHandlerHolder(uv_loop_t *loop) : loop_(loop) {}
+    std::shared_ptr<LoopQueue> queue_;
+    // Set when the handler is added to the registry
+    AppBus *appbus_;
+    SubscriptionId id_;
+    bool once_;
+    std::atomic<bool> removed_;
+    // Pending messages of a bounded event, see setQueueLimit()
+    std::mutex mailbox_mutex_;
+    std::condition_variable mailbox_space_;
+    std::deque<std::shared_ptr<EventMessage>> mailbox_;
+    bool mailbox_scheduled_;
+    EventHandlerHolder(uv_loop_t *loop, std::shared_ptr<LoopQueue> queue)
+        : loop_(loop), queue_(std::move(queue)), appbus_(nullptr), id_(0), once_(false), removed_(false),
+          mailbox_scheduled_(false) {}
     virtual ~EventHandlerHolder() {}
     uv_loop_t *loop() const { return loop_; }
+    LoopQueue *queue() const { return queue_.get(); }
+    virtual v8::Isolate *isolate() const { return nullptr; }
+    enum Formats {
+      kTakesJson = 1,
+      kTakesRecords = 2,
+      kTakesJsonText = 4
+    };
+    // Message representations handle() understands
+    virtual int formats() const { return kTakesJson; }
+    // Frees isolate resources early; called on the loop thread.
+    virtual void release() {}
+    void dispatch(const std::shared_ptr<EventMessage> &message);
+    void markRemoved();
     virtual void handle(std::shared_ptr<EventMessage> message) = 0;
   };
 
   struct RequestHandlerHolder {
     uv_loop_t *loop_;
-    RequestHandlerHolder(uv_loop_t *loop) : loop_(loop) {}
+    std::shared_ptr<LoopQueue> queue_;
+    RequestHandlerHolder(uv_loop_t *loop, std::shared_ptr<LoopQueue> queue)
+        : loop_(loop), queue_(std::move(queue)) {}
     virtual ~RequestHandlerHolder() {}
     uv_loop_t *loop() const { return loop_; }
+    LoopQueue *queue() const { return queue_.get(); }
+    virtual void release() {}
     virtual void handle(std::shared_ptr<RequestMessage> message) = 0;
   };
 
-  struct EventHolder {
-    std::recursive_timed_mutex mutex;
-    std::list<std::shared_ptr<EventHandlerHolder>> list;
-    std::map<std::string, std::shared_ptr<RequestHandlerHolder>> reqs;
+  struct EventEntry {
+    std::vector<std::shared_ptr<EventHandlerHolder>> handlers;
+    size_t queue_limit;
+    OverflowPolicy overflow;
+    bool coalesce;
+    Priority priority;
+    std::shared_ptr<const Schema> schema;
+
+    EventEntry() : queue_limit(0), overflow(kOverflowBlock), coalesce(false), priority(kPriorityNormal) {}
+    bool bounded() const { return queue_limit || coalesce; }
+    // Entries without handlers are kept only to remember their settings
+    bool unused() const { return handlers.empty() && !bounded() && priority == kPriorityNormal && !schema; }
   };
 
-  class EventLock;
+  struct Registry;
+
+  struct LoopTask;
+  struct EventDelivery;
+  struct V8DisposeTask;
+  struct ResponseTask;
+  struct RequestDelivery;
+  struct OutgoingRequest;
+  struct RequestTimeout;
+  struct RequestTimerClose;
+  struct MailboxDrain;
 
-  struct EventEmitTask;
+  struct Stream;
+  struct StreamTask;
+  struct StreamHandlerHolder;
+  struct HostStreamHandlerHolder;
+  struct V8StreamHandlerHolder;
 
   struct HostEventHandlerHolder;
+  struct HostBinaryEventHandlerHolder;
   struct V8EventHandlerHolder;
   struct HostRequestHandlerHolder;
   struct V8RequestHandlerHolder;
 
-  std::recursive_timed_mutex mutex_;
-  std::map<std::string, std::unique_ptr<EventHolder>> event_map_;
+  // Writers serialize on mutex_ and publish a modified copy. Emitters keep
+  // a weak per-thread copy of registry_ and only take registry_mutex_ to
+  // refresh it when registry_version_ has moved on, see registry().
+  std::mutex mutex_;
+  std::shared_ptr<const Registry> registry_;
+  mutable std::mutex registry_mutex_;
+  std::atomic<uint64_t> registry_version_;
+  const uint64_t instance_id_;
+  struct RegistryCache;
+  class RegistryRef;
+  static thread_local RegistryCache registry_cache_;
+  SubscriptionId next_subscription_id_;
+  std::map<SubscriptionId, std::string> subscriptions_;
+  // Interned keys indexed by EventId
+  std::vector<std::string> event_ids_;
+
+  std::mutex requests_mutex_;
+  RequestId next_request_id_;
+  std::map<RequestId, std::shared_ptr<OutgoingRequest>> outgoing_requests_;
+
+  std::atomic<uint64_t> next_stream_id_;
+
+  std::atomic<uint64_t> next_ring_id_;
+  // Shared with the rings, which may outlive the bus
+  struct RingTable;
+  std::shared_ptr<RingTable> rings_;
+  struct RingWakeup;
+  struct RingClose;
+
+  std::mutex loop_queues_mutex_;
+  std::map<uv_loop_t *, std::shared_ptr<LoopQueue>> loop_queues_;
+
+  // Null if loop was never attached or has been detached
+  std::shared_ptr<LoopQueue> getLoopQueue(uv_loop_t *loop);
+  // Loop thread only
+  std::shared_ptr<LoopQueue> attachLoopQueue(uv_loop_t *loop);
+  static std::shared_ptr<LoopQueue> v8LoopQueue(AppBus *self, uv_loop_t *loop);
+  static void disposeV8Callback(std::unique_ptr<V8Callback> callback, LoopQueue *queue);
+
+  struct EnvironmentCleanup {
+    AppBus *appbus;
+    uv_loop_t *loop;
+    v8::Isolate *isolate;
+  };
+  struct EnvironmentCleanupRemove;
+  // Hooks added by newV8EventBus() that have not run yet; guarded by loop_queues_mutex_
+  std::vector<EnvironmentCleanup *> environment_cleanups_;
+  static void environmentCleanupHook(void *arg);
+  // On the environment's thread
+  static void removeEnvironmentCleanup(EnvironmentCleanup *cleanup);
+
+  v8::Local<v8::Object> newV8EventBus(uv_loop_t *loop, v8::Local<v8::Context> context);
+#ifdef NODE_APP_HAS_LINKED_BINDING
+  // node::AddLinkedBinding() keeps the name pointer; a deque never moves its strings
+  std::deque<std::string> linked_binding_names_;
+  static void linkedBindingInit(v8::Local<v8::Object> exports,
+                                v8::Local<v8::Value> module,
+                                v8::Local<v8::Context> context,
+                                void *priv);
+#endif
 
   static void v8ThrowError(const char *msg);
+  static void v8Subscribe(const v8::FunctionCallbackInfo<v8::Value> &info, bool once);
   static void v8CallbackOn(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8CallbackOnce(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8CallbackOff(const v8::FunctionCallbackInfo<v8::Value> &info);
   static void v8CallbackEmit(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8CallbackEmitBinary(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8CallbackEventId(const v8::FunctionCallbackInfo<v8::Value> &info);
+  template<class... Key>
+  static void v8EmitTo(const v8::FunctionCallbackInfo<v8::Value> &info, AppBus *self, Key... key);
+
+  static void v8CallbackRequest(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8CallbackOnRequest(const v8::FunctionCallbackInfo<v8::Value> &info);
 
+  static void v8CallbackOnStream(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8CallbackOpenStream(const v8::FunctionCallbackInfo<v8::Value> &info);
+  static void v8CallbackOpenRing(const v8::FunctionCallbackInfo<v8::Value> &info);
+
+  static v8::Local<v8::Value> v8NoRequestHandlerError(v8::Isolate *isolate);
+  std::shared_ptr<RequestHandlerHolder> findRequestHandler(const char *key, size_t length) const;
+  std::shared_ptr<StreamHandlerHolder> findStreamHandler(const char *key, size_t length) const;
+  std::shared_ptr<Stream> openStreamImpl(const char *key, size_t length, size_t window);
+  void forgetRequest(RequestId id);
+  // Fails the requests routed to loop, or all of them if loop is null, with ECANCELED
+  void cancelOutgoingRequests(uv_loop_t *loop, const char *message);
   void requestFromNode(const v8::FunctionCallbackInfo<v8::Value> &info);
 
-  void emitImpl(const char *event_key, std::shared_ptr<EventMessage> message);
+  RegistryRef registry() const;
+  void publishRegistry(std::shared_ptr<Registry> next);
+  SubscriptionId addEventHandler(const char *event_key, std::shared_ptr<EventHandlerHolder> handler, bool once = false);
+  bool addRequestHandler(const char *key, std::shared_ptr<RequestHandlerHolder> handler);
+  bool addStreamHandler(const char *key, std::shared_ptr<StreamHandlerHolder> handler);
+
+  template<class T>
+  static const void *typeTag() {
+    static const char tag = 0;
+    return &tag;
+  }
+  struct HostJsonTextHandlerHolder;
+  struct HostRecordHandlerHolder;
+  struct SchemaCache;
+  struct JsonV8Builder;
+  bool emitRecordImpl(const char *event_key, const void *type, std::shared_ptr<const void> record);
+  SubscriptionId onRecordImpl(const char *event_key,
+                              const void *type,
+                              std::function<void(const void *record)> handler,
+                              uv_loop_t *loop);
+  template<class... Key>
+  static void attachRecord(const Registry &snapshot, EventMessage &message, Key... key);
+
+  static std::shared_ptr<EventMessage> newJsonMessage(rapidjson::Value &args, bool single_argument);
+  static std::shared_ptr<EventMessage> newJsonMessage(rapidjson::Document &&args, bool single_argument);
+  static std::shared_ptr<EventMessage> newBinaryMessage(BinaryWriter &writer);
+
+  struct BatchDelivery;
+  bool emitImpl(const char *event_key, std::shared_ptr<EventMessage> message);
+  bool emitImpl(EventId event_id, std::shared_ptr<EventMessage> message);
+  bool emitBatch(std::vector<std::pair<std::string, std::shared_ptr<EventMessage>>> &events);
+  template<class F>
+  void updateEventEntry(const char *event_key, F update);
+  static bool deliver(const EventEntry &entry, const std::shared_ptr<EventMessage> &message);
+  static bool deliverBounded(const EventEntry &entry,
+                             const std::shared_ptr<EventHandlerHolder> &handler,
+                             const std::shared_ptr<EventMessage> &message);
+};
+
+/**
+ * Collects events and hands them to AppBus on flush() or destruction.
+ * Each target loop is woken once per flush, and the events run there
+ * in emit order inside a single callback scope.
+ */
+class AppBus::Batch {
+ public:
+  Batch(AppBus *appbus) : appbus_(appbus) {}
+  ~Batch() { flush(); }
+
+  void emit(const char *event_key, rapidjson::Value &args, bool single_argument = false);
+  void emit(const char *event_key, rapidjson::Document &&args, bool single_argument = false);
+  void emit(const char *event_key);
+  void emit(const char *event_key, BinaryBuffer buffer);
+  void emitBinary(const char *event_key, BinaryWriter &writer);
+
+  /** Returns false when a bounded listener dropped or coalesced a message. */
+  bool flush();
+  size_t size() const { return events_.size(); }
+
+ private:
+  AppBus *appbus_;
+  std::vector<std::pair<std::string, std::shared_ptr<EventMessage>>> events_;
+
+  Batch(const Batch &) = delete;
+  Batch &operator=(const Batch &) = delete;
+};
+
+/**
+ * Writing end of a stream opened by the host.
+ * Dropping the writer before end() aborts the stream.
+ */
+class AppBus::StreamWriter {
+ public:
+  StreamWriter(std::shared_ptr<Stream> stream) : stream_(std::move(stream)) {}
+  ~StreamWriter();
+
+  /**
+   * Queues chunk for the reader. Returns false once the window is used up;
+   * the chunk is still sent unless the stream is closed.
+   */
+  bool write(BinaryBuffer chunk);
+  bool write(const void *data, size_t length);
+  /** Blocks until the reader returns credit; false if the stream was aborted. */
+  bool waitWritable();
+  void end();
+  void abort(const char *reason);
+
+ private:
+  std::shared_ptr<Stream> stream_;
+
+  StreamWriter(const StreamWriter &) = delete;
+  StreamWriter &operator=(const StreamWriter &) = delete;
 };
+
+/**
+ * Reading end of a stream handed to a host stream handler.
+ * Handlers run, and pause()/resume() must be called, on the handler's loop.
+ */
+class AppBus::StreamReader {
+ public:
+  typedef std::function<void(const BinaryBuffer &chunk)> DataHandler_t;
+  typedef std::function<void()> EndHandler_t;
+  typedef std::function<void(const std::string &reason)> AbortHandler_t;
+
+  StreamReader(std::shared_ptr<Stream> stream) : stream_(std::move(stream)) {}
+
+  void onData(DataHandler_t handler);
+  void onEnd(EndHandler_t handler);
+  void onAbort(AbortHandler_t handler);
+
+  /** Chunks consumed while paused return their credit on resume(). */
+  void pause();
+  void resume();
+  void abort(const char *reason);
+
+ private:
+  std::shared_ptr<Stream> stream_;
+};
+
+/**
+ * Ordered fields of a channel's messages, see AppBus::setSchema().
+ * Built through RecordSchema<T>; fields are not added once the schema
+ * has been passed to setSchema().
+ */
+class AppBus::Schema {
+ public:
+  enum FieldType {
+    kBool,
+    kInt32,
+    kUint32,
+    kInt64,
+    kDouble,
+    kString
+  };
+
+  virtual ~Schema() {}
+
+ protected:
+  struct Field {
+    std::string name;
+    FieldType type;
+    size_t offset;
+  };
+
+  Schema(const void *type, std::function<std::shared_ptr<void>()> create);
+
+  static FieldType fieldType(const bool *) { return kBool; }
+  static FieldType fieldType(const int32_t *) { return kInt32; }
+  static FieldType fieldType(const uint32_t *) { return kUint32; }
+  static FieldType fieldType(const int64_t *) { return kInt64; }
+  static FieldType fieldType(const double *) { return kDouble; }
+  static FieldType fieldType(const std::string *) { return kString; }
+
+  std::vector<Field> fields_;
+
+ private:
+  friend class AppBus;
+
+  // Keys the per-loop caches of templates and names
+  uint64_t id_;
+  const void *type_;
+  std::function<std::shared_ptr<void>()> create_;
+
+  v8::Local<v8::Object> toV8(LoopQueue *queue, v8::Isolate *isolate, v8::Local<v8::Context> context,
+                             const void *record) const;
+  // Missing or mistyped properties keep their default value
+  std::shared_ptr<void> fromV8(LoopQueue *queue, v8::Isolate *isolate, v8::Local<v8::Context> context,
+                               v8::Local<v8::Object> object) const;
+  SchemaCache &cache(LoopQueue *queue, v8::Isolate *isolate) const;
+  void toJson(const void *record, rapidjson::Value &target, rapidjson::Document::AllocatorType &allocator) const;
+  std::shared_ptr<void> fromJson(const rapidjson::Value &object) const;
+};
+
+/**
+ * Schema of the standard-layout struct T, whose fields are bool, int32_t,
+ * uint32_t, int64_t, double or std::string members:
+ *
+ *   auto schema = std::make_shared<AppBus::RecordSchema<Progress>>();
+ *   schema->field("id", &Progress::id).field("bytes", &Progress::bytes);
+ */
+template<class T>
+class AppBus::RecordSchema : public AppBus::Schema {
+ public:
+  RecordSchema() : Schema(typeTag<T>(), []() -> std::shared_ptr<void> { return std::make_shared<T>(); }) {}
+
+  template<class M>
+  RecordSchema &field(const char *name, M T::*member) {
+    T probe;
+    size_t offset = (const char *) &(probe.*member) - (const char *) &probe;
+    fields_.push_back(Field{name, fieldType(&(probe.*member)), offset});
+    return *this;
+  }
+};
+
+/**
+ * Single-producer, single-consumer ring of length-prefixed records in a
+ * SharedArrayBuffer, for high-rate fixed-schema data. One host thread
+ * writes; JS reads the records in place without a message per record.
+ *
+ * The buffer starts with Int32 counters on separate cache lines: the byte
+ * offsets written and read so far (wrapping at 2^32) and a waiting flag.
+ * Records start at kDataOffset + (offset & (capacity - 1)) with a
+ * little-endian uint32 length, followed by the bytes padded to 4. A length
+ * of kWrapMarker means the record continues at the start of the data area.
+ *
+ * The JS object from openRing(key) has buffer, capacity and dataOffset.
+ * A consumer reads records up to the write offset, stores the read offset,
+ * then stores 1 into the waiting flag and checks the write offset once
+ * more; the next write after that calls its onreadable(). The host cannot
+ * notify Atomics.wait(), so workers waiting there must use a timeout.
+ */
+class AppBus::Ring : public std::enable_shared_from_this<Ring> {
+ public:
+  enum Layout {
+    kWriteOffset = 0,
+    kReadOffset = 64,
+    kWaiting = 128,
+    kDataOffset = 192
+  };
+  static const uint32_t kWrapMarker = 0xffffffff;
+
+  Ring(std::weak_ptr<RingTable> table, uint64_t id, const char *key, size_t capacity);
+  ~Ring();
+
+  /**
+   * Copies one record in. Returns false, writing nothing, if the consumer
+   * has not yet freed enough room. Producer thread only.
+   */
+  bool write(const void *data, size_t length);
+  size_t capacity() const { return capacity_; }
+
+ private:
+  friend class AppBus;
+
+  std::weak_ptr<RingTable> table_;
+  uint64_t id_;
+  std::string key_;
+  size_t capacity_;
+  std::shared_ptr<uint8_t> memory_;
+
+  // Set once JS attaches
+  std::mutex consumer_mutex_;
+  std::shared_ptr<LoopQueue> consumer_;
+
+  std::atomic<int32_t> &counter(Layout field) const {
+    return *reinterpret_cast<std::atomic<int32_t> *>(memory_.get() + field);
+  }
+  void wake();
+
+  Ring(const Ring &) = delete;
+  Ring &operator=(const Ring &) = delete;
+};
+
 }
 
 #endif //__NODE_APP_MAIN_APP_BUS_HPP__
@@ -0,0 +1,779 @@
+/**
+ * @file	binary_message.cc
+ * @author	Jichan (development@jc-lab.net / http://ablog.jc-lab.net/ )
+ * @date	2026/10/16
+ * @copyright Copyright (C) 2019 jichan.\n
+ *            This software may be modified and distributed under the terms
+ *            of the Apache License 2.0.  See the LICENSE file for details.
+ */
+
+#include "binary_message.h"
+
+#include <string.h>
+
+namespace node_app {
+
+// Oldest format that every supported V8 reads; newer deserializers accept it.
+static const uint32_t kWireFormatVersion = 13;
+
+enum SerializationTag : uint8_t {
+  kTagVersion = 0xFF,
+  kTagPadding = '\0',
+  kTagVerifyObjectCount = '?',
+  kTagTheHole = '-',
+  kTagUndefined = '_',
+  kTagNull = '0',
+  kTagTrue = 'T',
+  kTagFalse = 'F',
+  kTagInt32 = 'I',
+  kTagUint32 = 'U',
+  kTagDouble = 'N',
+  kTagBigInt = 'Z',
+  kTagUtf8String = 'S',
+  kTagOneByteString = '"',
+  kTagTwoByteString = 'c',
+  kTagObjectReference = '^',
+  kTagBeginJSObject = 'o',
+  kTagEndJSObject = '{',
+  kTagBeginSparseJSArray = 'a',
+  kTagEndSparseJSArray = '@',
+  kTagBeginDenseJSArray = 'A',
+  kTagEndDenseJSArray = '$',
+  kTagDate = 'D',
+  kTagTrueObject = 'y',
+  kTagFalseObject = 'x',
+  kTagNumberObject = 'n',
+  kTagBigIntObject = 'z',
+  kTagStringObject = 's',
+  kTagBeginJSMap = ';',
+  kTagEndJSMap = ':',
+  kTagBeginJSSet = '\'',
+  kTagEndJSSet = ',',
+  kTagArrayBuffer = 'B',
+  kTagResizableArrayBuffer = '~',
+  kTagArrayBufferTransfer = 't',
+  kTagArrayBufferView = 'V'
+};
+
+static size_t varintSize(uint64_t value) {
+  size_t size = 1;
+  while (value >>= 7) size++;
+  return size;
+}
+
+static void appendUtf8(std::string &out, uint32_t cp) {
+  if (cp < 0x80) {
+    out.push_back((char) cp);
+  } else if (cp < 0x800) {
+    out.push_back((char) (0xC0 | (cp >> 6)));
+    out.push_back((char) (0x80 | (cp & 0x3F)));
+  } else if (cp < 0x10000) {
+    out.push_back((char) (0xE0 | (cp >> 12)));
+    out.push_back((char) (0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back((char) (0x80 | (cp & 0x3F)));
+  } else {
+    out.push_back((char) (0xF0 | (cp >> 18)));
+    out.push_back((char) (0x80 | ((cp >> 12) & 0x3F)));
+    out.push_back((char) (0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back((char) (0x80 | (cp & 0x3F)));
+  }
+}
+
+/**
+ * Decodes one code point, substituting U+FFFD for malformed input.
+ */
+static uint32_t nextUtf8(const uint8_t *&p, const uint8_t *end) {
+  uint32_t c = *p++;
+  int extra;
+  uint32_t min;
+  if (c < 0x80) {
+    return c;
+  } else if ((c & 0xE0) == 0xC0) {
+    extra = 1;
+    min = 0x80;
+    c &= 0x1F;
+  } else if ((c & 0xF0) == 0xE0) {
+    extra = 2;
+    min = 0x800;
+    c &= 0x0F;
+  } else if ((c & 0xF8) == 0xF0) {
+    extra = 3;
+    min = 0x10000;
+    c &= 0x07;
+  } else {
+    return 0xFFFD;
+  }
+  for (; extra > 0; extra--) {
+    if (p == end || (*p & 0xC0) != 0x80) return 0xFFFD;
+    c = (c << 6) | (*p++ & 0x3F);
+  }
+  if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0xFFFD;
+  return c;
+}
+
+BinaryWriter::BinaryWriter() {
+  writeTag(kTagVersion);
+  writeVarint(kWireFormatVersion);
+}
+
+void BinaryWriter::writeTag(uint8_t tag) {
+  buffer_.push_back(tag);
+}
+
+void BinaryWriter::writeVarint(uint64_t value) {
+  do {
+    uint8_t b = (uint8_t) (value & 0x7F);
+    value >>= 7;
+    if (value) b |= 0x80;
+    buffer_.push_back(b);
+  } while (value);
+}
+
+void BinaryWriter::writeRaw(const void *data, size_t length) {
+  const uint8_t *p = (const uint8_t *) data;
+  buffer_.insert(buffer_.end(), p, p + length);
+}
+
+void BinaryWriter::countValue() {
+  if (!levels_.empty()) {
+    levels_.back().count++;
+  }
+}
+
+void BinaryWriter::writeUndefined() {
+  countValue();
+  writeTag(kTagUndefined);
+}
+
+void BinaryWriter::writeNull() {
+  countValue();
+  writeTag(kTagNull);
+}
+
+void BinaryWriter::writeBool(bool value) {
+  countValue();
+  writeTag(value ? kTagTrue : kTagFalse);
+}
+
+void BinaryWriter::writeInt32(int32_t value) {
+  countValue();
+  writeTag(kTagInt32);
+  writeVarint((uint32_t) (((uint32_t) value << 1) ^ (uint32_t) (value >> 31)));
+}
+
+void BinaryWriter::writeUint32(uint32_t value) {
+  countValue();
+  writeTag(kTagUint32);
+  writeVarint(value);
+}
+
+void BinaryWriter::writeDouble(double value) {
+  countValue();
+  writeTag(kTagDouble);
+  writeRaw(&value, sizeof(value));
+}
+
+void BinaryWriter::writeBigInt(int64_t value) {
+  uint64_t magnitude = value < 0 ? (uint64_t) 0 - (uint64_t) value : (uint64_t) value;
+  countValue();
+  writeTag(kTagBigInt);
+  if (!magnitude) {
+    writeVarint(0);
+    return;
+  }
+  writeVarint((sizeof(magnitude) << 1) | (value < 0 ? 1 : 0));
+  writeRaw(&magnitude, sizeof(magnitude));
+}
+
+void BinaryWriter::writeBigUint64(uint64_t value) {
+  countValue();
+  writeTag(kTagBigInt);
+  if (!value) {
+    writeVarint(0);
+    return;
+  }
+  writeVarint(sizeof(value) << 1);
+  writeRaw(&value, sizeof(value));
+}
+
+void BinaryWriter::writeDate(double millis_since_epoch) {
+  countValue();
+  writeTag(kTagDate);
+  writeRaw(&millis_since_epoch, sizeof(millis_since_epoch));
+}
+
+void BinaryWriter::writeString(const char *utf8, size_t length) {
+  const uint8_t *begin = (const uint8_t *) utf8;
+  const uint8_t *end = begin + length;
+  bool ascii = true;
+  for (const uint8_t *p = begin; p != end; p++) {
+    if (*p & 0x80) {
+      ascii = false;
+      break;
+    }
+  }
+
+  countValue();
+
+  if (ascii) {
+    writeTag(kTagOneByteString);
+    writeVarint(length);
+    writeRaw(begin, length);
+    return;
+  }
+
+  std::vector<uint16_t> utf16;
+  utf16.reserve(length);
+  for (const uint8_t *p = begin; p != end;) {
+    uint32_t cp = nextUtf8(p, end);
+    if (cp >= 0x10000) {
+      cp -= 0x10000;
+      utf16.push_back((uint16_t) (0xD800 + (cp >> 10)));
+      utf16.push_back((uint16_t) (0xDC00 + (cp & 0x3FF)));
+    } else {
+      utf16.push_back((uint16_t) cp);
+    }
+  }
+
+  size_t byte_length = utf16.size() * sizeof(uint16_t);
+  // Same alignment rule as v8::ValueSerializer
+  if ((buffer_.size() + 1 + varintSize(byte_length)) & 1) {
+    writeTag(kTagPadding);
+  }
+  writeTag(kTagTwoByteString);
+  writeVarint(byte_length);
+  writeRaw(utf16.data(), byte_length);
+}
+
+void BinaryWriter::writeArrayBuffer(const void *data, size_t length) {
+  countValue();
+  writeTag(kTagArrayBuffer);
+  writeVarint(length);
+  writeRaw(data, length);
+}
+
+void BinaryWriter::writeArrayBufferView(ViewType type, const void *data, size_t length) {
+  writeArrayBuffer(data, length);
+  writeTag(kTagArrayBufferView);
+  writeVarint((uint8_t) type);
+  writeVarint(0);
+  writeVarint(length);
+}
+
+void BinaryWriter::writeArrayBuffer(BinaryBuffer buffer) {
+  countValue();
+  writeTag(kTagArrayBufferTransfer);
+  writeVarint(transfers_.size());
+  transfers_.push_back(std::move(buffer));
+}
+
+void BinaryWriter::writeArrayBufferView(ViewType type, BinaryBuffer buffer) {
+  size_t length = buffer.length;
+  writeArrayBuffer(std::move(buffer));
+  writeTag(kTagArrayBufferView);
+  writeVarint((uint8_t) type);
+  writeVarint(0);
+  writeVarint(length);
+}
+
+void BinaryWriter::beginObject() {
+  countValue();
+  levels_.push_back({true, 0, 0});
+  writeTag(kTagBeginJSObject);
+}
+
+void BinaryWriter::endObject() {
+  Level level = levels_.back();
+  levels_.pop_back();
+  writeTag(kTagEndJSObject);
+  writeVarint(level.count / 2);
+}
+
+void BinaryWriter::beginArray(uint32_t length) {
+  countValue();
+  levels_.push_back({false, 0, length});
+  writeTag(kTagBeginDenseJSArray);
+  writeVarint(length);
+}
+
+void BinaryWriter::endArray() {
+  Level level = levels_.back();
+  levels_.pop_back();
+  writeTag(kTagEndDenseJSArray);
+  writeVarint(0);
+  writeVarint(level.length);
+}
+
+BinaryPayload BinaryWriter::release() {
+  std::shared_ptr<std::vector<uint8_t>> owned(new std::vector<uint8_t>(std::move(buffer_)));
+  BinaryPayload payload;
+  payload.data = BinaryBuffer(owned->data(), owned->size(), owned);
+  payload.transfers = std::move(transfers_);
+  transfers_.clear();
+  levels_.clear();
+  return payload;
+}
+
+BinaryReader::BinaryReader(const BinaryPayload &payload)
+    : BinaryReader(payload.data.data, payload.data.length, &payload.transfers) {
+}
+
+BinaryReader::BinaryReader(const uint8_t *data, size_t length, const std::vector<BinaryBuffer> *transfers)
+    : pos_(data), end_(data + length), transfers_(transfers), version_(0),
+      bool_value_(false), int32_value_(0), uint32_value_(0), double_value_(0),
+      bigint_negative_(false), bigint_fits_(true), bigint_magnitude_(0),
+      bytes_(nullptr), bytes_length_(0), view_type_(BinaryWriter::kUint8Array) {
+}
+
+bool BinaryReader::readVarint(uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos_ == end_) return false;
+    uint8_t b = *pos_++;
+    value |= (uint64_t) (b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+bool BinaryReader::readVarint32(uint32_t &value) {
+  uint64_t wide;
+  if (!readVarint(wide) || wide > 0xFFFFFFFFu) return false;
+  value = (uint32_t) wide;
+  return true;
+}
+
+bool BinaryReader::readRaw(const uint8_t *&data, size_t length) {
+  if ((size_t) (end_ - pos_) < length) return false;
+  data = pos_;
+  pos_ += length;
+  return true;
+}
+
+bool BinaryReader::readHeader() {
+  if (pos_ == end_ || *pos_ != kTagVersion) return false;
+  pos_++;
+  return readVarint32(version_);
+}
+
+bool BinaryReader::bigIntValue(int64_t &value) const {
+  if (!bigint_fits_) return false;
+  if (bigint_negative_) {
+    if (bigint_magnitude_ > (uint64_t) INT64_MAX + 1) return false;
+    value = (int64_t) (0 - bigint_magnitude_);
+  } else {
+    if (bigint_magnitude_ > (uint64_t) INT64_MAX) return false;
+    value = (int64_t) bigint_magnitude_;
+  }
+  return true;
+}
+
+BinaryReader::Token BinaryReader::readBigInt() {
+  uint64_t bitfield;
+  const uint8_t *digits;
+  if (!readVarint(bitfield)) return kError;
+  size_t byte_length = (size_t) (bitfield >> 1);
+  if (!readRaw(digits, byte_length)) return kError;
+  bigint_negative_ = (bitfield & 1) != 0;
+  bigint_magnitude_ = 0;
+  bigint_fits_ = true;
+  for (size_t i = 0; i < byte_length; i++) {
+    if (i < sizeof(uint64_t)) {
+      bigint_magnitude_ |= (uint64_t) digits[i] << (i * 8);
+    } else if (digits[i]) {
+      bigint_fits_ = false;
+    }
+  }
+  double_value_ = bigint_negative_ ? -(double) bigint_magnitude_ : (double) bigint_magnitude_;
+  return kBigInt;
+}
+
+BinaryReader::Token BinaryReader::readArrayBufferView(const uint8_t *buffer, size_t buffer_length) {
+  bytes_ = buffer;
+  bytes_length_ = buffer_length;
+  if (pos_ == end_ || *pos_ != kTagArrayBufferView) {
+    return kArrayBuffer;
+  }
+  pos_++;
+
+  uint32_t sub_tag, byte_offset, byte_length, flags;
+  if (!readVarint32(sub_tag) || !readVarint32(byte_offset) || !readVarint32(byte_length)) return kError;
+  if (version_ >= 14 && !readVarint32(flags)) return kError;
+  if (byte_offset > buffer_length || byte_length > buffer_length - byte_offset) return kError;
+
+  bytes_ = buffer + byte_offset;
+  bytes_length_ = byte_length;
+  view_type_ = (BinaryWriter::ViewType) sub_tag;
+  return kArrayBufferView;
+}
+
+BinaryReader::Token BinaryReader::next() {
+  for (;;) {
+    if (pos_ == end_) return kEnd;
+
+    uint8_t tag = *pos_++;
+    switch (tag) {
+      case kTagPadding:
+        continue;
+      case kTagVerifyObjectCount: {
+        uint64_t ignored;
+        if (!readVarint(ignored)) return kError;
+        continue;
+      }
+      case kTagTheHole:
+      case kTagUndefined:
+        return kUndefined;
+      case kTagNull:
+        return kNull;
+      case kTagTrue:
+      case kTagTrueObject:
+        bool_value_ = true;
+        return kBool;
+      case kTagFalse:
+      case kTagFalseObject:
+        bool_value_ = false;
+        return kBool;
+      case kTagInt32: {
+        uint32_t zigzag;
+        if (!readVarint32(zigzag)) return kError;
+        int32_value_ = (int32_t) ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+        double_value_ = int32_value_;
+        return kInt32;
+      }
+      case kTagUint32:
+        if (!readVarint32(uint32_value_)) return kError;
+        double_value_ = uint32_value_;
+        return kUint32;
+      case kTagDouble:
+      case kTagNumberObject:
+      case kTagDate: {
+        const uint8_t *raw;
+        if (!readRaw(raw, sizeof(double_value_))) return kError;
+        memcpy(&double_value_, raw, sizeof(double_value_));
+        return tag == kTagDate ? kDate : kDouble;
+      }
+      case kTagBigInt:
+      case kTagBigIntObject:
+        return readBigInt();
+      case kTagOneByteString:
+      case kTagTwoByteString:
+      case kTagUtf8String: {
+        uint32_t byte_length;
+        const uint8_t *raw;
+        if (!readVarint32(byte_length) || !readRaw(raw, byte_length)) return kError;
+        string_value_.clear();
+        if (tag == kTagUtf8String) {
+          string_value_.assign((const char *) raw, byte_length);
+        } else if (tag == kTagOneByteString) {
+          string_value_.reserve(byte_length);
+          for (uint32_t i = 0; i < byte_length; i++) appendUtf8(string_value_, raw[i]);
+        } else {
+          if (byte_length & 1) return kError;
+          string_value_.reserve(byte_length);
+          for (uint32_t i = 0; i < byte_length; i += 2) {
+            uint32_t cp = raw[i] | (raw[i + 1] << 8);
+            if (cp >= 0xD800 && cp <= 0xDBFF && i + 3 < byte_length) {
+              uint32_t low = raw[i + 2] | (raw[i + 3] << 8);
+              if (low >= 0xDC00 && low <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+              }
+            }
+            if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
+            appendUtf8(string_value_, cp);
+          }
+        }
+        return kString;
+      }
+      case kTagStringObject:
+        // followed by a tagged string
+        continue;
+      case kTagObjectReference:
+        if (!readVarint32(uint32_value_)) return kError;
+        return kReference;
+      case kTagBeginJSObject:
+        return kBeginObject;
+      case kTagEndJSObject:
+        if (!readVarint32(uint32_value_)) return kError;
+        return kEndObject;
+      case kTagBeginDenseJSArray:
+      case kTagBeginSparseJSArray:
+        if (!readVarint32(uint32_value_)) return kError;
+        return tag == kTagBeginDenseJSArray ? kBeginArray : kBeginSparseArray;
+      case kTagEndDenseJSArray:
+      case kTagEndSparseJSArray: {
+        uint32_t num_properties;
+        if (!readVarint32(num_properties) || !readVarint32(uint32_value_)) return kError;
+        return tag == kTagEndDenseJSArray ? kEndArray : kEndSparseArray;
+      }
+      case kTagBeginJSMap:
+        return kBeginMap;
+      case kTagEndJSMap:
+        if (!readVarint32(uint32_value_)) return kError;
+        return kEndMap;
+      case kTagBeginJSSet:
+        return kBeginSet;
+      case kTagEndJSSet:
+        if (!readVarint32(uint32_value_)) return kError;
+        return kEndSet;
+      case kTagArrayBuffer: {
+        uint32_t byte_length;
+        const uint8_t *raw;
+        if (!readVarint32(byte_length) || !readRaw(raw, byte_length)) return kError;
+        return readArrayBufferView(raw, byte_length);
+      }
+      case kTagResizableArrayBuffer: {
+        uint32_t byte_length, max_length;
+        const uint8_t *raw;
+        if (!readVarint32(byte_length) || !readVarint32(max_length) || !readRaw(raw, byte_length)) return kError;
+        return readArrayBufferView(raw, byte_length);
+      }
+      case kTagArrayBufferTransfer: {
+        uint32_t transfer_id;
+        if (!readVarint32(transfer_id)) return kError;
+        if (!transfers_ || transfer_id >= transfers_->size()) return kError;
+        const BinaryBuffer &buffer = (*transfers_)[transfer_id];
+        return readArrayBufferView(buffer.data, buffer.length);
+      }
+      default:
+        return kError;
+    }
+  }
+}
+
+static bool binaryKeyToJson(rapidjson::Value &target,
+                            rapidjson::Document::AllocatorType &allocator,
+                            BinaryReader &reader,
+                            BinaryReader::Token token) {
+  std::string key;
+  switch (token) {
+    case BinaryReader::kString:
+      target.SetString(reader.stringValue().data(), reader.stringValue().length(), allocator);
+      return true;
+    case BinaryReader::kInt32:
+      key = std::to_string(reader.int32Value());
+      break;
+    case BinaryReader::kUint32:
+      key = std::to_string(reader.uint32Value());
+      break;
+    case BinaryReader::kDouble:
+      key = std::to_string(reader.doubleValue());
+      break;
+    default:
+      return false;
+  }
+  target.SetString(key.data(), key.length(), allocator);
+  return true;
+}
+
+static bool binaryScalarToJson(rapidjson::Value &target,
+                               rapidjson::Document::AllocatorType &allocator,
+                               BinaryReader &reader,
+                               BinaryReader::Token token) {
+  switch (token) {
+    case BinaryReader::kUndefined:
+    case BinaryReader::kNull:
+    case BinaryReader::kReference:
+      target.SetNull();
+      return true;
+    case BinaryReader::kBool:
+      target.SetBool(reader.boolValue());
+      return true;
+    case BinaryReader::kInt32:
+      target.SetInt(reader.int32Value());
+      return true;
+    case BinaryReader::kUint32:
+      target.SetUint(reader.uint32Value());
+      return true;
+    case BinaryReader::kDouble:
+    case BinaryReader::kDate:
+      target.SetDouble(reader.doubleValue());
+      return true;
+    case BinaryReader::kBigInt: {
+      int64_t value;
+      if (reader.bigIntValue(value)) {
+        target.SetInt64(value);
+      } else {
+        target.SetDouble(reader.doubleValue());
+      }
+      return true;
+    }
+    case BinaryReader::kString:
+      target.SetString(reader.stringValue().data(), reader.stringValue().length(), allocator);
+      return true;
+    case BinaryReader::kArrayBuffer:
+    case BinaryReader::kArrayBufferView: {
+      target.SetArray();
+      target.Reserve(reader.bytesLength(), allocator);
+      for (size_t i = 0; i < reader.bytesLength(); i++) {
+        target.PushBack(rapidjson::Value((unsigned) reader.bytes()[i]), allocator);
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+/**
+ * A container being read by binaryToJson().
+ * Objects, sparse arrays and maps alternate keys and values; dense arrays
+ * take length elements, then keys and values that are dropped.
+ */
+struct BinaryJsonFrame {
+  rapidjson::Value value;
+  rapidjson::Value key;
+  BinaryReader::Token end_token;
+  // Elements a dense array still expects
+  uint32_t remaining;
+  bool has_key;
+
+  BinaryJsonFrame(BinaryReader::Token _end_token, uint32_t _remaining)
+      : end_token(_end_token), remaining(_remaining), has_key(false) {}
+
+  bool takesKeys() const {
+    return value.IsObject() || (end_token == BinaryReader::kEndArray && !remaining);
+  }
+};
+
+/**
+ * Reads containers with an explicit stack, so deeply nested payloads
+ * cannot exhaust the caller's stack.
+ */
+bool binaryToJson(rapidjson::Value &target,
+                  rapidjson::Document::AllocatorType &allocator,
+                  BinaryReader &reader) {
+  std::vector<BinaryJsonFrame> frames;
+  for (;;) {
+    BinaryReader::Token token = reader.next();
+    rapidjson::Value current;
+    bool closed = false;
+
+    if (!frames.empty()) {
+      BinaryJsonFrame &frame = frames.back();
+      bool at_key = frame.takesKeys() && !frame.has_key;
+      if (token == frame.end_token && (at_key || frame.end_token == BinaryReader::kEndSet)) {
+        current = frame.value;
+        frames.pop_back();
+        closed = true;
+      } else if (at_key) {
+        if (!binaryKeyToJson(frame.key, allocator, reader, token)) return false;
+        frame.has_key = true;
+        continue;
+      }
+    }
+
+    if (closed) {
+      // current holds the container closed above
+    } else if (token == BinaryReader::kBeginObject ||
+        token == BinaryReader::kBeginSparseArray ||
+        token == BinaryReader::kBeginMap) {
+      BinaryReader::Token end_token = token == BinaryReader::kBeginObject ? BinaryReader::kEndObject
+          : token == BinaryReader::kBeginSparseArray ? BinaryReader::kEndSparseArray : BinaryReader::kEndMap;
+      frames.emplace_back(end_token, 0);
+      frames.back().value.SetObject();
+      continue;
+    } else if (token == BinaryReader::kBeginArray) {
+      uint32_t length = reader.length();
+      frames.emplace_back(BinaryReader::kEndArray, length);
+      frames.back().value.SetArray();
+      // The length comes off the wire; every element takes at least a byte
+      size_t reserve = length < reader.remaining() ? length : reader.remaining();
+      frames.back().value.Reserve((rapidjson::SizeType) reserve, allocator);
+      continue;
+    } else if (token == BinaryReader::kBeginSet) {
+      frames.emplace_back(BinaryReader::kEndSet, 0);
+      frames.back().value.SetArray();
+      continue;
+    } else if (!binaryScalarToJson(current, allocator, reader, token)) {
+      return false;
+    }
+
+    if (frames.empty()) {
+      target = current;
+      return true;
+    }
+    BinaryJsonFrame &parent = frames.back();
+    if (parent.value.IsObject()) {
+      parent.value.AddMember(parent.key, current, allocator);
+      parent.has_key = false;
+    } else if (parent.end_token == BinaryReader::kEndSet || parent.remaining) {
+      parent.value.PushBack(current, allocator);
+      if (parent.remaining) parent.remaining--;
+    } else {
+      // Named properties of the array are not representable
+      parent.has_key = false;
+    }
+  }
+}
+
+static void jsonScalarToBinary(BinaryWriter &writer, const rapidjson::Value &src) {
+  if (src.IsNull()) {
+    writer.writeNull();
+  } else if (src.IsBool()) {
+    writer.writeBool(src.GetBool());
+  } else if (src.IsUint64() && !src.IsUint()) {
+    writer.writeBigUint64(src.GetUint64());
+  } else if (src.IsInt64() && !src.IsInt()) {
+    writer.writeBigInt(src.GetInt64());
+  } else if (src.IsUint()) {
+    writer.writeUint32(src.GetUint());
+  } else if (src.IsInt()) {
+    writer.writeInt32(src.GetInt());
+  } else if (src.IsNumber()) {
+    writer.writeDouble(src.GetDouble());
+  } else if (src.IsString()) {
+    writer.writeString(src.GetString(), src.GetStringLength());
+  } else {
+    writer.writeUndefined();
+  }
+}
+
+/**
+ * Walks src with an explicit stack, like binaryToJson().
+ */
+void jsonToBinary(BinaryWriter &writer, const rapidjson::Value &src) {
+  // Containers being written and the index of their next child
+  std::vector<std::pair<const rapidjson::Value *, rapidjson::SizeType>> frames;
+  const rapidjson::Value *value = &src;
+  for (;;) {
+    if (value) {
+      if (value->IsObject()) {
+        writer.beginObject();
+        frames.emplace_back(value, 0);
+      } else if (value->IsArray()) {
+        writer.beginArray(value->Size());
+        frames.emplace_back(value, 0);
+      } else {
+        jsonScalarToBinary(writer, *value);
+      }
+    }
+    if (frames.empty()) {
+      return;
+    }
+
+    const rapidjson::Value &container = *frames.back().first;
+    rapidjson::SizeType index = frames.back().second;
+    if (container.IsObject()) {
+      if (index < container.MemberCount()) {
+        const rapidjson::Value::Member &member = container.MemberBegin()[index];
+        writer.writeString(member.name.GetString(), member.name.GetStringLength());
+        value = &member.value;
+        frames.back().second++;
+        continue;
+      }
+      writer.endObject();
+    } else {
+      if (index < container.Size()) {
+        value = &container[index];
+        frames.back().second++;
+        continue;
+      }
+      writer.endArray();
+    }
+    frames.pop_back();
+    value = nullptr;
+  }
+}
+
+}
@@ -0,0 +1,207 @@
+/**
+ * @file	binary_message.h
+ * @author	Jichan (development@jc-lab.net / http://ablog.jc-lab.net/ )
+ * @date	2026/10/16
+ * @copyright Copyright (C) 2019 jichan.\n
+ *            This software may be modified and distributed under the terms
+ *            of the Apache License 2.0.  See the LICENSE file for details.
+ */
+
+#ifndef __NODE_APP_BINARY_MESSAGE_H__
+#define __NODE_APP_BINARY_MESSAGE_H__
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rapidjson/document.h"
+
+namespace node_app {
+
+/**
+ * Read-only view of bytes kept alive by owner.
+ */
+struct BinaryBuffer {
+  const uint8_t *data;
+  size_t length;
+  std::shared_ptr<void> owner;
+
+  BinaryBuffer() : data(nullptr), length(0) {}
+  BinaryBuffer(const uint8_t *_data, size_t _length, std::shared_ptr<void> _owner)
+      : data(_data), length(_length), owner(std::move(_owner)) {}
+};
+
+/**
+ * Serialized value in the v8::ValueSerializer wire format.
+ * transfers holds the ArrayBuffer contents referenced by transfer id.
+ */
+struct BinaryPayload {
+  BinaryBuffer data;
+  std::vector<BinaryBuffer> transfers;
+};
+
+/**
+ * Writes the v8::ValueSerializer wire format without an isolate.
+ * Object and array member counts are tracked by the writer.
+ */
+class BinaryWriter {
+ public:
+  enum ViewType {
+    kInt8Array = 'b',
+    kUint8Array = 'B',
+    kUint8ClampedArray = 'C',
+    kInt16Array = 'w',
+    kUint16Array = 'W',
+    kInt32Array = 'd',
+    kUint32Array = 'D',
+    kFloat32Array = 'f',
+    kFloat64Array = 'F',
+    kDataView = '?'
+  };
+
+  BinaryWriter();
+
+  void writeUndefined();
+  void writeNull();
+  void writeBool(bool value);
+  void writeInt32(int32_t value);
+  void writeUint32(uint32_t value);
+  void writeDouble(double value);
+  void writeBigInt(int64_t value);
+  void writeBigUint64(uint64_t value);
+  void writeDate(double millis_since_epoch);
+  void writeString(const char *utf8, size_t length);
+  void writeString(const std::string &utf8) { writeString(utf8.data(), utf8.length()); }
+  void writeArrayBuffer(const void *data, size_t length);
+  void writeArrayBufferView(ViewType type, const void *data, size_t length);
+  /** By reference: JS receives an ArrayBuffer over buffer without a copy. */
+  void writeArrayBuffer(BinaryBuffer buffer);
+  void writeArrayBufferView(ViewType type, BinaryBuffer buffer);
+
+  void beginObject();
+  void endObject();
+  void beginArray(uint32_t length);
+  void endArray();
+
+  BinaryPayload release();
+
+ private:
+  struct Level {
+    bool is_object;
+    uint32_t count;
+    uint32_t length;
+  };
+
+  std::vector<uint8_t> buffer_;
+  std::vector<Level> levels_;
+  std::vector<BinaryBuffer> transfers_;
+
+  void writeTag(uint8_t tag);
+  void writeVarint(uint64_t value);
+  void writeRaw(const void *data, size_t length);
+  void countValue();
+};
+
+/**
+ * Pull reader for the v8::ValueSerializer wire format.
+ * Call readHeader() once, then next() until kEnd or kError.
+ */
+class BinaryReader {
+ public:
+  enum Token {
+    kEnd,
+    kError,
+    kUndefined,
+    kNull,
+    kBool,
+    kInt32,
+    kUint32,
+    kDouble,
+    kBigInt,
+    kDate,
+    kString,
+    kArrayBuffer,
+    kArrayBufferView,
+    kReference,
+    kBeginObject,
+    kEndObject,
+    kBeginArray,
+    kEndArray,
+    kBeginSparseArray,
+    kEndSparseArray,
+    kBeginMap,
+    kEndMap,
+    kBeginSet,
+    kEndSet
+  };
+
+  BinaryReader(const BinaryPayload &payload);
+  BinaryReader(const uint8_t *data, size_t length, const std::vector<BinaryBuffer> *transfers = nullptr);
+
+  bool readHeader();
+  Token next();
+
+  uint32_t version() const { return version_; }
+
+  bool boolValue() const { return bool_value_; }
+  int32_t int32Value() const { return int32_value_; }
+  uint32_t uint32Value() const { return uint32_value_; }
+  /** kDouble and kDate, or any numeric token widened to double */
+  double doubleValue() const { return double_value_; }
+  /** kBigInt: false if the magnitude does not fit in 64 bits */
+  bool bigIntValue(int64_t &value) const;
+  /** kString: UTF-8 */
+  const std::string &stringValue() const { return string_value_; }
+  /** kArrayBuffer, kArrayBufferView: bytes of the buffer or of the view */
+  const uint8_t *bytes() const { return bytes_; }
+  size_t bytesLength() const { return bytes_length_; }
+  /** kArrayBufferView */
+  BinaryWriter::ViewType viewType() const { return view_type_; }
+  /** kBeginArray, kBeginSparseArray: array length; kReference: object id */
+  uint32_t length() const { return uint32_value_; }
+  /** Bytes left to read */
+  size_t remaining() const { return (size_t) (end_ - pos_); }
+
+ private:
+  const uint8_t *pos_;
+  const uint8_t *end_;
+  const std::vector<BinaryBuffer> *transfers_;
+  uint32_t version_;
+
+  bool bool_value_;
+  int32_t int32_value_;
+  uint32_t uint32_value_;
+  double double_value_;
+  bool bigint_negative_;
+  bool bigint_fits_;
+  uint64_t bigint_magnitude_;
+  std::string string_value_;
+  const uint8_t *bytes_;
+  size_t bytes_length_;
+  BinaryWriter::ViewType view_type_;
+
+  bool readVarint(uint64_t &value);
+  bool readVarint32(uint32_t &value);
+  bool readRaw(const uint8_t *&data, size_t length);
+  Token readBigInt();
+  Token readArrayBufferView(const uint8_t *buffer, size_t buffer_length);
+};
+
+/**
+ * Reads one value from reader into target.
+ * ArrayBuffers and views become arrays of byte values, Dates become numbers.
+ */
+bool binaryToJson(rapidjson::Value &target,
+                  rapidjson::Document::AllocatorType &allocator,
+                  BinaryReader &reader);
+
+/**
+ * Writes one JSON value to writer.
+ */
+void jsonToBinary(BinaryWriter &writer, const rapidjson::Value &src);
+
+}
+
+#endif //__NODE_APP_BINARY_MESSAGE_H__
@@ -0,0 +1,531 @@
+/**
+ * @file	addon.cc
+ * @copyright Copyright (C) 2019 jichan.\n
+ *            This software may be modified and distributed under the terms
+ *            of the Apache License 2.0.  See the LICENSE file for details.
+ *
+ * Test addon: loads an AppBus into a plain node process. The bus object is
+ * registered as the global appBus; the exports drive the host side of it.
+ * Host listeners record what they receive until takeReceived() is called.
+ */
+
+#include <node.h>
+#include <uv.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "app_bus.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+namespace {
+
+using node_app::AppBus;
+
+AppBus *bus = nullptr;
+uv_loop_t *bus_loop = nullptr;
+
+// (key, JSON text) in the order host listeners ran; loop thread only
+std::vector<std::pair<std::string, std::string>> received;
+
+std::string stringify(const rapidjson::Value &value) {
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  value.Accept(writer);
+  return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+std::string toString(v8::Isolate *isolate, v8::Local<v8::Value> value) {
+  v8::String::Utf8Value utf8(isolate, value);
+  return std::string(*utf8, utf8.length());
+}
+
+v8::Local<v8::String> newString(v8::Isolate *isolate, const std::string &str) {
+  return v8::String::NewFromUtf8(isolate, str.data(), v8::NewStringType::kNormal, (int) str.length())
+      .ToLocalChecked();
+}
+
+void record(const std::string &key, const std::string &json) {
+  received.emplace_back(key, json);
+}
+
+// Counts the host listeners the bus still holds
+int live_handlers = 0;
+
+struct HandlerToken {
+  HandlerToken() { live_handlers++; }
+  ~HandlerToken() { live_handlers--; }
+};
+
+// hostOn(key) subscribes a host listener on the bus loop; returns its id
+void hostOn(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  std::string key = toString(isolate, info[0]);
+  std::shared_ptr<HandlerToken> token(new HandlerToken());
+  AppBus::SubscriptionId id = bus->on(key.c_str(), [key, token](const rapidjson::Document &args) -> void {
+    record(key, stringify(args));
+  });
+  info.GetReturnValue().Set(v8::Number::New(isolate, (double) id));
+}
+
+// hostOff(id)
+void hostOff(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  AppBus::SubscriptionId id = (AppBus::SubscriptionId) info[0]->IntegerValue(isolate->GetCurrentContext()).FromMaybe(0);
+  info.GetReturnValue().Set(bus->off(id));
+}
+
+// liveHandlers() returns how many hostOn listeners have not been freed
+void liveHandlers(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  info.GetReturnValue().Set(live_handlers);
+}
+
+// hostOnJsonText(key) records the text an onJsonText listener receives
+void hostOnJsonText(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  std::string key = toString(isolate, info[0]);
+  AppBus::SubscriptionId id = bus->onJsonText(key.c_str(), [key](const char *json, size_t length) -> void {
+    record(key, std::string(json, length));
+  });
+  info.GetReturnValue().Set(v8::Number::New(isolate, (double) id));
+}
+
+// hostEmit(key, json, single_argument) emits the parsed argument array
+// from the host, or the parsed value as the only argument.
+// The text may hold NaN and Infinity.
+void hostEmit(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  std::string key = toString(isolate, info[0]);
+  std::string json = toString(isolate, info[1]);
+  rapidjson::Document args;
+  args.Parse<rapidjson::kParseNanAndInfFlag>(json.c_str(), json.length());
+  info.GetReturnValue().Set(bus->emit(key.c_str(), std::move(args), info[2]->IsTrue()));
+}
+
+// hostEmitJson(key, json, owned) emits json as one argument, handing over
+// a std::string when owned is set
+void hostEmitJson(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  std::string key = toString(isolate, info[0]);
+  std::string json = toString(isolate, info[1]);
+  if (info[2]->IsTrue()) {
+    info.GetReturnValue().Set(bus->emitJson(key.c_str(), std::move(json)));
+  } else {
+    info.GetReturnValue().Set(bus->emitJson(key.c_str(), json.data(), json.length()));
+  }
+}
+
+// hostOnBinary(key) records the JSON form of the values a binary listener reads
+void hostOnBinary(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  std::string key = toString(isolate, info[0]);
+  AppBus::SubscriptionId id = bus->onBinary(key.c_str(), [key](node_app::BinaryReader &reader) -> void {
+    rapidjson::Document value;
+    if (node_app::binaryToJson(value, value.GetAllocator(), reader)) {
+      record(key, stringify(value));
+    }
+  });
+  info.GetReturnValue().Set(v8::Number::New(isolate, (double) id));
+}
+
+// hostEmitBinarySample(key) emits
+// {date: Date(1000), big: -5n, bytes: Uint16Array [1, 2], list: [1, 'two', true, null]}
+void hostEmitBinarySample(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  std::string key = toString(info.GetIsolate(), info[0]);
+  const uint16_t shorts[] = {1, 2};
+  node_app::BinaryWriter writer;
+  writer.beginObject();
+  writer.writeString("date");
+  writer.writeDate(1000);
+  writer.writeString("big");
+  writer.writeBigInt(-5);
+  writer.writeString("bytes");
+  writer.writeArrayBufferView(node_app::BinaryWriter::kUint16Array, shorts, sizeof(shorts));
+  writer.writeString("list");
+  writer.beginArray(4);
+  writer.writeInt32(1);
+  writer.writeString("two");
+  writer.writeBool(true);
+  writer.writeNull();
+  writer.endArray();
+  writer.endObject();
+  info.GetReturnValue().Set(bus->emitBinary(key.c_str(), writer));
+}
+
+// Counts the host buffers hostEmitBuffer() lent out that are still alive
+int live_buffers = 0;
+
+// hostEmitBuffer(key, bytes) emits an ArrayBuffer over host memory holding
+// the given byte values, by reference
+void hostEmitBuffer(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  std::string key = toString(isolate, info[0]);
+  v8::Local<v8::Array> vbytes = info[1].As<v8::Array>();
+  std::shared_ptr<std::vector<uint8_t>> bytes(new std::vector<uint8_t>(), [](std::vector<uint8_t> *bytes) {
+    live_buffers--;
+    delete bytes;
+  });
+  live_buffers++;
+  for (uint32_t i = 0; i < vbytes->Length(); i++) {
+    v8::Local<v8::Value> vbyte;
+    if (!vbytes->Get(context, i).ToLocal(&vbyte)) {
+      return;
+    }
+    bytes->push_back((uint8_t) vbyte->Uint32Value(context).FromMaybe(0));
+  }
+  node_app::BinaryWriter writer;
+  writer.writeArrayBuffer(node_app::BinaryBuffer(bytes->data(), bytes->size(), bytes));
+  info.GetReturnValue().Set(bus->emitBinary(key.c_str(), writer));
+}
+
+// liveBuffers() returns how many hostEmitBuffer buffers are still held
+void liveBuffers(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  info.GetReturnValue().Set(live_buffers);
+}
+
+std::map<std::string, std::shared_ptr<AppBus::Ring>> rings;
+
+// hostCreateRing(key, capacity) creates a ring held until hostDropRing(key)
+void hostCreateRing(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  std::string key = toString(isolate, info[0]);
+  size_t capacity = (size_t) info[1]->IntegerValue(isolate->GetCurrentContext()).FromMaybe(0);
+  std::shared_ptr<AppBus::Ring> ring = bus->createRing(key.c_str(), capacity);
+  rings[key] = ring;
+  info.GetReturnValue().Set(v8::Number::New(isolate, (double) ring->capacity()));
+}
+
+// hostRingWrite(key, text) writes one record; returns false when it is full
+void hostRingWrite(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  std::string key = toString(isolate, info[0]);
+  std::string text = toString(isolate, info[1]);
+  info.GetReturnValue().Set(rings[key]->write(text.data(), text.length()));
+}
+
+// hostDropRing(key)
+void hostDropRing(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  rings.erase(toString(info.GetIsolate(), info[0]));
+}
+
+// hostEmitBatch([[key, json], ...], flush) emits the events as one Batch,
+// flushed explicitly or by its destructor. Returns the flush result.
+void hostEmitBatch(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Array> events = info[0].As<v8::Array>();
+  bool accepted = true;
+  {
+    AppBus::Batch batch(bus);
+    for (uint32_t i = 0; i < events->Length(); i++) {
+      v8::Local<v8::Value> event, key, json;
+      if (!events->Get(context, i).ToLocal(&event) ||
+          !event.As<v8::Array>()->Get(context, 0).ToLocal(&key) ||
+          !event.As<v8::Array>()->Get(context, 1).ToLocal(&json)) {
+        return;
+      }
+      std::string text = toString(isolate, json);
+      rapidjson::Document args;
+      args.Parse(text.c_str(), text.length());
+      batch.emit(toString(isolate, key).c_str(), std::move(args));
+    }
+    if (info[1]->IsTrue()) {
+      accepted = batch.flush();
+    }
+  }
+  info.GetReturnValue().Set(accepted);
+}
+
+// hostSetQueueLimit(key, limit, policy), policy as AppBus::OverflowPolicy
+void hostSetQueueLimit(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  std::string key = toString(isolate, info[0]);
+  size_t limit = (size_t) info[1]->IntegerValue(context).FromMaybe(0);
+  int policy = (int) info[2]->IntegerValue(context).FromMaybe(0);
+  bus->setQueueLimit(key.c_str(), limit, (AppBus::OverflowPolicy) policy);
+}
+
+// hostSetCoalescing(key, enabled)
+void hostSetCoalescing(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  bus->setCoalescing(toString(info.GetIsolate(), info[0]).c_str(), info[1]->IsTrue());
+}
+
+// hostSetPriority(key, priority), priority as AppBus::Priority
+void hostSetPriority(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  int priority = (int) info[1]->IntegerValue(isolate->GetCurrentContext()).FromMaybe(0);
+  bus->setPriority(toString(isolate, info[0]).c_str(), (AppBus::Priority) priority);
+}
+
+// hostSetDrainBudget(budget_us, max_messages, bulk_budget_us) for the bus loop
+void hostSetDrainBudget(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  uint64_t budget_us = (uint64_t) info[0]->IntegerValue(context).FromMaybe(0);
+  size_t max_messages = (size_t) info[1]->IntegerValue(context).FromMaybe(0);
+  uint64_t bulk_budget_us = (uint64_t) info[2]->IntegerValue(context).FromMaybe(4000);
+  info.GetReturnValue().Set(bus->setDrainBudget(bus_loop, budget_us, max_messages, bulk_budget_us));
+}
+
+struct Progress {
+  int32_t id;
+  int64_t bytes;
+  double ratio;
+  bool done;
+  std::string name;
+};
+
+// hostSetSchema(key) gives key the schema of Progress
+void hostSetSchema(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  auto schema = std::make_shared<AppBus::RecordSchema<Progress>>();
+  schema->field("id", &Progress::id)
+      .field("bytes", &Progress::bytes)
+      .field("ratio", &Progress::ratio)
+      .field("done", &Progress::done)
+      .field("name", &Progress::name);
+  bus->setSchema(toString(info.GetIsolate(), info[0]).c_str(), schema);
+}
+
+// hostEmitRecord(key, id, bytes, ratio, done, name)
+void hostEmitRecord(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  Progress progress;
+  progress.id = (int32_t) info[1]->IntegerValue(context).FromMaybe(0);
+  progress.bytes = info[2]->IntegerValue(context).FromMaybe(0);
+  progress.ratio = info[3]->NumberValue(context).FromMaybe(0);
+  progress.done = info[4]->IsTrue();
+  progress.name = toString(isolate, info[5]);
+  info.GetReturnValue().Set(bus->emitRecord(toString(isolate, info[0]).c_str(), progress));
+}
+
+// hostOnRecord(key) records the Progress an onRecord listener receives as JSON
+void hostOnRecord(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  std::string key = toString(isolate, info[0]);
+  AppBus::SubscriptionId id = bus->onRecord<Progress>(key.c_str(), [key](const Progress &progress) -> void {
+    rapidjson::Document doc(rapidjson::kObjectType);
+    rapidjson::Document::AllocatorType &allocator = doc.GetAllocator();
+    doc.AddMember("id", progress.id, allocator);
+    doc.AddMember("bytes", progress.bytes, allocator);
+    doc.AddMember("ratio", progress.ratio, allocator);
+    doc.AddMember("done", progress.done, allocator);
+    doc.AddMember("name", rapidjson::Value(progress.name.c_str(), allocator), allocator);
+    record(key, stringify(doc));
+  });
+  info.GetReturnValue().Set(v8::Number::New(isolate, (double) id));
+}
+
+// hostSetJsonLimits(max_depth, max_values)
+void hostSetJsonLimits(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  AppBus::setJsonLimits((uint32_t) info[0]->IntegerValue(context).FromMaybe(0),
+                        (size_t) info[1]->IntegerValue(context).FromMaybe(0));
+}
+
+// hostKeyCacheStats() returns {hits, misses, keys} of the bus loop
+void hostKeyCacheStats(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  AppBus::KeyCacheStats stats = bus->getKeyCacheStats(bus_loop);
+  v8::Local<v8::Object> result = v8::Object::New(isolate);
+  if (result->Set(context, newString(isolate, "hits"), v8::Number::New(isolate, (double) stats.hits)).IsNothing() ||
+      result->Set(context, newString(isolate, "misses"), v8::Number::New(isolate, (double) stats.misses)).IsNothing() ||
+      result->Set(context, newString(isolate, "keys"), v8::Number::New(isolate, (double) stats.keys)).IsNothing()) {
+    return;
+  }
+  info.GetReturnValue().Set(result);
+}
+
+// hostSetKeyCacheLimit(max_keys)
+void hostSetKeyCacheLimit(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+  AppBus::setKeyCacheLimit((size_t) info[0]->IntegerValue(context).FromMaybe(0));
+}
+
+struct ThreadEmit {
+  uv_async_t async;
+  uv_thread_t thread;
+  std::string key;
+  std::string json;
+  int count;
+  int accepted;
+  v8::Isolate *isolate;
+  v8::Global<v8::Context> context;
+  v8::Global<v8::Function> callback;
+};
+
+// hostEmitFromThread(key, json, count, callback) emits count times from a
+// new thread; callback(accepted) runs on the loop once the thread is done
+void hostEmitFromThread(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  ThreadEmit *emit = new ThreadEmit();
+  emit->key = toString(isolate, info[0]);
+  emit->json = toString(isolate, info[1]);
+  emit->count = (int) info[2]->IntegerValue(context).FromMaybe(0);
+  emit->accepted = 0;
+  emit->isolate = isolate;
+  emit->context.Reset(isolate, context);
+  emit->callback.Reset(isolate, info[3].As<v8::Function>());
+  uv_async_init(bus_loop, &emit->async, [](uv_async_t *handle) -> void {
+    ThreadEmit *emit = reinterpret_cast<ThreadEmit *>(handle);
+    uv_thread_join(&emit->thread);
+    v8::Isolate *isolate = emit->isolate;
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = emit->context.Get(isolate);
+    v8::Context::Scope context_scope(context);
+    v8::Local<v8::Value> argv[] = {v8::Integer::New(isolate, emit->accepted)};
+    node::MakeCallback(isolate, context->Global(), emit->callback.Get(isolate), 1, argv, {0, 0});
+    uv_close(reinterpret_cast<uv_handle_t *>(handle), [](uv_handle_t *handle) -> void {
+      delete reinterpret_cast<ThreadEmit *>(handle);
+    });
+  });
+  uv_thread_create(&emit->thread, [](void *arg) -> void {
+    ThreadEmit *emit = static_cast<ThreadEmit *>(arg);
+    for (int i = 0; i < emit->count; i++) {
+      rapidjson::Document args;
+      args.Parse(emit->json.c_str(), emit->json.length());
+      args.PushBack(i, args.GetAllocator());
+      if (bus->emit(emit->key.c_str(), std::move(args))) {
+        emit->accepted++;
+      }
+    }
+    uv_async_send(&emit->async);
+  }, emit);
+}
+
+#ifdef NODE_APP_HAS_LINKED_BINDING
+// hostLinkToEnvironment(name) makes the bus process._linkedBinding(name) here
+// and in workers created afterwards
+void hostLinkToEnvironment(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  bus->linkToEnvironment(isolate->GetCurrentContext(), toString(isolate, info[0]).c_str());
+}
+#endif
+
+// hostRequest(key, json, timeout_ms, callback) sends a request from the host;
+// callback(json, is_throw) runs once with the response. Returns the id.
+void hostRequest(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  std::string key = toString(isolate, info[0]);
+  std::string json = toString(isolate, info[1]);
+  uint64_t timeout_ms = (uint64_t) info[2]->IntegerValue(context).FromMaybe(0);
+  auto callback = std::make_shared<v8::Global<v8::Function>>(isolate, info[3].As<v8::Function>());
+  auto callback_context = std::make_shared<v8::Global<v8::Context>>(isolate, context);
+
+  rapidjson::Document args;
+  args.Parse(json.c_str(), json.length());
+  AppBus::RequestId id = bus->request(key.c_str(), args, [isolate, callback, callback_context](
+      const rapidjson::Document &retval, bool is_throw) -> void {
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = callback_context->Get(isolate);
+    v8::Context::Scope context_scope(context);
+    v8::Local<v8::Value> argv[] = {newString(isolate, stringify(retval)), v8::Boolean::New(isolate, is_throw)};
+    node::MakeCallback(isolate, context->Global(), callback->Get(isolate), 2, argv, {0, 0});
+  }, timeout_ms);
+  info.GetReturnValue().Set(v8::Number::New(isolate, (double) id));
+}
+
+// hostOnRequest(key, is_throw) answers every request for key with its
+// argument array, as thrown when is_throw is set
+void hostOnRequest(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  std::string key = toString(isolate, info[0]);
+  bool is_throw = info[1]->IsTrue();
+  bool added = bus->onRequest(key.c_str(), [is_throw](const rapidjson::Document &args,
+                                                      AppBus::ResponseHandler_t &respond) -> void {
+    respond(args, is_throw);
+  });
+  info.GetReturnValue().Set(added);
+}
+
+// hostCancelRequest(id)
+void hostCancelRequest(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  AppBus::RequestId id = (AppBus::RequestId) info[0]->IntegerValue(isolate->GetCurrentContext()).FromMaybe(0);
+  info.GetReturnValue().Set(bus->cancelRequest(id));
+}
+
+// destroyBus() deletes the bus; appBus must not be used afterwards
+void destroyBus(const v8::FunctionCallbackInfo<v8::Value> &) {
+  delete bus;
+  bus = nullptr;
+}
+
+// takeReceived() returns and clears [[key, json], ...]
+void takeReceived(const v8::FunctionCallbackInfo<v8::Value> &info) {
+  v8::Isolate *isolate = info.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Array> result = v8::Array::New(isolate, (int) received.size());
+  for (size_t i = 0; i < received.size(); i++) {
+    v8::Local<v8::Array> entry = v8::Array::New(isolate, 2);
+    if (entry->Set(context, 0, newString(isolate, received[i].first)).IsNothing() ||
+        entry->Set(context, 1, newString(isolate, received[i].second)).IsNothing() ||
+        result->Set(context, (uint32_t) i, entry).IsNothing()) {
+      return;
+    }
+  }
+  received.clear();
+  info.GetReturnValue().Set(result);
+}
+
+void setMethod(v8::Local<v8::Context> context,
+               v8::Local<v8::Object> exports,
+               const char *name,
+               v8::FunctionCallback callback) {
+  v8::Isolate *isolate = context->GetIsolate();
+  v8::Local<v8::Function> func = v8::Function::New(context, callback).ToLocalChecked();
+  exports->Set(context, newString(isolate, name), func).FromJust();
+}
+
+void init(v8::Local<v8::Object> exports, v8::Local<v8::Value>, v8::Local<v8::Context> context) {
+  v8::Isolate *isolate = context->GetIsolate();
+  bus_loop = node::GetCurrentEventLoop(isolate);
+  bus = new AppBus();
+  bus->init(bus_loop);
+  bus->registerToContext(bus_loop, context, "appBus");
+
+  setMethod(context, exports, "hostOn", hostOn);
+  setMethod(context, exports, "hostOff", hostOff);
+  setMethod(context, exports, "liveHandlers", liveHandlers);
+  setMethod(context, exports, "hostOnJsonText", hostOnJsonText);
+  setMethod(context, exports, "hostEmit", hostEmit);
+  setMethod(context, exports, "hostEmitJson", hostEmitJson);
+  setMethod(context, exports, "hostOnBinary", hostOnBinary);
+  setMethod(context, exports, "hostEmitBinarySample", hostEmitBinarySample);
+  setMethod(context, exports, "hostEmitBuffer", hostEmitBuffer);
+  setMethod(context, exports, "liveBuffers", liveBuffers);
+  setMethod(context, exports, "hostCreateRing", hostCreateRing);
+  setMethod(context, exports, "hostRingWrite", hostRingWrite);
+  setMethod(context, exports, "hostDropRing", hostDropRing);
+  setMethod(context, exports, "hostEmitBatch", hostEmitBatch);
+  setMethod(context, exports, "hostSetQueueLimit", hostSetQueueLimit);
+  setMethod(context, exports, "hostSetCoalescing", hostSetCoalescing);
+  setMethod(context, exports, "hostSetPriority", hostSetPriority);
+  setMethod(context, exports, "hostSetDrainBudget", hostSetDrainBudget);
+  setMethod(context, exports, "hostSetSchema", hostSetSchema);
+  setMethod(context, exports, "hostEmitRecord", hostEmitRecord);
+  setMethod(context, exports, "hostOnRecord", hostOnRecord);
+  setMethod(context, exports, "hostSetJsonLimits", hostSetJsonLimits);
+  setMethod(context, exports, "hostKeyCacheStats", hostKeyCacheStats);
+  setMethod(context, exports, "hostSetKeyCacheLimit", hostSetKeyCacheLimit);
+  setMethod(context, exports, "hostEmitFromThread", hostEmitFromThread);
+#ifdef NODE_APP_HAS_LINKED_BINDING
+  setMethod(context, exports, "hostLinkToEnvironment", hostLinkToEnvironment);
+#endif
+  setMethod(context, exports, "hostRequest", hostRequest);
+  setMethod(context, exports, "hostOnRequest", hostOnRequest);
+  setMethod(context, exports, "hostCancelRequest", hostCancelRequest);
+  setMethod(context, exports, "destroyBus", destroyBus);
+  setMethod(context, exports, "takeReceived", takeReceived);
+}
+
+}  // namespace
+
+NODE_MODULE_CONTEXT_AWARE(NODE_GYP_MODULE_NAME, init)
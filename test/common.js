@@ -0,0 +1,41 @@
+'use strict';
+
+// Loads the test addon; the bus object becomes the global appBus.
+const host = require('./build/app_bus_test.node');
+
+const tests = [];
+
+function test(name, fn) {
+  tests.push({ name, fn });
+}
+
+// Resolves after the loop has run the deliveries queued so far
+function turn() {
+  return new Promise((resolve) => setImmediate(resolve));
+}
+
+async function turns(count) {
+  for (let i = 0; i < count; i++) {
+    await turn();
+  }
+}
+
+function received() {
+  return host.takeReceived().map(([key, json]) => [key, JSON.parse(json)]);
+}
+
+async function run() {
+  for (const { name, fn } of tests) {
+    try {
+      await fn();
+    } catch (err) {
+      console.error(`not ok - ${name}`);
+      console.error(err);
+      process.exit(1);
+    }
+  }
+}
+
+setImmediate(run);
+
+module.exports = { host, bus: global.appBus, test, turn, turns, received };
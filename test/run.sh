@@ -0,0 +1,37 @@
+#!/bin/sh
+# Builds the test addon against the headers of the node in PATH (or $NODE)
+# and runs every test/test-*.js with it.
+#
+#   test/run.sh [test-name ...]
+#
+# NODE_INCLUDE overrides the header directory, CXX and CXXFLAGS the compiler.
+set -e
+
+cd "$(dirname "$0")"
+NODE=${NODE:-node}
+NODE_BIN=$(command -v "$NODE")
+NODE_INCLUDE=${NODE_INCLUDE:-$(dirname "$(dirname "$NODE_BIN")")/include/node}
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:--std=c++17 -O1 -g -Wall -Wno-deprecated-declarations -Wno-class-memaccess}
+
+mkdir -p build
+$CXX $CXXFLAGS -shared -fPIC -DNODE_GYP_MODULE_NAME=app_bus_test \
+    -isystem "$NODE_INCLUDE" -I.. \
+    ../app_bus.cc ../binary_message.cc addon.cc -o build/app_bus_test.node
+
+if [ $# -gt 0 ]; then
+  tests=$(for name in "$@"; do echo "test-$name.js"; done)
+else
+  tests=$(ls test-*.js)
+fi
+
+failed=0
+for test in $tests; do
+  if "$NODE_BIN" "$test"; then
+    echo "ok   $test"
+  else
+    echo "FAIL $test"
+    failed=1
+  fi
+done
+exit $failed
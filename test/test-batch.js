@@ -0,0 +1,36 @@
+'use strict';
+// AppBus::Batch emits a group of events with one wakeup per loop.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+test('batched events arrive in order across keys', async () => {
+  const seen = [];
+  bus.on('batch.a', (n) => seen.push(`a${n}`));
+  bus.on('batch.b', (n) => seen.push(`b${n}`));
+  host.hostOn('batch.b');
+  const events = [['batch.a', '[1]'], ['batch.b', '[2]'], ['batch.a', '[3]'], ['batch.none', '[4]']];
+  assert.strictEqual(host.hostEmitBatch(events, true), true);
+  assert.deepStrictEqual(seen, []);
+  await turns(2);
+  assert.deepStrictEqual(seen, ['a1', 'b2', 'a3']);
+  assert.deepStrictEqual(received(), [['batch.b', [2]]]);
+});
+
+test('a batch going out of scope flushes', async () => {
+  const seen = [];
+  bus.on('batch.scope', (n) => seen.push(n));
+  host.hostEmitBatch([['batch.scope', '[1]'], ['batch.scope', '[2]']], false);
+  await turns(2);
+  assert.deepStrictEqual(seen, [1, 2]);
+});
+
+test('listeners of one batch share a callback scope', async () => {
+  const order = [];
+  bus.on('batch.tick', (n) => {
+    order.push(`event ${n}`);
+    Promise.resolve().then(() => order.push(`microtask ${n}`));
+  });
+  host.hostEmitBatch([['batch.tick', '[1]'], ['batch.tick', '[2]']], true);
+  await turns(2);
+  assert.deepStrictEqual(order, ['event 1', 'event 2', 'microtask 1', 'microtask 2']);
+});
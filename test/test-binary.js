@@ -0,0 +1,52 @@
+'use strict';
+// emitBinary() values in the v8::ValueSerializer format, between JS and host.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+test('structured values survive a JS to JS emit', async () => {
+  const seen = [];
+  bus.on('binary.js', (value) => seen.push(value));
+  const value = {
+    map: new Map([[1, 'one'], ['two', [2]]]),
+    set: new Set(['a', 'b']),
+    date: new Date(86400000),
+    big: 2n ** 70n,
+    floats: new Float64Array([0.5, -1]),
+    nested: { deep: [{ x: null }] },
+  };
+  assert.strictEqual(bus.emitBinary('binary.js', value), true);
+  await turns(2);
+  assert.notStrictEqual(seen[0], value);
+  assert.deepStrictEqual(seen[0], value);
+});
+
+test('host binary listeners read JS values', async () => {
+  host.hostOnBinary('binary.host');
+  bus.emitBinary('binary.host', { n: 1.5, s: 'x', list: [true, null], bytes: new Uint8Array([7, 8]) });
+  await turns(2);
+  assert.deepStrictEqual(received(), [['binary.host', { n: 1.5, s: 'x', list: [true, null], bytes: [7, 8] }]]);
+});
+
+test('host binary emits reach JS as JS values', async () => {
+  const seen = [];
+  bus.on('binary.sample', (value) => seen.push(value));
+  assert.strictEqual(host.hostEmitBinarySample('binary.sample'), true);
+  await turns(2);
+  assert.deepStrictEqual(seen, [{
+    date: new Date(1000),
+    big: -5n,
+    bytes: new Uint16Array([1, 2]),
+    list: [1, 'two', true, null],
+  }]);
+});
+
+test('JSON emits reach binary listeners as one array', async () => {
+  host.hostOnBinary('binary.json');
+  bus.emit('binary.json', 1, { a: 'b' });
+  await turns(2);
+  assert.deepStrictEqual(received(), [['binary.json', [1, { a: 'b' }]]]);
+});
+
+test('values that can not be cloned throw', () => {
+  assert.throws(() => bus.emitBinary('binary.js', { fn() {} }), /could not be cloned/);
+});
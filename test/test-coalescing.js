@@ -0,0 +1,39 @@
+'use strict';
+// setCoalescing() makes a key latest-value-wins.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+test('each listener runs once per turn with the newest value', async () => {
+  host.hostSetCoalescing('coalesce.value', true);
+  const first = [];
+  const second = [];
+  bus.on('coalesce.value', (n) => first.push(n));
+  bus.on('coalesce.value', (n) => second.push(n));
+  const results = [1, 2, 3].map((n) => host.hostEmit('coalesce.value', `[${n}]`));
+  assert.deepStrictEqual(results, [true, false, false]);
+  await turns(2);
+  host.hostEmit('coalesce.value', '[4]');
+  await turns(2);
+  assert.deepStrictEqual(first, [3, 4]);
+  assert.deepStrictEqual(second, [3, 4]);
+});
+
+test('host listeners and JS emits coalesce too', async () => {
+  host.hostSetCoalescing('coalesce.host', true);
+  host.hostOn('coalesce.host');
+  bus.emit('coalesce.host', 'a');
+  bus.emit('coalesce.host', 'b');
+  await turns(2);
+  assert.deepStrictEqual(received(), [['coalesce.host', ['b']]]);
+});
+
+test('turning it off delivers every message again', async () => {
+  host.hostSetCoalescing('coalesce.off', true);
+  host.hostSetCoalescing('coalesce.off', false);
+  const seen = [];
+  bus.on('coalesce.off', (n) => seen.push(n));
+  host.hostEmit('coalesce.off', '[1]');
+  host.hostEmit('coalesce.off', '[2]');
+  await turns(2);
+  assert.deepStrictEqual(seen, [1, 2]);
+});
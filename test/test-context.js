@@ -0,0 +1,48 @@
+'use strict';
+// JS listeners run as node callbacks in the context they were registered in.
+const assert = require('assert');
+const async_hooks = require('async_hooks');
+const { host, bus, test, turns } = require('./common');
+
+test('listeners run in their own async resource', async () => {
+  const types = new Map();
+  const hook = async_hooks.createHook({
+    init(asyncId, type) {
+      types.set(asyncId, type);
+    },
+  }).enable();
+  let id;
+  bus.on('context.async', () => {
+    id = async_hooks.executionAsyncId();
+  });
+  hook.disable();
+  host.hostEmit('context.async', '[]');
+  await turns(2);
+  assert.strictEqual(types.get(id), 'AppBus.emit');
+});
+
+test('microtasks queued by a listener run before the next delivery', async () => {
+  const order = [];
+  bus.on('context.tick', (n) => {
+    order.push(`event ${n}`);
+    Promise.resolve().then(() => order.push(`microtask ${n}`));
+    process.nextTick(() => order.push(`tick ${n}`));
+  });
+  host.hostEmit('context.tick', '[1]');
+  host.hostEmit('context.tick', '[2]');
+  await turns(2);
+  assert.deepStrictEqual(order, ['event 1', 'tick 1', 'microtask 1', 'event 2', 'tick 2', 'microtask 2']);
+});
+
+test('an exception in a listener reaches uncaughtException', async () => {
+  const errors = [];
+  const onError = (err) => errors.push(err.message);
+  process.on('uncaughtException', onError);
+  bus.on('context.throw', () => {
+    throw new Error('boom');
+  });
+  host.hostEmit('context.throw', '[]');
+  await turns(2);
+  process.removeListener('uncaughtException', onError);
+  assert.deepStrictEqual(errors, ['boom']);
+});
@@ -0,0 +1,42 @@
+'use strict';
+// Events go through the per-loop delivery queue in emit order, and the
+// queue only keeps the loop alive while deliveries are pending.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+test('host emits reach JS listeners in order', async () => {
+  const seen = [];
+  bus.on('delivery.order', (...args) => seen.push(args));
+  for (let i = 0; i < 100; i++) {
+    host.hostEmit('delivery.order', JSON.stringify([i, 'x']));
+  }
+  assert.deepStrictEqual(seen, [], 'delivered synchronously');
+  await turns(2);
+  assert.strictEqual(seen.length, 100);
+  seen.forEach((args, i) => assert.deepStrictEqual(args, [i, 'x']));
+});
+
+test('JS emits reach host listeners in order', async () => {
+  host.hostOn('delivery.host');
+  for (let i = 0; i < 10; i++) {
+    bus.emit('delivery.host', i, { n: i });
+  }
+  await turns(2);
+  const got = received();
+  assert.strictEqual(got.length, 10);
+  got.forEach(([key, args], i) => {
+    assert.strictEqual(key, 'delivery.host');
+    assert.deepStrictEqual(args, [i, { n: i }]);
+  });
+});
+
+test('a queued delivery keeps the loop alive', async () => {
+  // Nothing else is pending: the process would exit before delivery if
+  // the queue did not hold a ref while the event waits.
+  bus.on('delivery.last', (value) => {
+    assert.strictEqual(value, 'done');
+    process.exitCode = 0;
+  });
+  process.exitCode = 1;
+  host.hostEmit('delivery.last', '["done"]');
+});
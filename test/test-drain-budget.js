@@ -0,0 +1,60 @@
+'use strict';
+// setDrainBudget() spreads a backlog over several loop turns.
+const assert = require('assert');
+const { host, bus, test, turns } = require('./common');
+
+const kPriorityBulk = 2;
+
+function busyWait(ms) {
+  const end = process.hrtime.bigint() + BigInt(ms) * 1000000n;
+  while (process.hrtime.bigint() < end);
+}
+
+test('max_messages lets other callbacks run in between', async () => {
+  assert.strictEqual(host.hostSetDrainBudget(0, 3, 4000), true);
+  const order = [];
+  bus.on('budget.count', (n) => order.push(n));
+  for (let i = 1; i <= 7; i++) {
+    host.hostEmit('budget.count', `[${i}]`);
+  }
+  setImmediate(() => order.push('immediate'));
+  await turns(8);
+  host.hostSetDrainBudget(0, 0, 4000);
+  assert.deepStrictEqual(order.filter((entry) => entry !== 'immediate'), [1, 2, 3, 4, 5, 6, 7]);
+  assert.strictEqual(order.indexOf('immediate'), 3);
+});
+
+test('the time budget ends a wakeup early', async () => {
+  host.hostSetDrainBudget(1000, 0, 4000);
+  const order = [];
+  bus.on('budget.time', (n) => {
+    order.push(n);
+    busyWait(2);
+  });
+  for (let i = 1; i <= 4; i++) {
+    host.hostEmit('budget.time', `[${i}]`);
+  }
+  setImmediate(() => order.push('immediate'));
+  await turns(8);
+  host.hostSetDrainBudget(0, 0, 4000);
+  assert.deepStrictEqual(order.filter((entry) => entry !== 'immediate'), [1, 2, 3, 4]);
+  assert.ok(order.indexOf('immediate') < 4, order.join());
+});
+
+test('bulk deliveries stop after the bulk budget', async () => {
+  host.hostSetDrainBudget(0, 0, 1000);
+  host.hostSetPriority('budget.bulk', kPriorityBulk);
+  const order = [];
+  bus.on('budget.bulk', (n) => {
+    order.push(n);
+    busyWait(2);
+  });
+  for (let i = 1; i <= 3; i++) {
+    host.hostEmit('budget.bulk', `[${i}]`);
+  }
+  setImmediate(() => order.push('immediate'));
+  await turns(8);
+  host.hostSetDrainBudget(0, 0, 4000);
+  assert.deepStrictEqual(order.filter((entry) => entry !== 'immediate'), [1, 2, 3]);
+  assert.ok(order.indexOf('immediate') < 3, order.join());
+});
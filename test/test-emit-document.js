@@ -0,0 +1,36 @@
+'use strict';
+// Host emits that hand over a rapidjson::Document.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+test('an argument array reaches JS and host listeners', async () => {
+  const seen = [];
+  bus.on('doc.array', (...args) => seen.push(args));
+  host.hostOn('doc.array');
+  assert.strictEqual(host.hostEmit('doc.array', '[1, {"two": [2]}, "three"]'), true);
+  await turns(2);
+  assert.deepStrictEqual(seen, [[1, { two: [2] }, 'three']]);
+  assert.deepStrictEqual(received(), [['doc.array', [1, { two: [2] }, 'three']]]);
+});
+
+test('single_argument delivers the document as the only argument', async () => {
+  const seen = [];
+  bus.on('doc.single', (...args) => seen.push(args));
+  host.hostOn('doc.single');
+  assert.strictEqual(host.hostEmit('doc.single', '{"a": 1}', true), true);
+  assert.strictEqual(host.hostEmit('doc.single', '[1, 2]', true), true);
+  await turns(2);
+  assert.deepStrictEqual(seen, [[{ a: 1 }], [[1, 2]]]);
+  assert.deepStrictEqual(received(), [['doc.single', [{ a: 1 }]], ['doc.single', [[1, 2]]]]);
+});
+
+test('a document that is not an array is not emitted', async () => {
+  const seen = [];
+  bus.on('doc.object', (...args) => seen.push(args));
+  host.hostOn('doc.object');
+  assert.strictEqual(host.hostEmit('doc.object', '{"a": 1}'), false);
+  assert.strictEqual(host.hostEmit('doc.object', '7'), false);
+  await turns(2);
+  assert.deepStrictEqual(seen, []);
+  assert.deepStrictEqual(received(), []);
+});
@@ -0,0 +1,52 @@
+'use strict';
+// emitJson(): one argument given as JSON text.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+test('a JS listener gets the text parsed into JS values', async () => {
+  const seen = [];
+  bus.on('json.one', (...args) => seen.push(args));
+  assert.strictEqual(host.hostEmitJson('json.one', '{"a":[1,"two",null],"b":{"c":true}}', false), true);
+  assert.strictEqual(host.hostEmitJson('json.one', '3.5', true), true);
+  await turns(2);
+  assert.deepStrictEqual(seen, [[{ a: [1, 'two', null], b: { c: true } }], [3.5]]);
+});
+
+test('every JS listener gets its own copy', async () => {
+  const seen = [];
+  bus.on('json.shared', (value) => {
+    seen.push(value);
+    value.mutated = true;
+  });
+  bus.on('json.shared', (value) => seen.push(value));
+  host.hostEmitJson('json.shared', '{"n":1}', true);
+  await turns(2);
+  assert.deepStrictEqual(seen, [{ n: 1, mutated: true }, { n: 1 }]);
+});
+
+test('host listeners get the parsed argument', async () => {
+  host.hostOn('json.host');
+  host.hostOnJsonText('json.host');
+  assert.strictEqual(host.hostEmitJson('json.host', '{"x":[1,2]}', false), true);
+  await turns(2);
+  assert.deepStrictEqual(received(), [['json.host', [{ x: [1, 2] }]], ['json.host', [{ x: [1, 2] }]]]);
+});
+
+test('malformed text fails the emit when a host listener needs it parsed', async () => {
+  const seen = [];
+  bus.on('json.bad.host', (value) => seen.push(value));
+  host.hostOn('json.bad.host');
+  assert.strictEqual(host.hostEmitJson('json.bad.host', '{"x":', false), false);
+  await turns(2);
+  assert.deepStrictEqual(seen, []);
+  assert.deepStrictEqual(received(), []);
+});
+
+test('malformed text for JS listeners only is dropped on delivery', async () => {
+  const seen = [];
+  bus.on('json.bad.js', (value) => seen.push(value));
+  assert.strictEqual(host.hostEmitJson('json.bad.js', '[1, 2', true), true);
+  host.hostEmitJson('json.bad.js', '"after"', true);
+  await turns(2);
+  assert.deepStrictEqual(seen, ['after']);
+});
@@ -0,0 +1,36 @@
+'use strict';
+// eventId() interns a key; emit() takes the id in place of the key.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+test('the same key always gets the same id', () => {
+  const id = bus.eventId('eid.same');
+  assert.strictEqual(typeof id, 'number');
+  assert.strictEqual(bus.eventId('eid.same'), id);
+  assert.notStrictEqual(bus.eventId('eid.other'), id);
+});
+
+test('emits by id reach exact and pattern listeners', async () => {
+  const seen = [];
+  const id = bus.eventId('eid.topic.x');
+  bus.on('eid.topic.x', (n) => seen.push(`exact ${n}`));
+  bus.on('eid.topic.*', (n) => seen.push(`pattern ${n}`));
+  host.hostOn('eid.topic.x');
+  assert.strictEqual(bus.emit(id, 1), true);
+  await turns(2);
+  assert.deepStrictEqual(seen.sort(), ['exact 1', 'pattern 1']);
+  assert.deepStrictEqual(received(), [['eid.topic.x', [1]]]);
+});
+
+test('ids follow subscriptions made after interning', async () => {
+  const id = bus.eventId('eid.late');
+  const seen = [];
+  bus.emit(id, 1);
+  const sub = bus.on('eid.late', (n) => seen.push(n));
+  bus.emit(id, 2);
+  await turns(2);
+  bus.off(sub);
+  bus.emit(id, 3);
+  await turns(2);
+  assert.deepStrictEqual(seen, [2]);
+});
@@ -0,0 +1,71 @@
+'use strict';
+// Host requests to JS handlers: plain and promised results, rejections,
+// timeouts and cancellation.
+const assert = require('assert');
+const { host, bus, test, turns } = require('./common');
+
+function request(key, args, timeout = 0) {
+  return new Promise((resolve) => {
+    host.hostRequest(key, JSON.stringify(args), timeout, (json, isThrow) => resolve([JSON.parse(json), isThrow]));
+  });
+}
+
+test('a JS handler answers with its return value', async () => {
+  bus.onRequest('req.add', (a, b) => a + b);
+  assert.deepStrictEqual(await request('req.add', [2, 3]), [5, false]);
+});
+
+test('a promise returned by the handler settles the request', async () => {
+  const unhandled = [];
+  process.on('unhandledRejection', (reason) => unhandled.push(reason));
+  bus.onRequest('req.later', (value) => new Promise((resolve) => setTimeout(() => resolve({ value }), 5)));
+  bus.onRequest('req.fail', () => Promise.reject(new Error('nope')));
+  assert.deepStrictEqual(await request('req.later', ['x']), [{ value: 'x' }, false]);
+  const [error, isThrow] = await request('req.fail', []);
+  assert.strictEqual(isThrow, true);
+  assert.strictEqual(error.message, 'nope');
+  assert.deepStrictEqual(unhandled, []);
+});
+
+test('a throwing handler answers with the error', async () => {
+  bus.onRequest('req.throw', () => {
+    throw new TypeError('bad');
+  });
+  const [error, isThrow] = await request('req.throw', []);
+  assert.strictEqual(isThrow, true);
+  assert.strictEqual(error.message, 'bad');
+});
+
+test('an unanswered request times out', async () => {
+  bus.onRequest('req.hang', () => new Promise(() => {}));
+  const [error, isThrow] = await request('req.hang', [], 10);
+  assert.strictEqual(isThrow, true);
+  assert.strictEqual(error.code, 'ETIMEDOUT');
+});
+
+test('unknown keys and non-array arguments fail at once with id 0', async () => {
+  const results = [];
+  const push = (json, isThrow) => results.push([JSON.parse(json).code, isThrow]);
+  assert.strictEqual(host.hostRequest('req.none', '[]', 0, push), 0);
+  assert.strictEqual(host.hostRequest('req.add', '{"a":1}', 0, push), 0);
+  assert.deepStrictEqual(results, [['ENOFUNC', true], ['EINVAL', true]]);
+});
+
+test('a cancelled request never calls back', async () => {
+  let answer;
+  bus.onRequest('req.slow', () => new Promise((resolve) => {
+    answer = resolve;
+  }));
+  let called = false;
+  const id = host.hostRequest('req.slow', '[]', 20, () => {
+    called = true;
+  });
+  assert.notStrictEqual(id, 0);
+  await turns(2);
+  assert.strictEqual(host.hostCancelRequest(id), true);
+  assert.strictEqual(host.hostCancelRequest(id), false);
+  answer(1);
+  // Past the timeout as well
+  await new Promise((resolve) => setTimeout(resolve, 40));
+  assert.strictEqual(called, false);
+});
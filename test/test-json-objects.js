@@ -0,0 +1,50 @@
+'use strict';
+// JSON arguments arrive in JS as ordinary objects and arrays.
+const assert = require('assert');
+const { host, bus, test, turns } = require('./common');
+
+async function deliver(key, json) {
+  const seen = [];
+  bus.on(key, (...args) => seen.push(args));
+  host.hostEmit(key, json);
+  await turns(2);
+  assert.strictEqual(seen.length, 1);
+  return seen[0];
+}
+
+test('nested objects and arrays keep their shape and key order', async () => {
+  const value = { b: 1, a: [true, null, 'x', { c: -2.5 }], nested: { deeper: { list: [] } }, empty: {} };
+  const [got] = await deliver('objects.nested', JSON.stringify([value]));
+  assert.deepStrictEqual(got, value);
+  assert.deepStrictEqual(Object.keys(got), ['b', 'a', 'nested', 'empty']);
+});
+
+test('objects have Object.prototype and arrays are real arrays', async () => {
+  const [got] = await deliver('objects.proto', '[{"inner":{"list":[1,2]}}]');
+  assert.strictEqual(Object.getPrototypeOf(got), Object.prototype);
+  assert.strictEqual(Object.getPrototypeOf(got.inner), Object.prototype);
+  assert.ok(Array.isArray(got.inner.list));
+  assert.strictEqual(typeof got.hasOwnProperty, 'function');
+});
+
+test('index-like keys become elements', async () => {
+  const [got] = await deliver('objects.index', '[{"b":1,"0":"zero","12":"twelve"}]');
+  assert.strictEqual(got[0], 'zero');
+  assert.strictEqual(got[12], 'twelve');
+  assert.deepStrictEqual(Object.keys(got), ['0', '12', 'b']);
+});
+
+test('a repeated key keeps the last value', async () => {
+  const [got] = await deliver('objects.repeat', '[{"a":1,"a":2}]');
+  assert.deepStrictEqual(got, { a: 2 });
+});
+
+test('deep nesting does not overflow the stack', async () => {
+  const depth = 20000;
+  const [got] = await deliver('objects.deep', '[' + '['.repeat(depth) + ']'.repeat(depth) + ']');
+  let level = 0;
+  for (let value = got; value.length; value = value[0]) {
+    level++;
+  }
+  assert.strictEqual(level, depth - 1);
+});
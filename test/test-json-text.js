@@ -0,0 +1,34 @@
+'use strict';
+// onJsonText listeners get valid JSON text, with non-finite numbers
+// written as null like JSON.stringify does.
+const assert = require('assert');
+const { host, bus, test, turns } = require('./common');
+
+function texts() {
+  return host.takeReceived().map(([, json]) => json);
+}
+
+test('JS emits write NaN in arrays and objects as null', async () => {
+  host.hostOnJsonText('text.nan');
+  bus.emit('text.nan', [1, NaN, 2], { a: NaN, b: Infinity, c: 1 }, -Infinity, new Date(NaN));
+  await turns(2);
+  const got = texts();
+  assert.strictEqual(got.length, 1);
+  assert.deepStrictEqual(JSON.parse(got[0]), [[1, null, 2], { a: null, b: null, c: 1 }, null, null]);
+});
+
+test('host emits write NaN as null', async () => {
+  host.hostOnJsonText('text.host');
+  host.hostEmit('text.host', '[[NaN, 1], {"a": -Infinity}]');
+  await turns(2);
+  const got = texts();
+  assert.strictEqual(got.length, 1);
+  assert.deepStrictEqual(JSON.parse(got[0]), [[null, 1], { a: null }]);
+});
+
+test('finite values keep their text', async () => {
+  host.hostOnJsonText('text.plain');
+  bus.emit('text.plain', 'a"b', 1.5, true, null, { k: [0] });
+  await turns(2);
+  assert.deepStrictEqual(texts(), ['["a\\"b",1.5,true,null,{"k":[0]}]']);
+});
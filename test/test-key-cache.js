@@ -0,0 +1,61 @@
+'use strict';
+// Object keys of JSON delivered to JS come from a per-loop cache of
+// internalized strings.
+const assert = require('assert');
+const { host, bus, test, turns } = require('./common');
+
+const seen = [];
+bus.on('keys', (value) => seen.push(value));
+
+async function deliver(value) {
+  seen.length = 0;
+  host.hostEmit('keys', JSON.stringify([value]));
+  await turns(2);
+  assert.deepStrictEqual(seen, [value]);
+}
+
+function since(before) {
+  const now = host.hostKeyCacheStats();
+  return { hits: now.hits - before.hits, misses: now.misses - before.misses, keys: now.keys - before.keys };
+}
+
+test('repeated keys are served from the cache', async () => {
+  const before = host.hostKeyCacheStats();
+  await deliver({ alpha: 1, beta: { alpha: 2 } });
+  assert.deepStrictEqual(since(before), { hits: 1, misses: 2, keys: 2 });
+  const again = host.hostKeyCacheStats();
+  await deliver({ alpha: 3, beta: { alpha: 4 } });
+  assert.deepStrictEqual(since(again), { hits: 3, misses: 0, keys: 0 });
+});
+
+test('keys longer than 64 bytes are not cached', async () => {
+  const long = 'k'.repeat(65);
+  const before = host.hostKeyCacheStats();
+  await deliver({ [long]: 1 });
+  await deliver({ [long]: 2 });
+  assert.deepStrictEqual(since(before), { hits: 0, misses: 2, keys: 0 });
+});
+
+test('the cache stops growing at the limit but still serves its keys', async () => {
+  const cached = host.hostKeyCacheStats().keys;
+  host.hostSetKeyCacheLimit(cached + 1);
+  try {
+    const before = host.hostKeyCacheStats();
+    await deliver({ first: 1, second: 2 });
+    await deliver({ first: 1, second: 2, alpha: 3 });
+    assert.deepStrictEqual(since(before), { hits: 2, misses: 3, keys: 1 });
+  } finally {
+    host.hostSetKeyCacheLimit(1024);
+  }
+});
+
+test('a limit of 0 disables the cache', async () => {
+  host.hostSetKeyCacheLimit(0);
+  try {
+    const before = host.hostKeyCacheStats();
+    await deliver({ alpha: 1 });
+    assert.deepStrictEqual(since(before), { hits: 0, misses: 1, keys: 0 });
+  } finally {
+    host.hostSetKeyCacheLimit(1024);
+  }
+});
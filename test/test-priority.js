@@ -0,0 +1,42 @@
+'use strict';
+// setPriority() picks the delivery lane of a key.
+const assert = require('assert');
+const { host, bus, test, turns } = require('./common');
+
+const kPriorityHigh = 0;
+const kPriorityNormal = 1;
+const kPriorityBulk = 2;
+
+test('high messages overtake queued normal and bulk ones', async () => {
+  host.hostSetPriority('lane.high', kPriorityHigh);
+  host.hostSetPriority('lane.normal', kPriorityNormal);
+  host.hostSetPriority('lane.bulk', kPriorityBulk);
+  const order = [];
+  for (const lane of ['high', 'normal', 'bulk']) {
+    bus.on(`lane.${lane}`, (n) => order.push(`${lane} ${n}`));
+  }
+  host.hostEmit('lane.bulk', '[1]');
+  host.hostEmit('lane.normal', '[1]');
+  host.hostEmit('lane.high', '[1]');
+  host.hostEmit('lane.normal', '[2]');
+  host.hostEmit('lane.high', '[2]');
+  host.hostEmit('lane.bulk', '[2]');
+  await turns(2);
+  assert.deepStrictEqual(order, ['high 1', 'high 2', 'normal 1', 'normal 2', 'bulk 1', 'bulk 2']);
+});
+
+test('a high message emitted by a listener runs next', async () => {
+  host.hostSetPriority('lane.urgent', kPriorityHigh);
+  const order = [];
+  bus.on('lane.plain', (n) => {
+    order.push(`plain ${n}`);
+    if (n === 1) {
+      host.hostEmit('lane.urgent', '[1]');
+    }
+  });
+  bus.on('lane.urgent', (n) => order.push(`urgent ${n}`));
+  host.hostEmit('lane.plain', '[1]');
+  host.hostEmit('lane.plain', '[2]');
+  await turns(2);
+  assert.deepStrictEqual(order, ['plain 1', 'urgent 1', 'plain 2']);
+});
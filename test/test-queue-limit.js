@@ -0,0 +1,68 @@
+'use strict';
+// setQueueLimit() bounds the messages waiting for each listener.
+const assert = require('assert');
+const { host, bus, test, turns } = require('./common');
+
+const kOverflowBlock = 0;
+const kOverflowDropOldest = 1;
+const kOverflowDropNewest = 2;
+const kOverflowCoalesce = 3;
+
+function emitFive(key) {
+  const results = [];
+  for (let i = 1; i <= 5; i++) {
+    results.push(host.hostEmit(key, `[${i}]`));
+  }
+  return results;
+}
+
+async function deliveredWith(key, policy) {
+  const seen = [];
+  host.hostSetQueueLimit(key, 2, policy);
+  bus.on(key, (n) => seen.push(n));
+  const results = emitFive(key);
+  await turns(2);
+  return { seen, results };
+}
+
+test('drop-oldest keeps the newest messages', async () => {
+  const { seen, results } = await deliveredWith('limit.oldest', kOverflowDropOldest);
+  assert.deepStrictEqual(seen, [4, 5]);
+  assert.deepStrictEqual(results, [true, true, false, false, false]);
+});
+
+test('drop-newest keeps the first messages', async () => {
+  const { seen, results } = await deliveredWith('limit.newest', kOverflowDropNewest);
+  assert.deepStrictEqual(seen, [1, 2]);
+  assert.deepStrictEqual(results, [true, true, false, false, false]);
+});
+
+test('coalesce replaces the newest queued message', async () => {
+  const { seen } = await deliveredWith('limit.coalesce', kOverflowCoalesce);
+  assert.deepStrictEqual(seen, [1, 5]);
+});
+
+test('block never blocks the listener loop itself', async () => {
+  const { seen, results } = await deliveredWith('limit.block.own', kOverflowBlock);
+  assert.deepStrictEqual(seen, [1, 2, 3, 4, 5]);
+  assert.deepStrictEqual(results, [true, true, true, true, true]);
+});
+
+test('block makes other threads wait instead of dropping', async () => {
+  const seen = [];
+  host.hostSetQueueLimit('limit.block', 1, kOverflowBlock);
+  bus.on('limit.block', (n) => seen.push(n));
+  const accepted = await new Promise((resolve) => host.hostEmitFromThread('limit.block', '[]', 50, resolve));
+  await turns(2);
+  assert.strictEqual(accepted, 50);
+  assert.deepStrictEqual(seen, Array.from({ length: 50 }, (_, i) => i));
+});
+
+test('a limit of 0 removes the bound', async () => {
+  const { seen } = await deliveredWith('limit.none', kOverflowDropNewest);
+  host.hostSetQueueLimit('limit.none', 0, kOverflowDropNewest);
+  seen.length = 0;
+  emitFive('limit.none');
+  await turns(2);
+  assert.deepStrictEqual(seen, [1, 2, 3, 4, 5]);
+});
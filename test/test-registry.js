@@ -0,0 +1,34 @@
+'use strict';
+// Handlers are published through a copy-on-write registry that emitting
+// threads cache; a removed handler must not outlive off() in that cache.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+test('emits see handlers added and removed in between', async () => {
+  const first = host.hostOn('registry.swap');
+  bus.emit('registry.swap', 1);
+  await turns(2);
+  const second = host.hostOn('registry.swap');
+  bus.emit('registry.swap', 2);
+  await turns(2);
+  host.hostOff(first);
+  bus.emit('registry.swap', 3);
+  await turns(2);
+  host.hostOff(second);
+  bus.emit('registry.swap', 4);
+  await turns(2);
+  assert.deepStrictEqual(received().map(([, args]) => args[0]), [1, 2, 2, 3]);
+});
+
+test('an idle emitting thread does not keep removed handlers alive', async () => {
+  const before = host.liveHandlers();
+  const id = host.hostOn('registry.idle');
+  assert.strictEqual(host.liveHandlers(), before + 1);
+  // Caches the registry holding the handler on this thread
+  bus.emit('registry.idle', 1);
+  await turns(2);
+  received();
+
+  assert.strictEqual(host.hostOff(id), true);
+  assert.strictEqual(host.liveHandlers(), before);
+});
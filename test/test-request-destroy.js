@@ -0,0 +1,24 @@
+'use strict';
+// Destroying the bus fails its pending requests, so their timers never
+// reach back into the freed bus.
+const assert = require('assert');
+const { host, bus, test } = require('./common');
+
+test('pending host requests fail with ECANCELED when the bus goes away', async () => {
+  bus.onRequest('destroy.never', () => new Promise(() => {}));
+  const results = [];
+  host.hostRequest('destroy.never', '[1]', 20, (json, isThrow) => results.push([JSON.parse(json), isThrow]));
+  host.hostRequest('destroy.never', '[2]', 0, (json, isThrow) => results.push([JSON.parse(json), isThrow]));
+  await new Promise((resolve) => setImmediate(resolve));
+
+  host.destroyBus();
+  assert.strictEqual(results.length, 2);
+  for (const [error, isThrow] of results) {
+    assert.strictEqual(isThrow, true);
+    assert.strictEqual(error.code, 'ECANCELED');
+  }
+
+  // Past the first request's timeout: its timer must stay quiet
+  await new Promise((resolve) => setTimeout(resolve, 50));
+  assert.strictEqual(results.length, 2);
+});
@@ -0,0 +1,30 @@
+'use strict';
+// request() from JS: promises settled by host and JS handlers.
+const assert = require('assert');
+const { host, bus, test } = require('./common');
+
+test('a host handler resolves the promise', async () => {
+  host.hostOnRequest('js.echo', false);
+  assert.deepStrictEqual(await bus.request('js.echo', 1, 'two', { three: [3] }), [1, 'two', { three: [3] }]);
+});
+
+test('a host handler answering as thrown rejects the promise', async () => {
+  host.hostOnRequest('js.fail', true);
+  await assert.rejects(bus.request('js.fail', 'why'), (reason) => {
+    assert.deepStrictEqual(reason, ['why']);
+    return true;
+  });
+});
+
+test('a JS handler on the same loop answers', async () => {
+  bus.onRequest('js.double', (n) => Promise.resolve(n * 2));
+  assert.strictEqual(await bus.request('js.double', 21), 42);
+});
+
+test('an unknown key rejects with ENOFUNC', async () => {
+  await assert.rejects(bus.request('js.none'), { code: 'ENOFUNC' });
+});
+
+test('a non-string key throws', () => {
+  assert.throws(() => bus.request(1), /key must be a string/);
+});
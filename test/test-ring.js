@@ -0,0 +1,82 @@
+'use strict';
+// Shared-memory rings written by the host and read by JS.
+const assert = require('assert');
+const { host, bus, test, turns } = require('./common');
+
+const kWriteOffset = 0;
+const kReadOffset = 64;
+const kWaiting = 128;
+const kWrapMarker = 0xffffffff;
+
+// Reads every record written so far, then asks to be woken for the next one
+function consume(ring, records) {
+  const counters = new Int32Array(ring.buffer, 0, ring.dataOffset / 4);
+  const view = new DataView(ring.buffer, ring.dataOffset, ring.capacity);
+  const bytes = new Uint8Array(ring.buffer, ring.dataOffset, ring.capacity);
+  for (;;) {
+    let read = Atomics.load(counters, kReadOffset / 4) >>> 0;
+    while (read !== Atomics.load(counters, kWriteOffset / 4) >>> 0) {
+      let at = read & (ring.capacity - 1);
+      const length = view.getUint32(at, true);
+      if (length === kWrapMarker) {
+        read = (read + ring.capacity - at) >>> 0;
+        continue;
+      }
+      at += 4;
+      records.push(Buffer.from(bytes.slice(at, at + length)).toString());
+      read = (read + 4 + ((length + 3) & ~3)) >>> 0;
+    }
+    Atomics.store(counters, kReadOffset / 4, read | 0);
+    Atomics.store(counters, kWaiting / 4, 1);
+    if (Atomics.load(counters, kWriteOffset / 4) === Atomics.load(counters, kReadOffset / 4)) {
+      return;
+    }
+  }
+}
+
+test('records written before and after attaching are read in order', async () => {
+  assert.strictEqual(host.hostCreateRing('ring.order', 100), 128);
+  host.hostRingWrite('ring.order', 'first');
+  const ring = bus.openRing('ring.order');
+  assert.strictEqual(ring.capacity, 128);
+  const records = [];
+  ring.onreadable = () => consume(ring, records);
+  await turns(2);
+  assert.deepStrictEqual(records, ['first']);
+  for (let i = 0; i < 20; i++) {
+    // 12 bytes a record: wraps around the 128 byte ring
+    assert.strictEqual(host.hostRingWrite('ring.order', `rec-${i}`.padEnd(8, '.')), true);
+    await turns(2);
+  }
+  assert.deepStrictEqual(records.slice(1), Array.from({ length: 20 }, (_, i) => `rec-${i}`.padEnd(8, '.')));
+  host.hostDropRing('ring.order');
+});
+
+test('a full ring refuses records until the consumer reads', async () => {
+  host.hostCreateRing('ring.full', 64);
+  const ring = bus.openRing('ring.full');
+  let written = 0;
+  while (host.hostRingWrite('ring.full', 'x'.repeat(12))) {
+    written++;
+  }
+  assert.strictEqual(written, 4);
+  const records = [];
+  consume(ring, records);
+  assert.strictEqual(records.length, 4);
+  assert.strictEqual(host.hostRingWrite('ring.full', 'y'), true);
+  host.hostDropRing('ring.full');
+});
+
+test('a ring takes one consumer', () => {
+  host.hostCreateRing('ring.one', 64);
+  bus.openRing('ring.one');
+  assert.throws(() => bus.openRing('ring.one'), /already has a consumer/);
+  host.hostDropRing('ring.one');
+});
+
+test('opening an unknown ring names the key', () => {
+  assert.throws(() => bus.openRing('ring.none'), {
+    code: 'ENOENT',
+    message: 'No ring created for key: ring.none',
+  });
+});
@@ -0,0 +1,29 @@
+'use strict';
+// JS emits with only same-isolate listeners hand over the values themselves.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+test('listeners on the emitting isolate get the same values', async () => {
+  const seen = [];
+  bus.on('same.values', (...args) => seen.push(args));
+  const object = { nested: [1] };
+  const fn = () => 1;
+  bus.emit('same.values', object, fn, undefined);
+  await turns(2);
+  assert.strictEqual(seen.length, 1);
+  assert.strictEqual(seen[0][0], object);
+  assert.strictEqual(seen[0][1], fn);
+  assert.strictEqual(seen[0].length, 3);
+});
+
+test('a host listener makes the emit go through JSON', async () => {
+  const seen = [];
+  bus.on('same.host', (value) => seen.push(value));
+  host.hostOn('same.host');
+  const object = { n: 1 };
+  bus.emit('same.host', object);
+  await turns(2);
+  assert.notStrictEqual(seen[0], object);
+  assert.deepStrictEqual(seen[0], object);
+  assert.deepStrictEqual(received(), [['same.host', [{ n: 1 }]]]);
+});
@@ -0,0 +1,93 @@
+'use strict';
+// Schema channels: records between host code and JS without a JSON DOM,
+// and the limits of JS to JSON conversion.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+host.hostSetSchema('progress');
+
+test('JS listeners get host records as objects in schema order', async () => {
+  const seen = [];
+  bus.on('progress', (progress) => seen.push(progress));
+  assert.strictEqual(host.hostEmitRecord('progress', 7, 1024, 0.5, true, 'copy'), true);
+  await turns(2);
+  assert.strictEqual(seen.length, 1);
+  assert.deepStrictEqual(Object.keys(seen[0]), ['id', 'bytes', 'ratio', 'done', 'name']);
+  assert.deepStrictEqual(seen[0], { id: 7, bytes: 1024, ratio: 0.5, done: true, name: 'copy' });
+});
+
+test('int64 fields past the int32 range arrive as BigInt', async () => {
+  const seen = [];
+  bus.on('progress.big', (progress) => seen.push(progress.bytes));
+  host.hostSetSchema('progress.big');
+  host.hostEmitRecord('progress.big', 1, 2 ** 40, 0, false, '');
+  await turns(2);
+  assert.deepStrictEqual(seen, [BigInt(2 ** 40)]);
+});
+
+test('a JS emit of one object reaches onRecord listeners as the struct', async () => {
+  host.hostSetSchema('progress.js');
+  host.hostOnRecord('progress.js');
+  bus.emit('progress.js', { id: 3, bytes: 10, ratio: 0.25, done: false, name: 'js' });
+  await turns(2);
+  assert.deepStrictEqual(received(), [
+    ['progress.js', { id: 3, bytes: 10, ratio: 0.25, done: false, name: 'js' }],
+  ]);
+});
+
+test('missing and mistyped properties keep their defaults', async () => {
+  host.hostSetSchema('progress.partial');
+  host.hostOnRecord('progress.partial');
+  bus.emit('progress.partial', { id: 'nine', name: 'partial' });
+  await turns(2);
+  assert.deepStrictEqual(received(), [
+    ['progress.partial', { id: 0, bytes: 0, ratio: 0, done: false, name: 'partial' }],
+  ]);
+});
+
+test('JSON listeners on a schema channel still get the arguments', async () => {
+  host.hostSetSchema('progress.json');
+  host.hostOn('progress.json');
+  host.hostEmitRecord('progress.json', 5, 6, 0.75, true, 'json');
+  await turns(2);
+  assert.deepStrictEqual(received(), [
+    ['progress.json', [{ id: 5, bytes: 6, ratio: 0.75, done: true, name: 'json' }]],
+  ]);
+});
+
+test('emitRecord on a key without a schema delivers nothing', async () => {
+  host.hostOn('progress.none');
+  assert.strictEqual(host.hostEmitRecord('progress.none', 1, 1, 1, true, ''), false);
+  await turns(2);
+  assert.deepStrictEqual(received(), []);
+});
+
+test('cyclic arguments for host listeners throw a TypeError', () => {
+  host.hostOn('cyclic');
+  const cyclic = { name: 'loop' };
+  cyclic.self = cyclic;
+  assert.throws(() => bus.emit('cyclic', cyclic), TypeError);
+});
+
+test('arguments past the depth and value limits throw a TypeError', async () => {
+  host.hostOn('limits');
+  host.hostSetJsonLimits(3, 0);
+  try {
+    assert.strictEqual(bus.emit('limits', { a: { b: 1 } }), true);
+    assert.throws(() => bus.emit('limits', { a: { b: { c: { d: 1 } } } }), TypeError);
+    host.hostSetJsonLimits(0, 5);
+    assert.strictEqual(bus.emit('limits', [1, 2]), true);
+    assert.throws(() => bus.emit('limits', [1, 2, 3, 4, 5, 6, 7, 8]), TypeError);
+  } finally {
+    host.hostSetJsonLimits(0, 0);
+  }
+  await turns(2);
+  assert.deepStrictEqual(received(), [['limits', [{ a: { b: 1 } }]], ['limits', [[1, 2]]]]);
+});
+
+test('Maps, Sets, Dates and BigInts are converted', async () => {
+  host.hostOn('converted');
+  bus.emit('converted', new Map([['k', 1]]), new Set([2, 3]), new Date(86400000), BigInt(4));
+  await turns(2);
+  assert.deepStrictEqual(received(), [['converted', [{ k: 1 }, [2, 3], 86400000, 4]]]);
+});
@@ -0,0 +1,81 @@
+'use strict';
+// Streams between JS writers and readers on one loop.
+const assert = require('assert');
+const { bus, test, turns } = require('./common');
+
+function bytes(buffer) {
+  return Array.from(new Uint8Array(buffer));
+}
+
+test('chunks arrive in order, then the end', async () => {
+  const events = [];
+  bus.onStream('stream.order', (reader) => {
+    reader.ondata = (chunk) => events.push(bytes(chunk));
+    reader.onend = () => events.push('end');
+  });
+  const writer = bus.openStream('stream.order');
+  const chunk = new Uint8Array([1, 2]);
+  writer.write(chunk);
+  // write() copied it
+  chunk[0] = 9;
+  writer.write(new Uint8Array([3]).buffer);
+  writer.end();
+  await turns(4);
+  assert.deepStrictEqual(events, [[1, 2], [3], 'end']);
+});
+
+test('a paused reader holds back credit until resume()', async () => {
+  let reader;
+  const received = [];
+  bus.onStream('stream.window', (r) => {
+    reader = r;
+    reader.pause();
+    reader.ondata = (chunk) => received.push(bytes(chunk));
+  });
+  const writer = bus.openStream('stream.window', 2);
+  let drained = 0;
+  writer.ondrain = () => drained++;
+  assert.strictEqual(writer.write(new Uint8Array([1])), true);
+  assert.strictEqual(writer.write(new Uint8Array([2])), false);
+  await turns(4);
+  assert.deepStrictEqual(received, [[1], [2]]);
+  assert.strictEqual(drained, 0);
+  reader.resume();
+  await turns(4);
+  assert.strictEqual(drained, 1);
+  assert.strictEqual(writer.write(new Uint8Array([3])), true);
+  writer.end();
+});
+
+test('aborting the reader reaches the writer', async () => {
+  let reader;
+  bus.onStream('stream.abort', (r) => {
+    reader = r;
+  });
+  const writer = bus.openStream('stream.abort');
+  let reason;
+  writer.onabort = (r) => {
+    reason = r;
+  };
+  writer.write(new Uint8Array([1]));
+  await turns(2);
+  reader.abort('stop');
+  await turns(4);
+  assert.strictEqual(reason, 'stop');
+  assert.strictEqual(writer.write(new Uint8Array([2])), false);
+});
+
+test('stream methods refuse other objects', () => {
+  bus.onStream('stream.this', () => {});
+  const writer = bus.openStream('stream.this');
+  assert.throws(() => writer.write.call(bus, new Uint8Array([1])), /Not a stream/);
+  assert.throws(() => writer.abort.call({}, 'x'), /Not a stream/);
+  writer.end();
+});
+
+test('opening a stream without a handler names the key', () => {
+  assert.throws(() => bus.openStream('stream.none'), {
+    code: 'ENOFUNC',
+    message: 'No stream handler registered for key: stream.none',
+  });
+});
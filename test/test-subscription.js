@@ -0,0 +1,57 @@
+'use strict';
+// on() ids, once() and off() from JS.
+const assert = require('assert');
+const { host, bus, test, turns } = require('./common');
+
+test('off(id) removes one subscription', async () => {
+  const seen = [];
+  const first = bus.on('sub.id', (n) => seen.push(`first ${n}`));
+  const second = bus.on('sub.id', (n) => seen.push(`second ${n}`));
+  assert.notStrictEqual(first, second);
+  host.hostEmit('sub.id', '[1]');
+  await turns(2);
+  assert.strictEqual(bus.off(first), true);
+  assert.strictEqual(bus.off(first), false);
+  host.hostEmit('sub.id', '[2]');
+  await turns(2);
+  bus.off(second);
+  assert.deepStrictEqual(seen, ['first 1', 'second 1', 'second 2']);
+});
+
+test('off(key, fn) removes that function', async () => {
+  const seen = [];
+  const fn = (n) => seen.push(n);
+  bus.on('sub.fn', fn);
+  bus.on('sub.fn', () => seen.push('other'));
+  assert.strictEqual(bus.off('sub.fn', fn), true);
+  host.hostEmit('sub.fn', '[1]');
+  await turns(2);
+  assert.deepStrictEqual(seen, ['other']);
+});
+
+test('once() runs for the first event only', async () => {
+  const seen = [];
+  bus.once('sub.once', (n) => seen.push(n));
+  host.hostEmit('sub.once', '[1]');
+  host.hostEmit('sub.once', '[2]');
+  await turns(2);
+  host.hostEmit('sub.once', '[3]');
+  await turns(2);
+  assert.deepStrictEqual(seen, [1]);
+});
+
+test('an off() before delivery drops queued events', async () => {
+  const seen = [];
+  const id = bus.on('sub.queued', (n) => seen.push(n));
+  host.hostEmit('sub.queued', '[1]');
+  bus.off(id);
+  await turns(2);
+  assert.deepStrictEqual(seen, []);
+});
+
+test('host listeners are freed by off()', () => {
+  const before = host.liveHandlers();
+  const id = host.hostOn('sub.host');
+  assert.strictEqual(host.hostOff(id), true);
+  assert.strictEqual(host.liveHandlers(), before);
+});
@@ -0,0 +1,69 @@
+'use strict';
+// emitBinary() transfer and pin lists, and host memory lent to JS.
+const assert = require('assert');
+const v8 = require('v8');
+const vm = require('vm');
+const { host, bus, test, turns } = require('./common');
+
+v8.setFlagsFromString('--expose-gc');
+const gc = vm.runInNewContext('gc');
+const major = Number(process.versions.node.split('.')[0]);
+
+function collect(key) {
+  const values = [];
+  bus.on(key, (value) => values.push(value));
+  return values;
+}
+
+test('transferred buffers are detached from the sender', async () => {
+  const values = collect('xfer.detach');
+  const buffer = new Uint8Array([1, 2, 3]).buffer;
+  assert.strictEqual(bus.emitBinary('xfer.detach', { buffer }, [buffer]), true);
+  assert.strictEqual(buffer.byteLength, 0);
+  await turns(2);
+  assert.deepStrictEqual(Array.from(new Uint8Array(values[0].buffer)), [1, 2, 3]);
+});
+
+test('pinned buffers stay with the sender', async () => {
+  const values = collect('xfer.pin');
+  const buffer = new Uint8Array([4, 5]).buffer;
+  bus.emitBinary('xfer.pin', { buffer }, [], [buffer]);
+  assert.strictEqual(buffer.byteLength, 2);
+  await turns(2);
+  assert.deepStrictEqual(Array.from(new Uint8Array(values[0].buffer)), [4, 5]);
+  new Uint8Array(buffer)[0] = 9;
+  // Shared without a copy where the backing store can be pinned
+  assert.strictEqual(new Uint8Array(values[0].buffer)[0], major >= 14 ? 9 : 4);
+});
+
+test('a delivered buffer can be sent on again', async () => {
+  const values = collect('xfer.again');
+  const buffer = new Uint8Array([7, 8]).buffer;
+  bus.emitBinary('xfer.again', buffer, [], [buffer]);
+  await turns(2);
+  const pinned = values[0];
+  bus.emitBinary('xfer.again', pinned, [], [pinned]);
+  bus.emitBinary('xfer.again', pinned, [pinned]);
+  assert.strictEqual(pinned.byteLength, 0);
+  await turns(2);
+  assert.deepStrictEqual(values.slice(1).map((value) => Array.from(new Uint8Array(value))), [[7, 8], [7, 8]]);
+});
+
+test('host memory reaches every listener and is released after them', async () => {
+  const first = collect('xfer.host');
+  const second = collect('xfer.host');
+  assert.strictEqual(host.hostEmitBuffer('xfer.host', [1, 2, 3, 4]), true);
+  await turns(2);
+  assert.deepStrictEqual(Array.from(new Uint8Array(first[0])), [1, 2, 3, 4]);
+  assert.deepStrictEqual(Array.from(new Uint8Array(second[0])), [1, 2, 3, 4]);
+  // Both wrap the same host memory; sending both on must not clash
+  bus.emitBinary('xfer.host.back', first[0], [], [first[0]]);
+  bus.emitBinary('xfer.host.back', second[0], [second[0]]);
+  first.length = 0;
+  second.length = 0;
+  for (let i = 0; i < 10 && host.liveBuffers() > 0; i++) {
+    await turns(2);
+    gc();
+  }
+  assert.strictEqual(host.liveBuffers(), 0);
+});
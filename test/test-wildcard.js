@@ -0,0 +1,50 @@
+'use strict';
+// Topic patterns: '*'/'+' match one segment, a trailing '#'/'**' the rest.
+const assert = require('assert');
+const { host, bus, test, turns, received } = require('./common');
+
+async function matches(pattern, topics) {
+  const seen = [];
+  const id = bus.on(pattern, (topic) => seen.push(topic));
+  for (const topic of topics) {
+    host.hostEmit(topic, JSON.stringify([topic]));
+  }
+  await turns(2);
+  bus.off(id);
+  return seen;
+}
+
+test('one-segment wildcards', async () => {
+  const topics = ['wild.a', 'wild.a.b', 'wild', 'wild.b'];
+  assert.deepStrictEqual(await matches('wild.*', topics), ['wild.a', 'wild.b']);
+  assert.deepStrictEqual(await matches('wild.+', topics), ['wild.a', 'wild.b']);
+});
+
+test('trailing wildcards match the remaining segments, if any', async () => {
+  const topics = ['deep.a', 'deep.a.b.c', 'deep', 'deeper.a'];
+  assert.deepStrictEqual(await matches('deep.#', topics), ['deep.a', 'deep.a.b.c', 'deep']);
+  assert.deepStrictEqual(await matches('deep.**', topics), ['deep.a', 'deep.a.b.c', 'deep']);
+});
+
+test('slashes separate segments too', async () => {
+  const topics = ['ui/main/click', 'ui/main/hover', 'ui/click'];
+  assert.deepStrictEqual(await matches('ui/+/click', topics), ['ui/main/click']);
+});
+
+test('a listener runs once per matching subscription', async () => {
+  const seen = [];
+  bus.on('multi.*', () => seen.push('star'));
+  bus.on('multi.#', () => seen.push('hash'));
+  bus.on('multi.x', () => seen.push('exact'));
+  host.hostEmit('multi.x', '[]');
+  await turns(2);
+  assert.deepStrictEqual(seen.sort(), ['exact', 'hash', 'star']);
+});
+
+test('host listeners and JS emits match patterns', async () => {
+  host.hostOn('hostwild.*.end');
+  bus.emit('hostwild.mid.end', 1);
+  bus.emit('hostwild.end', 2);
+  await turns(2);
+  assert.deepStrictEqual(received(), [['hostwild.*.end', [1]]]);
+});
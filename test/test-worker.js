@@ -0,0 +1,74 @@
+'use strict';
+// Worker threads reach the bus through the linked binding.
+const assert = require('assert');
+const { host, bus, test, received } = require('./common');
+
+const linked = typeof host.hostLinkToEnvironment === 'function';
+let Worker;
+try {
+  ({ Worker } = require('worker_threads'));
+} catch (err) {
+  // Node 10 without --experimental-worker
+}
+
+function startWorker(source) {
+  const worker = new Worker(`
+    const { parentPort } = require('worker_threads');
+    const bus = process._linkedBinding('app_bus_test');
+    // Bus listeners do not keep a loop alive
+    setInterval(() => {}, 1000);
+    ${source}
+  `, { eval: true });
+  return new Promise((resolve, reject) => {
+    worker.once('error', reject);
+    worker.once('message', () => resolve(worker));
+  });
+}
+
+function exited(worker) {
+  return new Promise((resolve) => worker.once('exit', resolve));
+}
+
+if (linked && Worker) {
+  host.hostLinkToEnvironment('app_bus_test');
+
+  test('the main thread gets a bus object as well', () => {
+    assert.strictEqual(typeof process._linkedBinding('app_bus_test').emit, 'function');
+  });
+
+  test('events cross between the main thread and a worker', async () => {
+    const worker = await startWorker(`
+      bus.on('worker.ping', (n) => bus.emit('worker.pong', n + 1));
+      parentPort.postMessage('ready');
+    `);
+    const seen = [];
+    bus.on('worker.pong', (n) => seen.push(n));
+    host.hostOn('worker.pong');
+    bus.emit('worker.ping', 1);
+    for (let i = 0; i < 100 && seen.length === 0; i++) {
+      await new Promise((resolve) => setTimeout(resolve, 10));
+    }
+    assert.deepStrictEqual(seen, [2]);
+    assert.deepStrictEqual(received(), [['worker.pong', [2]]]);
+    await Promise.all([exited(worker), worker.terminate()]);
+  });
+
+  test('a worker answers requests from the main thread', async () => {
+    const worker = await startWorker(`
+      bus.onRequest('worker.double', (n) => n * 2);
+      parentPort.postMessage('ready');
+    `);
+    assert.strictEqual(await bus.request('worker.double', 21), 42);
+    await Promise.all([exited(worker), worker.terminate()]);
+  });
+
+  test('handlers of a worker are removed when it exits', async () => {
+    const worker = await startWorker(`
+      bus.onRequest('worker.gone', () => 'here');
+      parentPort.postMessage('ready');
+    `);
+    assert.strictEqual(await bus.request('worker.gone'), 'here');
+    await Promise.all([exited(worker), worker.terminate()]);
+    await assert.rejects(bus.request('worker.gone'), { code: 'ENOFUNC' });
+  });
+}